@@ -8,6 +8,7 @@
 
 #include "ros/ros.h"
 #include "ros/time.h"
+#include "ros/callback_queue.h"
 #include "sensor_msgs/LaserScan.h"
 #include "visualization_msgs/Marker.h"
 #include "geometry_msgs/Point.h"
@@ -17,9 +18,25 @@
 #include <cmath>
 #include "nav_msgs/Odometry.h"
 #include <tf/transform_datatypes.h>
+#include <tf/transform_broadcaster.h>
 #include "std_msgs/Float32.h"
 #include "nav_msgs/GetMap.h"
 #include "nav_msgs/SetMap.h"
+#include "localization_map.h"
+#include "scan_matcher.h"
+#include "particle_filter.h"
+#include "triple_buffer.h"
+#include "scan_reduction.h"
+#include "place_index.h"
+#include "scan_odometry.h"
+#include "lru_cache.h"
+#include "work_stealing_pool.h"
+#include "odometry_buffer.h"
+#include "map_overlay.h"
+#include "range_table.h"
+#include <thread>
+#include <memory>
+#include <mutex>
 
 using namespace std;
 
@@ -27,10 +44,84 @@ using namespace std;
 #define distance_to_travel 1.0
 #define angle_to_travel 20.0
 
+#define map_package "" // map package written by map_compiler, mapped at startup instead of requesting and preprocessing the map of the map_server
+#define map_huge_pages false // ask for huge pages for the mapped package
+
+#define hit_uncertainty 0.05 // a hit is considered as an obstacle if it is at less than hit_uncertainty (in meters) from an occupied cell
+#define likelihood_mode false // score the positions with the sum of the likelihoods of the hits instead of the number of hits
+#define position_resolution 0.05 // in meters, step of the positions tested by find_best_position
+#define use_branch_and_bound true // search the best position coarse to fine instead of testing all the positions
+#define search_threads 4 // number of threads sharing each search, jobs of the pool in the fleet service
+#define use_simd true // use the AVX2 sensor model when the processor supports it
+#define correlative_matching true // rotate the scan once per orientation and translate it cell by cell, instead of computing the hits of each position
+#define search_deadline 0.02 // in seconds, the search of estimate_position returns the best position found so far after this time, 0 to search the whole window
+#define refine_position true // refine the position found by the search continuously, below the steps of the search
+#define scan_drop_invalid true // the beams without echo are not used by the search
+#define scan_voxel_size 0 // in meters, the search uses one beam per square of scan_voxel_size x scan_voxel_size, 0 to use all the beams
+#define scan_informative_beams 120 // if not 0, the search uses at most this number of beams, chosen to constrain every direction
+
+#define particle_filter_mode false // track the position with a particle filter instead of searching around the predicted position
+#define particle_distance_to_travel 0.1 // the particle filter is updated after these small motions
+#define particle_angle_to_travel 5.0 // in degrees
+#define particle_initial_spread 0.1 // in meters, spread of the particles around the position found by initialize_localization
+#define particle_initial_angle 5.0 // in degrees
+
+#define scan_odometry_prediction true // predict the position with the motion measured by matching consecutive scans instead of the motion of the wheels
+
+#define window_sigmas 3.0 // the window searched by estimate_position and by the worker covers this number of standard deviations of the predicted position
+#define window_min 0.05 // in meters, bounds of the half size of the window, the scans are paired with the odometry of their time
+#define window_max 1.0
+#define window_min_angle 5.0 // in degrees, bounds of the half range of its orientations
+#define window_max_angle 60.0
+#define wheel_translation_noise 0.15 // standard deviation of the motion measured by the wheels: meters per meter
+#define wheel_rotation_noise 0.2 // radians per radian
+#define wheel_rotation_translation_noise 0.1 // radians per meter
+#define scan_translation_noise 0.03 // same for the motion measured by the scans
+#define scan_rotation_noise 0.03
+#define scan_rotation_translation_noise 0.02
+
+#define stationary_change 0.02 // in meters, an update is skipped if the root mean square change of the ranges since the last update is below this value,
+#define stationary_flipped_beams 0.02 // and at most this fraction of the beams gained or lost their echo
+#define search_memo_size 32 // number of recent searches whose results are kept
+
+#define map_overlay_update true // learn the changes of the map from the scans of well localized positions, and use them in the sensor model and in the searches
+#define overlay_min_score 0.7 // score per beam above which a position is well localized enough to update the overlay
+#define overlay_update_period 1.0 // in seconds, a well localized scan updates the overlay at most this often, and the searches score the changes published then
+
+#define beam_model false // score the positions with the beam model (the searches rescore their best positions of the hits with it): each range is compared with the range expected from the position, read in the range table of the map
+#define beam_sigma 0.1 // standard deviation (in meters) of a range around the expected range
+#define beam_hit_weight 0.7 // a range of the beam model is the expected range with noise,
+#define beam_short_weight 0.2 // or a shorter range, stopped by an obstacle that is not in the map,
+#define beam_random_weight 0.1 // or a random range
+#define beam_short_rate 0.5 // per meter, rate of the exponential distribution of the ranges stopped by obstacles that are not in the map
+#define free_space_score false // the sensor model and the searches also score the beams without echo along which the map is free up to the range of the laser
+#define range_table_file "" // range table written by map_compiler with its package (map.package.ranges), mapped at startup (the node never builds it), "" without the beam model and the free space score
+
+#define place_index_file "" // index written by place_indexer, used to relocalize the robot in the whole map when it is lost, "" for none
+#define relocalization_candidates 20 // places of the index around which the position is searched
+#define lost_score 0.3 // score per beam under which the robot is considered lost
+
+#define pose_checkpoint "localization_pose.txt" // file where the estimated position is saved, a relative file is in $ROS_HOME (~/.ros by default), "" to never save it
+#define checkpoint_period 1.0 // in seconds, period of the saves of the estimated position
+#define warm_start_distance 0.3 // in meters, at startup the position is searched in a square of 2*warm_start_distance around the saved position
+#define warm_start_angle 15.0 // in degrees, and with orientations at less than warm_start_angle from the saved orientation
+#define warm_start_min_score 0.6 // score per beam under which the saved position is rejected and the position is searched in the whole map
+
+#define asynchronous_matching true // search the position in a worker thread and publish the position dead-reckoned with the odometry meanwhile
+#define odometry_rate 50 // in hz, rate of the main loop in asynchronous mode, so that each odometry message is published
+#define odometry_buffer_size 64 // odometry messages kept to get the odometry at the time of each scan, 1.3 s at 50 hz
+#define odometry_max_extrapolation 0.05 // in seconds, a scan taken after the last odometry message is paired with the odometry extrapolated up to this time
+
+#define fleet_size 4 // number of robots localized by localization_fleet_node, if not given on its command line
+#define fleet_namespace "robot_" // the topics and the frames of robot i are in the namespace robot_i
+#define fleet_threads 0 // threads of the pool shared by the robots of the fleet, 0 for one thread per core
+
 class localization
 {
 
 private:
+    // fleet service: the callbacks of the robot are called by its updates, in the pool
+    ros::CallbackQueue callbacks;
     ros::NodeHandle n;
 
     ros::Subscriber sub_scan;
@@ -49,11 +140,108 @@ private:
     bool valid[1000];
 
     //to store the map
-    nav_msgs::GetMap::Response resp;
     geometry_msgs::Point min, max;
     float cell_size;
     int width_max;
     int height_max;
+    // the map of the node, or the map shared by all the robots of the fleet service
+    localization_map own_grid;
+    const localization_map& grid;
+    // changes of the map seen by this robot, only updated by the thread that searches
+    // (the worker, or the matching jobs of the robot, in asynchronous mode, and the main loop otherwise)
+    map_overlay overlay;
+    ros::WallTime last_overlay_update;
+    // sure changes published by the overlay, scored by the searches and by the sensor model over the map: the searches converge again after the furniture moved
+    // each reader keeps the layer it copied under layer_lock, the next layer shares the blocks that did not change
+    mutex layer_lock;
+    shared_ptr<const overlay_layer> layer;
+
+    // motion measured by matching consecutive scans, and its pose at the last estimate
+    scan_odometry scan_motion;
+    float scan_last_x, scan_last_y, scan_last_orientation;
+    bool predicted_from_scans;
+
+    // uncertainty on the position: standard deviations of the estimated position, from the curvature of the score around it,
+    // grown by the motion until the next estimate; they size the window searched by estimate_position
+    float position_deviation;
+    float orientation_deviation;
+
+    // scan and position of the last update: the robot has not moved while the scan stays the same
+    int reference_nb_beams;
+    float reference_r[1000];
+    bool reference_valid[1000];
+    geometry_msgs::Point reference_position;
+    float reference_orientation;
+    // odometry of the reference scan: a position found by the worker for an earlier scan also corrects the reference position
+    geometry_msgs::Point reference_odom;
+    float reference_odom_orientation;
+
+    // results of the recent searches, by scan and window
+    struct memoized_search
+    {
+        search_result best;
+        int nb_search_beams;
+        float position_deviation, orientation_deviation;
+    };
+    lru_cache<uint64_t, memoized_search> search_memo;
+    // same for the searches of the worker, only used by the worker (or the matching jobs of the robot, which never overlap)
+    lru_cache<uint64_t, memoized_search> worker_memo;
+
+    // matchers of the robot, kept from one search to the next: one for the main loop, one for the worker or the matching jobs
+    unique_ptr<scan_matcher> search_matcher;
+    unique_ptr<scan_matcher> worker_matcher;
+
+    // places of the map for the relocalization, of the node or shared by the fleet
+    place_index own_places;
+    const place_index& places;
+    bool places_loaded;
+
+    // ranges expected in the map, for the beam model and the free space score, of the node or shared by the fleet
+    range_table own_ranges;
+    const range_table& ranges;
+
+    // fleet service: the updates and the searches of the robot are jobs of the pool shared by the robots, null for a single robot
+    // a robot has at most one update and one search in the pool at a time
+    work_stealing_pool* pool;
+    atomic<bool> update_scheduled;
+    atomic<int> pending_matchings;
+    string odom_frame;
+    string checkpoint_file;
+
+    // particles of the particle filter mode
+    particle_filter filter;
+
+    // asynchronous mode: the worker searches the position of the latest scan while the main loop publishes
+    // the odometry corrected by the last position found, ie the transform from the map to the odometry frame
+    struct scan_snapshot
+    {
+        int nb_beams;
+        float r[1000], theta[1000];
+        bool valid[1000];
+        float odom_x, odom_y, odom_orientation; // odometry when the scan was taken
+        float scan_x, scan_y, scan_orientation; // pose of the scan odometry when the scan was taken
+        float predicted_x, predicted_y, predicted_orientation;
+        // half size of the window searched around the predicted position, and its step of orientation
+        float window, angle_window, angle_step;
+        float range_max; // range of the beams without echo
+    };
+    struct position_correction
+    {
+        bool found;
+        float x, y, orientation;
+        float odom_x, odom_y, odom_orientation; // odometry when the scan was taken
+        float scan_x, scan_y, scan_orientation; // pose of the scan odometry when the scan was taken
+        // uncertainty on the position found
+        float position_deviation, orientation_deviation;
+    };
+    triple_buffer<scan_snapshot> scans;
+    triple_buffer<position_correction> corrections;
+    thread worker;
+    atomic<bool> worker_stop;
+    tf::Transform map_to_odom;
+    // same for the frame of the scan odometry, from which the worker predicts the position of the next scan
+    tf::Transform map_to_scan;
+    tf::TransformBroadcaster broadcaster;
 
     // GRAPHICAL DISPLAY
     int nb_pts;
@@ -65,6 +253,10 @@ private:
     float odom_current_orientation;
     geometry_msgs::Point odom_last;
     float odom_last_orientation;
+    // last odometry messages, and the odometry interpolated at the time of the current scan, to which the scan is compared
+    odometry_buffer<odometry_buffer_size> odometry;
+    geometry_msgs::Point odom_scan;
+    float odom_scan_orientation;
 
     //to store the initial_position of the mobile robot
     bool init_position;
@@ -72,6 +264,12 @@ private:
     geometry_msgs::Point initial_position;
     float initial_orientation;
 
+    // position saved by the previous run of the node, used instead of the initial pose
+    bool warm_start;
+    ros::WallTime last_checkpoint;
+    geometry_msgs::Point checkpoint_position;
+    float checkpoint_orientation;
+
     //to store the predicted and estimated position of the mobile robot
     bool localization_initialized;
     geometry_msgs::Point predicted_position;
@@ -91,7 +289,21 @@ private:
 
 public:
 
+// node of a single robot: gets the map and processes the laser data until ros is stopped
 localization();
+// robot name of the fleet service, with the map and the places shared by the robots: its updates are run by schedule_update
+localization(const string& name, const localization_map& shared_grid, const place_index& shared_places, const range_table& shared_ranges, work_stealing_pool& shared_pool);
+~localization();
+
+// the map, from its package or from the map_server, and the place index
+static void load_map(localization_map& grid);
+static bool load_place_index(place_index& places);
+// the range table is only mapped if the beam model or the free space score use it
+static void load_range_table(const localization_map& grid, range_table& ranges);
+void setup(const string& name);
+
+// fleet service: submits the callbacks and the update of the robot to the pool, unless they are still running
+void schedule_update();
 
 //UPDATE: main processing of laser data
 /*//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -99,10 +311,36 @@ localization();
 void update(); 
 
 void initialize_localization(); 
+bool warm_start_localization();
+bool relocalize();
+void save_checkpoint();
 void predict_position(); 
 void estimate_position(); 
-void find_best_position(float min_x, float max_x, float min_y, float max_y, float min_orientation, float max_orientation); 
+void grow_deviation(float distance, float angle);
+void search_extent(float& window, float& angle_window, float& angle_step) const;
+void update_overlay(float x, float y, float o, float score, int nb_beams, const float* r, const float* theta, const bool* valid);
+shared_ptr<const overlay_layer> current_layer();
+float overlay_score();
+scan_matcher& reuse_matcher(unique_ptr<scan_matcher>& matcher);
+bool stationary() const;
+void set_reference_scan();
+void hold_position();
+static uint64_t search_key(const search_window& window, int nb_beams, const float* r, const bool* valid, unsigned int revision);
+void track_position();
+void request_matching();
+void matching_worker();
+void matching_job();
+void match_scan(scan_matcher& matcher);
+bool apply_correction();
+void publish_dead_reckoning(const ros::Time& stamp);
+// returns the score of the best position divided by the number of beams used by the search
+// the positions are tested every step meters and angle_step radians
+float find_best_position(float min_x, float max_x, float min_y, float max_y, float min_orientation, float max_orientation, float deadline = 0,
+                         float step = position_resolution, float angle_step = angle_resolution * M_PI / 180); 
 int sensor_model(float x, float y, float o);
+float sensor_likelihood(float x, float y, float o);
+float sensor_beam_model(float x, float y, float o);
+float sensor_score(float x, float y, float o);
 int cell_value(float x, float y);
 
 // Distance between two points
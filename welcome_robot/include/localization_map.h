@@ -0,0 +1,281 @@
+#pragma once
+
+#ifndef LOCALIZATION_MAP_H
+#define LOCALIZATION_MAP_H
+
+// map used by the localization
+// the occupancy grid received from the map_server is preprocessed once into a distance field
+// so that the sensor model only needs one lookup per beam
+
+#include <vector>
+#include <string>
+#include <cmath>
+#include <stdint.h>
+
+#define likelihood_sigma 0.05 // standard deviation (in meters) of a hit around an obstacle, used by the float likelihood mode
+#define distance_saturation 255 // distances to the nearest obstacle (in cells) are saturated at this value
+#define pyramid_depth 7 // number of levels of the resolution pyramid used by the branch and bound search
+#define map_tiled false // store the bit grids of the map in tiles of tile_size x tile_size cells instead of row by row
+#define tile_bits 6 // tile_size = 2^tile_bits = 64 cells, ie 512 bytes per tile
+#define map_package_version 1 // version of the binary map packages written by save_package
+
+using namespace std;
+
+// grid with 1 bit per cell, stored in 32 bit words
+// in tiled layout, the cells are stored tile by tile, and row by row inside a tile:
+// the hits of a scan, spread in every direction around the robot, touch a few tiles
+// instead of one cache line per row of the map
+struct bit_grid
+{
+    int width, height;
+    bool tiled;
+    int nb_tiles_x;
+    size_t nb_words;
+    // the words are read through bits: they are either in words, or in a mapped map package
+    const uint32_t* bits;
+    vector<uint32_t> words;
+
+bit_grid()
+{
+    width = height = nb_tiles_x = 0;
+    tiled = false;
+    nb_words = 0;
+    bits = 0;
+}
+
+void layout(int width, int height, bool tiled)
+{
+    this->width = width;
+    this->height = height;
+    this->tiled = tiled;
+    if ( tiled )
+    {
+        const int tile_size = 1 << tile_bits;
+        nb_tiles_x = ( width + tile_size - 1 ) >> tile_bits;
+        int nb_tiles_y = ( height + tile_size - 1 ) >> tile_bits;
+        nb_words = ( size_t(nb_tiles_x) * nb_tiles_y ) << ( 2 * tile_bits - 5 );
+    }
+    else
+        nb_words = (size_t(width) * height + 31) / 32;
+}
+
+// empty grid of width x height cells
+void resize(int width, int height, bool tiled)
+{
+    layout(width, height, tiled);
+    words.assign(nb_words, 0);
+    bits = &words[0];
+}
+
+// grid whose words are stored elsewhere, read only
+void attach(int width, int height, bool tiled, const uint32_t* data)
+{
+    layout(width, height, tiled);
+    vector<uint32_t>().swap(words);
+    bits = data;
+}
+
+// index of the bit of the cell (x, y)
+int index(int x, int y) const
+{
+    if ( tiled )
+    {
+        const int mask = ( 1 << tile_bits ) - 1;
+        int tile = ( y >> tile_bits ) * nb_tiles_x + ( x >> tile_bits );
+        return ( tile << ( 2 * tile_bits ) ) | ( ( y & mask ) << tile_bits ) | ( x & mask );
+    }
+    return width * y + x;
+}
+
+bool get(int x, int y) const
+{
+    int i = index(x, y);
+    return ( bits[i >> 5] >> ( i & 31 ) ) & 1;
+}
+
+void set(int x, int y)
+{
+    int i = index(x, y);
+    words[i >> 5] |= 1u << ( i & 31 );
+}
+
+size_t size() const
+{
+    return nb_words * sizeof(uint32_t);
+}
+
+};
+
+class localization_map
+{
+
+public:
+    // size and position of the map
+    int width_max;
+    int height_max;
+    float cell_size;
+    float min_x, min_y;
+    float max_x, max_y;
+
+localization_map();
+~localization_map();
+
+// layout of the bit grids built by the next load (see bit_grid)
+void set_tiled(bool tiled);
+
+// build the map and its distance field from an occupancy grid (100 = occupied, 0 = free, -1 = unknown)
+// a hit is considered as an obstacle if it is at less than uncertainty (in meters) from an occupied cell
+// the pyramid of distances needed by level_likelihood is only built if likelihood is set
+void load(int width, int height, float resolution, float origin_x, float origin_y, const int8_t* occupancy, float uncertainty, bool likelihood);
+
+// write the map and all its derived structures to a binary package, to be mapped by open_package
+bool save_package(const string& file) const;
+
+// map a package written by save_package instead of building the map: nothing is computed or copied,
+// the pages are read from the file when they are first used and are shared by all the processes that map it
+// returns false if the package cannot be read, or was not built with the same uncertainty, or without the pyramid of distances needed by likelihood
+bool open_package(const string& file, float uncertainty, bool likelihood, bool huge_pages);
+
+// returns the value of the cell corresponding to the position (x, y) in the map
+// returns 100 if cell(x, y) is occupied, 0 if cell(x, y) is free, -1 if unknown or outside the map
+int cell_value(float x, float y) const;
+
+// index of the cell corresponding to the position (x, y), returns false if (x, y) is outside the map
+bool cell_index(float x, float y, int& x_int, int& y_int) const
+{
+    float x_cell = (x - min_x) / cell_size;
+    float y_cell = (y - min_y) / cell_size;
+    if ( ( x_cell < 0 ) || ( y_cell < 0 ) )
+        return false;
+    x_int = x_cell;
+    y_int = y_cell;
+    return ( x_int < width_max ) && ( y_int < height_max );
+}
+
+// value of the cell (x_int, y_int), inside the map: 100 if occupied, 0 if free, -1 if unknown
+int cell_state(int x_int, int y_int) const
+{
+    if ( unknown.get(x_int, y_int) )
+        return -1;
+    return occupied.get(x_int, y_int) ? 100 : 0;
+}
+
+// true if the cell (x_int, y_int) is at less than uncertainty from an occupied cell
+bool cell_hit(int x_int, int y_int) const
+{
+    return hits.get(x_int, y_int);
+}
+
+// likelihood of a hit in the cell (x_int, y_int), between 0 and 1
+float cell_likelihood(int x_int, int y_int) const
+{
+    return likelihood_table[distance_cells[width_max * y_int + x_int]];
+}
+
+// likelihood of a hit at (x, y), bilinearly interpolated between the centers of the cells, and its gradient (per meter)
+// used by the continuous refinement of the position
+float interpolated_likelihood(float x, float y, float& gradient_x, float& gradient_y) const;
+
+// raw access for the vectorized kernels
+// the distance field is padded so that a 32 bit load at the index of any cell stays inside
+const uint8_t* distance_field() const
+{
+    return distance_cells;
+}
+
+const bit_grid& hit_grid() const
+{
+    return hits;
+}
+
+int hit_distance() const
+{
+    return hit_radius;
+}
+
+const float* likelihood_values() const
+{
+    return likelihood_table;
+}
+
+// number of levels of the resolution pyramid, level 0 is the map itself
+int nb_levels() const
+{
+    return pyramid_hits.size() + 1;
+}
+
+// minimum distance to an occupied cell over the block [x_int - 1, x_int + 2^level] x [y_int - 1, y_int + 2^level]
+// (level >= 1): it bounds the distance seen by a hit translated by less than 2^level cells from (x_int, y_int)
+// the margin of one cell absorbs the rounding of the position of the hits
+int level_distance(int level, int x_int, int y_int) const
+{
+    const int margin = 1 << level;
+    x_int += margin;
+    y_int += margin;
+    const int width = width_max + margin + 1;
+    if ( ( x_int < 0 ) || ( y_int < 0 ) || ( x_int >= width ) || ( y_int >= height_max + margin + 1 ) )
+        return distance_saturation;
+    return pyramid_cells[level - 1][width * y_int + x_int];
+}
+
+bool level_hit(int level, int x_int, int y_int) const
+{
+    const int margin = 1 << level;
+    x_int += margin;
+    y_int += margin;
+    const bit_grid& blocks = pyramid_hits[level - 1];
+    if ( ( unsigned(x_int) >= unsigned(blocks.width) ) || ( unsigned(y_int) >= unsigned(blocks.height) ) )
+        return false;
+    return blocks.get(x_int, y_int);
+}
+
+float level_likelihood(int level, int x_int, int y_int) const
+{
+    return likelihood_table[level_distance(level, x_int, y_int)];
+}
+
+// memory used by the map and its derived structures, in bytes
+size_t memory_size() const;
+
+private:
+    bool tiled;
+
+    // package mapped by open_package, 0 if the map has been built by load
+    void* package;
+    size_t package_size;
+
+    // occupancy of the map: 1 bit per cell for the occupied cells and 1 bit per cell for the unknown cells
+    bit_grid occupied, unknown;
+
+    // distance (in cells) from each cell to the nearest occupied cell, saturated at distance_saturation
+    // the distances are read through distance_cells, which points to distance or to the mapped package
+    vector<uint8_t> distance;
+    const uint8_t* distance_cells;
+    int hit_radius;
+    float likelihood_table[distance_saturation + 1];
+
+    // cells at less than hit_radius from an occupied cell: this is all the sensor model needs in its default mode
+    bit_grid hits;
+
+    // pyramid[level - 1] stores level_distance(level, ...) for level = 1 .. pyramid_depth, only in likelihood mode
+    // pyramid_hits[level - 1] stores level_hit(level, ...)
+    vector< vector<uint8_t> > pyramid;
+    vector<const uint8_t*> pyramid_cells;
+    vector<bit_grid> pyramid_hits;
+
+void compute_distance_field();
+void compute_pyramid(bool likelihood);
+void compute_likelihood_table();
+void release_package();
+
+// a map owns its package or the storage its pointers refer to
+localization_map(const localization_map&);
+localization_map& operator=(const localization_map&);
+
+};
+
+// read a map saved for the map_server (yaml file and its pgm image), with the same thresholds as the map_server
+// the occupancy is returned row by row from the bottom of the image: 100 = occupied, 0 = free, -1 = unknown
+bool read_map_file(const string& yaml_file, int& width, int& height, float& resolution, float& origin_x, float& origin_y, vector<int8_t>& occupancy);
+
+#endif
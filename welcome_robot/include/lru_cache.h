@@ -0,0 +1,78 @@
+#pragma once
+
+#ifndef LRU_CACHE_H
+#define LRU_CACHE_H
+
+// cache of the last values computed, the least recently used value is dropped when the cache is full
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+using namespace std;
+
+template <typename K, typename V>
+class lru_cache
+{
+
+public:
+
+lru_cache(size_t capacity)
+    : capacity(capacity)
+{
+}
+
+// the value of key if it is in the cache, which becomes the most recently used value
+bool find(const K& key, V& value)
+{
+
+    typename unordered_map<K, typename list< pair<K, V> >::iterator>::iterator found = index.find(key);
+    if ( found == index.end() )
+        return false;
+    entries.splice(entries.begin(), entries, found->second);
+    value = found->second->second;
+    return true;
+
+}
+
+void insert(const K& key, const V& value)
+{
+
+    typename unordered_map<K, typename list< pair<K, V> >::iterator>::iterator found = index.find(key);
+    if ( found != index.end() )
+    {
+        found->second->second = value;
+        entries.splice(entries.begin(), entries, found->second);
+        return;
+    }
+
+    entries.push_front(make_pair(key, value));
+    index[key] = entries.begin();
+    if ( entries.size() > capacity )
+    {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+
+}
+
+size_t size() const
+{
+    return entries.size();
+}
+
+void clear()
+{
+    entries.clear();
+    index.clear();
+}
+
+private:
+    size_t capacity;
+    // most recently used first
+    list< pair<K, V> > entries;
+    unordered_map<K, typename list< pair<K, V> >::iterator> index;
+
+};
+
+#endif
@@ -0,0 +1,258 @@
+#pragma once
+
+#ifndef MAP_OVERLAY_H
+#define MAP_OVERLAY_H
+
+// changes of the map seen by the laser since the map was made: furniture added or moved
+// the overlay stores the log-odds of occupancy of the cells, in blocks of block_size x block_size cells,
+// and a block only exists where a scan has disagreed with the map: the memory follows the area that has changed,
+// and a cell without block has the value of the map
+// the map itself is read only, it may be mapped from a package or shared by several robots
+
+#include "localization_map.h"
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#define overlay_block_bits 4 // blocks of 16 x 16 cells, 256 bytes each
+#define overlay_hit 8 // log-odds (in tenths) added to a cell by the hit of a beam
+#define overlay_miss 4 // log-odds (in tenths) removed from a cell crossed by a beam
+#define overlay_occupied 20 // a cell with log-odds above this value is occupied, and free below the opposite
+#define overlay_max 60 // bound of the log-odds, so that a change of the map can be undone by a few scans
+#define overlay_hit_margin 2 // cells before the end of a beam that are not updated as free, because of the noise of the range
+#define overlay_distance_radius 8 // in cells, the distances to the obstacles are computed again up to this radius around a change (at most one block)
+
+using namespace std;
+
+// block_size x block_size bits, one 16 bit row per line of cells
+struct overlay_bits
+{
+    uint16_t rows[1 << overlay_block_bits];
+};
+
+// sparse grid of bits, whose first cell is the cell (origin, origin) of the map: only the blocks with a bit set are stored
+// the blocks are shared between the copies of the grid, a block is replaced and never modified
+struct overlay_plane
+{
+    int origin;
+    int width, height;
+    int nb_blocks_x, nb_blocks_y;
+    // one bit per block, set if the block exists
+    vector<uint64_t> present;
+    unordered_map< int, shared_ptr<const overlay_bits> > blocks;
+
+void resize(int origin, int width, int height);
+
+bool get(int x_int, int y_int) const
+{
+    x_int -= origin;
+    y_int -= origin;
+    if ( ( unsigned(x_int) >= unsigned(width) ) || ( unsigned(y_int) >= unsigned(height) ) )
+        return false;
+    int index = ( y_int >> overlay_block_bits ) * nb_blocks_x + ( x_int >> overlay_block_bits );
+    if ( !( ( present[index >> 6] >> ( index & 63 ) ) & 1 ) )
+        return false;
+    const int mask = ( 1 << overlay_block_bits ) - 1;
+    return ( blocks.find(index)->second->rows[y_int & mask] >> ( x_int & mask ) ) & 1;
+}
+
+// bits of the cells (x_int, y_int) to (x_int + 31, y_int), 0 outside of the grid
+uint32_t row(int x_int, int y_int) const;
+
+// replaces the block index, which is removed if all its bits are 0
+void store(int index, const overlay_bits& bits);
+
+size_t memory_size() const;
+};
+
+// the sure changes of an overlay over its map, as the sensor model and the searches read them
+// only the blocks of cells around a change are stored, with their hits, occupancy and distances to the obstacles of the map and of the changes:
+// the cells of a block without changes are read in the map after one bit test, the others with one lookup of their block
+// the cells whose distance to an obstacle decreased are dilated over the blocks of the pyramid, so that the bounds of the
+// branch and bound search stay above the scores with the changes
+// a layer is never modified: a search keeps the layer it started with, the next one shares the blocks that did not change
+class overlay_layer
+{
+
+public:
+
+overlay_layer(const localization_map& map);
+
+// same as the functions of the map, with the changes
+int cell_state(int x_int, int y_int) const
+{
+    const cell_block* block = find_block(x_int, y_int);
+    if ( !block )
+        return map.cell_state(x_int, y_int);
+    const int mask = ( 1 << overlay_block_bits ) - 1;
+    if ( ( block->unknown.rows[y_int & mask] >> ( x_int & mask ) ) & 1 )
+        return -1;
+    return ( ( block->occupied.rows[y_int & mask] >> ( x_int & mask ) ) & 1 ) ? 100 : 0;
+}
+
+int cell_value(float x, float y) const;
+
+bool cell_hit(int x_int, int y_int) const
+{
+    const cell_block* block = find_block(x_int, y_int);
+    if ( !block )
+        return map.cell_hit(x_int, y_int);
+    const int mask = ( 1 << overlay_block_bits ) - 1;
+    return ( block->hits.rows[y_int & mask] >> ( x_int & mask ) ) & 1;
+}
+
+float cell_likelihood(int x_int, int y_int) const
+{
+    const cell_block* block = find_block(x_int, y_int);
+    if ( !block )
+        return map.cell_likelihood(x_int, y_int);
+    const int mask = ( 1 << overlay_block_bits ) - 1;
+    return map.likelihood_values()[block->distance[( ( y_int & mask ) << overlay_block_bits ) | ( x_int & mask )]];
+}
+
+float interpolated_likelihood(float x, float y, float& gradient_x, float& gradient_y) const;
+
+bool level_hit(int level, int x_int, int y_int) const
+{
+    return map.level_hit(level, x_int, y_int) || levels[level].get(x_int, y_int);
+}
+
+// an obstacle added further than the radius from a cell may still be closer than the obstacles of the map
+float level_likelihood(int level, int x_int, int y_int) const
+{
+    if ( levels[level].get(x_int, y_int) )
+        return map.likelihood_values()[0];
+    return max(map.level_likelihood(level, x_int, y_int), map.likelihood_values()[radius + 1]);
+}
+
+// true if the layer is the map
+bool empty() const
+{
+    return cells.empty();
+}
+
+// incremented by each layer published with changes
+unsigned int revision() const
+{
+    return changes;
+}
+
+int nb_blocks() const
+{
+    return cells.size();
+}
+
+// one bit per block of cells, set if the block differs from the map, for the vectorized kernels
+const uint64_t* changed_blocks() const
+{
+    return &present[0];
+}
+
+int blocks_per_row() const
+{
+    return nb_blocks_x;
+}
+
+// memory used by the layer, in bytes: the blocks shared with the previous layers are counted
+size_t memory_size() const;
+
+private:
+    friend class map_overlay;
+
+    struct cell_block
+    {
+        overlay_bits hits, occupied, unknown;
+        uint8_t distance[1 << ( 2 * overlay_block_bits )];
+    };
+
+    const localization_map& map;
+    // distances computed again around the changes, in cells
+    int radius;
+    int nb_blocks_x, nb_blocks_y;
+    vector<uint64_t> present;
+    unordered_map< int, shared_ptr<const cell_block> > cells;
+    // cells closer to an obstacle than in the map
+    overlay_plane closer;
+    // levels[0]: the cells of closer dilated by one cell, levels[level]: over the blocks of level_hit(level, ...)
+    vector<overlay_plane> levels;
+    unsigned int changes;
+
+const cell_block* find_block(int x_int, int y_int) const
+{
+    int index = ( y_int >> overlay_block_bits ) * nb_blocks_x + ( x_int >> overlay_block_bits );
+    if ( !( ( present[index >> 6] >> ( index & 63 ) ) & 1 ) )
+        return 0;
+    return cells.find(index)->second.get();
+}
+
+};
+
+class map_overlay
+{
+
+public:
+
+map_overlay(const localization_map& map);
+
+// the scan taken from the position (x, y, orientation) updates the cells crossed by its beams, and the cells of its hits
+// only the beams with an echo are used
+void integrate(float x, float y, float orientation, int nb_beams, const float* r, const float* theta, const bool* valid);
+
+// value of the cell corresponding to the position (x, y): the value of the overlay where it is sure, of the map elsewhere
+// returns 100 if occupied, 0 if free, -1 if unknown or outside the map
+int cell_value(float x, float y) const;
+
+// layer of the sure changes integrated so far: only the blocks around the cells that changed since the last layer are computed
+shared_ptr<const overlay_layer> publish();
+
+void clear();
+
+int nb_blocks() const
+{
+    return blocks.size();
+}
+
+// memory used by the overlay, in bytes
+size_t memory_size() const;
+
+private:
+    struct block
+    {
+        int8_t log_odds[1 << ( 2 * overlay_block_bits )];
+    };
+
+    const localization_map& map;
+    int nb_blocks_x, nb_blocks_y;
+    unordered_map<int, block> blocks;
+    // one bit per block of the map, set if the block exists: most lookups end here
+    vector<uint64_t> present;
+    // blocks with a cell that became sure or stopped being sure since the last layer
+    vector<int> dirty;
+    shared_ptr<const overlay_layer> published;
+
+int block_index(int x_int, int y_int) const
+{
+    return ( y_int >> overlay_block_bits ) * nb_blocks_x + ( x_int >> overlay_block_bits );
+}
+
+bool block_present(int index) const
+{
+    return ( present[index >> 6] >> ( index & 63 ) ) & 1;
+}
+
+// log-odds of the cell, 0 if it has no block
+const int8_t* find_cell(int x_int, int y_int) const;
+// value of the cell (x_int, y_int) inside the map, with the sure cells of the overlay
+int cell_state(int x_int, int y_int) const;
+// change of the log-odds of the cell, its block is created if the cell disagrees with the map
+void update_cell(int x_int, int y_int, int change);
+// the block index of the layer computed again from the map and the overlay
+void update_block(overlay_layer& layer, int index) const;
+// the blocks of the levels of the layer that depend on the blocks of cells updated
+void update_levels(overlay_layer& layer, const vector<int>& updated) const;
+
+};
+
+#endif
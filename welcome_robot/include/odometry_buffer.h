@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef ODOMETRY_BUFFER_H
+#define ODOMETRY_BUFFER_H
+
+// the last odometry messages with their stamps, to get the odometry at the time a scan was taken
+// one producer adds the messages, any thread can read them: nobody ever waits,
+// the sequence number of a slot gives the message it holds, a reader gives up on a slot rewritten before or during its read
+
+#include <atomic>
+#include <cmath>
+
+using namespace std;
+
+template <int capacity>
+class odometry_buffer
+{
+
+public:
+
+odometry_buffer()
+    : count(0)
+{
+
+    for (int loop = 0; loop < capacity; loop++)
+        slots[loop].sequence.store(0, memory_order_relaxed);
+
+}
+
+// producer: the odometry (x, y, orientation) at stamp, the stamps increase
+void push(double stamp, float x, float y, float orientation)
+{
+
+    // message index is written with the sequence number 2 * index + 1, then 2 * index + 2 once written
+    unsigned long index = count.load(memory_order_relaxed);
+    slot& current = slots[index % capacity];
+    current.sequence.store(2 * index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    current.stamp.store(stamp, memory_order_relaxed);
+    current.x.store(x, memory_order_relaxed);
+    current.y.store(y, memory_order_relaxed);
+    current.orientation.store(orientation, memory_order_relaxed);
+    current.sequence.store(2 * index + 2, memory_order_release);
+    count.store(index + 1, memory_order_release);
+
+}
+
+// the odometry at stamp, interpolated between the messages around it,
+// or extrapolated from the last two messages if stamp is at most max_extrapolation seconds after the last one
+// returns false if stamp is out of the buffer
+bool interpolate(double stamp, double max_extrapolation, float& x, float& y, float& orientation) const
+{
+
+    unsigned long last = count.load(memory_order_acquire);
+    if ( last < 2 )
+        return (false);
+
+    // from the newest message back to the oldest one still in the buffer
+    entry after, before;
+    if ( !read(last - 1, after) )
+        return (false);
+    unsigned long first = ( last > (unsigned long)capacity ) ? last - capacity : 0;
+    for (unsigned long loop = last - 1; loop > first; loop--)
+    {
+        if ( !read(loop - 1, before) )
+            return (false);
+        if ( before.stamp <= stamp )
+        {
+            if ( stamp > after.stamp + max_extrapolation )
+                return (false);
+            double ratio = ( after.stamp > before.stamp ) ? ( stamp - before.stamp ) / ( after.stamp - before.stamp ) : 1;
+            x = before.x + ratio * ( after.x - before.x );
+            y = before.y + ratio * ( after.y - before.y );
+            orientation = remainder(before.orientation + ratio * remainder(after.orientation - before.orientation, 2 * M_PI), 2 * M_PI);
+            return (true);
+        }
+        after = before;
+    }
+
+    return (false);
+
+}
+
+private:
+    struct slot
+    {
+        atomic<unsigned long> sequence;
+        atomic<double> stamp;
+        atomic<float> x, y, orientation;
+    };
+    struct entry
+    {
+        double stamp;
+        float x, y, orientation;
+    };
+
+    slot slots[capacity];
+    // number of messages pushed
+    atomic<unsigned long> count;
+
+// message number index, false if it has been overwritten by a newer message
+bool read(unsigned long index, entry& value) const
+{
+
+    const slot& current = slots[index % capacity];
+    if ( current.sequence.load(memory_order_acquire) != 2 * index + 2 )
+        return (false);
+    value.stamp = current.stamp.load(memory_order_relaxed);
+    value.x = current.x.load(memory_order_relaxed);
+    value.y = current.y.load(memory_order_relaxed);
+    value.orientation = current.orientation.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+
+    return (current.sequence.load(memory_order_relaxed) == 2 * index + 2);
+
+}
+
+};
+
+#endif
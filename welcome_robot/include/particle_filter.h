@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef PARTICLE_FILTER_H
+#define PARTICLE_FILTER_H
+
+// monte carlo localization: the position of the robot is tracked with a set of particles
+// moved with the odometry, weighted with the laser data and resampled with KLD sampling (Fox 2003),
+// so that the number of particles grows when the position is uncertain and shrinks when it converges
+
+#include "localization_map.h"
+#include <random>
+
+#define particles_min 100 // bounds of the number of particles
+#define particles_max 5000
+#define kld_error 0.05 // maximum error between the particles and the true distribution (KLD sampling)
+#define kld_quantile 2.326 // upper quantile of the standard normal distribution for a probability of 0.99 that the error is below kld_error
+#define kld_bin_size 0.25 // size (in meters and degrees) of the bins of the histogram used by KLD sampling
+#define kld_bin_angle 10.0
+#define particle_beams 60 // number of beams of the laser used to weight the particles
+#define particle_sigma 0.2 // standard deviation (in meters) of a hit around an obstacle
+#define particle_hit_weight 0.95 // probability that a hit is explained by the map, otherwise it is a random measurement
+#define odometry_rotation_noise 0.2 // noise of the odometry motion model: rotation per rotation
+#define odometry_rotation_translation_noise 0.2 // rotation per meter
+#define odometry_translation_noise 0.2 // translation per meter
+#define odometry_translation_rotation_noise 0.05 // translation per radian
+
+using namespace std;
+
+struct particle
+{
+    float x, y, orientation;
+    double weight;
+};
+
+class particle_filter
+{
+
+public:
+
+particle_filter(const localization_map& map);
+
+// particles drawn around (x, y, o) with a standard deviation of spread (in meters) and angle_spread (in radians)
+void initialize(float x, float y, float o, float spread, float angle_spread);
+
+// moves the particles by the motion measured by the odometry between (last_x, last_y, last_o) and (x, y, o)
+void predict(float last_x, float last_y, float last_o, float x, float y, float o);
+
+// weights the particles with the laser data in the frame of the robot and resamples them
+// only the valid beams are used, the others carry no information about the obstacles
+void correct(int nb_beams, const float* r, const float* theta, const bool* valid);
+
+// mean position of the particles and its standard deviation (in meters)
+void estimate(float& x, float& y, float& o, float& deviation) const;
+
+int nb_particles() const
+{
+    return particles.size();
+}
+
+const vector<particle>& get_particles() const
+{
+    return particles;
+}
+
+private:
+    const localization_map& map;
+    vector<particle> particles;
+    mt19937 generator;
+
+    // log of the probability of a hit at a distance of d cells from the nearest obstacle
+    float log_likelihood[distance_saturation + 1];
+    float log_outside;
+
+double log_weight(const particle& p, const vector<float>& beam_r, const vector<float>& beam_cos, const vector<float>& beam_sin) const;
+void resample();
+
+};
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+#ifndef PLACE_INDEX_H
+#define PLACE_INDEX_H
+
+// index of the places of a map for the global relocalization
+// the free cells of the map are sampled offline, and the surroundings of each place are summarized by a small descriptor:
+// the distance to the nearest obstacle in each sector around the place, as in scan context (Kim 2018)
+// a lost robot first compares the ring key of its scan, which does not depend on its orientation, with the keys of all the places,
+// then aligns its scan with the descriptors of the closest places only, for all the orientations,
+// and only searches its position around the best aligned places
+
+#include "localization_map.h"
+#include "scan_matcher.h"
+#include <cmath>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#define place_sectors 72 // sectors of 5 degrees around a place
+#define place_rays_per_sector 5 // rays cast in each sector of a place by build
+#define place_clearance 0.2 // in meters, the cells closer to an obstacle are not sampled: the robot cannot be there
+#define place_key_bins 32 // bins of the ring key of a place: the histogram of the distances of its sectors
+#define place_key_candidates 2048 // places with the closest ring keys, whose orientation is aligned with the scan
+#define place_index_version 1 // version of the index files written by save
+
+using namespace std;
+
+struct place_candidate
+{
+    float x, y, orientation;
+    int distance; // between the descriptors of the place and of the scan
+};
+
+class place_index
+{
+
+public:
+
+place_index();
+
+// samples the free cells of the map every place_step meters, the obstacles are seen up to range_max
+void build(const localization_map& map, float place_step, float range_max);
+
+// write the index to a binary file, read it back: returns false if the file cannot be read or is from another version
+bool save(const string& file) const;
+bool load(const string& file);
+
+// descriptor of a scan: the distance to the nearest hit in each sector of the field of view of the laser, in the frame of the robot
+// returns the first sector of the field of view, nb_seen sectors follow it around the robot
+int describe(int nb_beams, const float* r, const float* theta, const bool* valid, uint8_t* descriptor, int& nb_seen) const;
+
+// ring key of a descriptor of nb_sectors sectors: the number of sectors in each bin of distance, out of place_sectors
+// the key of a scan only sees its field of view: its counts are scaled to the whole turn
+void ring_key(const uint8_t* descriptor, int nb_sectors, uint8_t* key) const;
+
+// the nb_candidates positions whose descriptors are the closest to the descriptor of the scan, closest first
+// the places with the closest ring keys are compared with the scan for all the orientations of the robot, one per sector
+void query(int nb_beams, const float* r, const float* theta, const bool* valid, int nb_candidates, vector<place_candidate>& candidates) const;
+
+// the best position of the searches around the candidates, with the scan set in matcher
+// each candidate stands for the positions at less than half a step and one sector from it
+search_result verify(const scan_matcher& matcher, const vector<place_candidate>& candidates, float resolution, float angle_resolution, bool branch_and_bound) const;
+
+int size() const
+{
+    return places.size() / 2;
+}
+
+// distance between two places, and between two orientations of a place
+float step() const
+{
+    return place_step;
+}
+
+float angle_step() const
+{
+    return 2 * M_PI / place_sectors;
+}
+
+private:
+    float place_step;
+    float range_max;
+
+    // (x, y) of each place, and its descriptor written twice in a row,
+    // so that the sectors seen by the robot are contiguous for every orientation
+    vector<float> places;
+    vector<uint8_t> descriptors;
+    // ring key of each place, computed from its descriptor
+    vector<uint8_t> keys;
+
+void compute_keys();
+
+// distance in [0, range_max] stored in a byte, more precise for the short ranges
+uint8_t quantize(float range) const;
+
+};
+
+#endif
@@ -0,0 +1,130 @@
+#pragma once
+
+#ifndef RANGE_TABLE_H
+#define RANGE_TABLE_H
+
+// ranges expected from a position of the map in any direction, without marching along the ray (compressed directional distance transform)
+// the directions are quantized: for each direction, the map is cut in lanes of one cell parallel to it,
+// and each lane stores the runs of obstacles it crosses, sorted along the direction
+// a ray is in one lane: its range is the distance to the next run of the lane, found by a binary search over a few runs
+// a direction and its opposite share their lanes, which are read backwards
+// only the occupied cells on the border of the obstacles are stored: a ray never starts inside an obstacle
+
+#include "localization_map.h"
+#include <vector>
+#include <string>
+#include <cmath>
+#include <stdint.h>
+
+#define range_directions 180 // directions of the table over 180 degrees: 1 degree each
+#define range_lanes_per_cell 2 // lanes per cell across each direction: a range is stopped by an obstacle at most cell_size / range_lanes_per_cell beside the ray
+#define range_units_per_cell 4 // the positions of the runs are stored in 16 bits, in quarters of cell: maps up to 16000 cells in width plus height
+#define range_max_run 255 // the lengths of the runs are stored in 8 bits, in units: the longer runs are split
+#define range_table_version 1 // version of the files written by save
+
+using namespace std;
+
+// mixture of the beam model: a range is the expected range with noise, or a shorter range stopped by an obstacle
+// that is not in the map, or a random range
+// each beam scores at most 1 (the weights sum to 1), as a hit of the other sensor models
+struct beam_mixture
+{
+    float sigma; // standard deviation (in meters) of a range around the expected range
+    float hit_weight, short_weight, random_weight;
+    float short_rate; // per meter, rate of the exponential distribution of the shorter ranges
+    float max_range; // range of the beams without echo
+    bool free_space; // a beam without echo scores 1 if the map is free along it up to max_range, 0 otherwise
+
+float score(float range, float expected, bool echo) const
+{
+    if ( !echo )
+        return ( ( free_space && ( expected >= max_range ) ) ? 1 : 0 );
+    float error = range - expected;
+    float score = hit_weight * exp(-error * error / ( 2 * sigma * sigma )) + random_weight;
+    if ( error < 0 )
+        score += short_weight * exp(-short_rate * range);
+    return score;
+}
+
+};
+
+class range_table
+{
+
+public:
+
+range_table();
+~range_table();
+
+// the runs of the occupied cells of the map, for each direction, computed by nb_threads threads
+// returns false if the map is too large for the table
+bool build(const localization_map& map, int nb_threads);
+
+// write the table to a binary file, to be mapped by open
+bool save(const string& file) const;
+
+// map a table written by save instead of building it: the pages are read from the file when they are first used
+// and are shared by all the processes that map it
+// returns false if the file cannot be read, or was not built from the same map
+bool open(const string& file, const localization_map& map);
+
+bool built() const
+{
+    return nb_directions > 0;
+}
+
+// distance from (x, y) to the first occupied cell in the direction angle, max_range if there is none before
+float range(float x, float y, float angle, float max_range) const;
+
+// memory used by the table, in bytes (mapped or not)
+size_t memory_size() const;
+
+private:
+    struct lanes
+    {
+        float cos_angle, sin_angle;
+        // first position across the direction, from the origin of the map
+        float min_across;
+        // first position along the direction, from the origin of the map
+        float min_along;
+        int32_t nb_lanes;
+        // index of the first lane of the direction in first_run
+        uint32_t first_lane;
+    };
+
+    float cell_size, lane_width;
+    float min_x, min_y;
+    int nb_directions;
+    // size and occupancy of the map the table is built from, checked by open
+    int width, height;
+    uint64_t signature;
+
+    // the runs of the lane l of all the directions are first_run[l] to first_run[l + 1] - 1,
+    // from run_start[k] to run_start[k] + run_length[k], positions along the direction from min_along, in units
+    // the arrays are read through the pointers, which point to the vectors or to the mapped file
+    vector<lanes> direction_storage;
+    vector<uint32_t> first_run_storage;
+    vector<uint16_t> start_storage;
+    vector<uint8_t> length_storage;
+    const lanes* directions;
+    const uint32_t* first_run;
+    const uint16_t* run_start;
+    const uint8_t* run_length;
+    size_t nb_lanes, nb_runs;
+
+    // file mapped by open, 0 if the table has been built
+    void* file_data;
+    size_t file_size;
+
+void build_direction(const localization_map& map, const vector<int>& border_x, const vector<int>& border_y, int direction, lanes& current,
+                     vector<uint32_t>& first, vector<uint16_t>& starts, vector<uint8_t>& lengths) const;
+void attach_storage();
+void release_file();
+
+// a table owns its file or the storage its pointers refer to
+range_table(const range_table&);
+range_table& operator=(const range_table&);
+
+};
+
+#endif
@@ -0,0 +1,338 @@
+#pragma once
+
+#ifndef SCAN_MATCHER_H
+#define SCAN_MATCHER_H
+
+// search of the position of the robot for which the laser data best match the map
+
+#include "localization_map.h"
+#include "map_overlay.h"
+#include "range_table.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#define refine_iterations 10 // maximum number of iterations of the continuous refinement
+#define bound_check_beams 32 // the bounded scores check if the position can still win every bound_check_beams beams
+#define no_threshold -1 // threshold of a score computed over all the beams
+#define bound_margin 1e-3 // a position is only abandoned if it misses the threshold by more than the rounding of the sums of likelihoods
+#define score_tile_bits 2 // the exhaustive searches score tiles of 4 x 4 neighboring positions together
+#define score_batch_size 16 // maximum number of positions of a batch of scores: a tile of positions
+#define rerank_candidates 16 // with the ranges, the best positions of the hits scored again with the ranges
+
+class work_stealing_pool;
+
+// positions tested by a search: (min_x + i * step, min_y + j * step, min_orientation + k * angle_step)
+// with 0 <= i < nb_x, 0 <= j < nb_y and 0 <= k < nb_orientations
+struct search_window
+{
+    float min_x, min_y, min_orientation;
+    int nb_x, nb_y, nb_orientations;
+    float step, angle_step;
+};
+
+struct search_result
+{
+    bool found;
+    float x, y, orientation;
+    float score;
+    int nb_scored; // number of positions for which the score has been computed
+    long nb_beams_scored; // number of beams scored for these positions: the bounded scores skip the beams of the positions that cannot win
+    bool complete; // false if the search has been stopped by its deadline
+    float coverage; // fraction of the positions of the window scored or pruned
+};
+
+class scan_matcher
+{
+
+public:
+
+// with correlative set, the positions of the window are scored by translating the hits computed once per orientation
+// by an integer number of cells, without any trigonometry
+scan_matcher(const localization_map& map, bool likelihood, bool correlative);
+
+// number of threads sharing the positions of a search, the result does not depend on it
+void set_nb_threads(int nb_threads);
+
+// the threads of a search are jobs of pool instead of threads started by the search (0: threads started by each search)
+// the search must then run in a job of the pool or in a thread out of it, which waits for the jobs
+void set_pool(work_stealing_pool* pool);
+
+// changes of the map scored instead of the map where they differ from it (0: the map alone)
+// the layer is read by the searches and must stay alive until they return
+void set_overlay(const overlay_layer* layer);
+
+// laser data in the frame of the robot
+// echo[k] is false for a beam without echo, only scored by the free space term of set_ranges (0: all the beams have an echo)
+// the beams with an echo are stored first
+void set_scan(int nb_beams, const float* r, const float* theta, const bool* echo = 0);
+
+// scores with the ranges expected from the positions, read in the range table of the map (0 to score the hits only):
+// with beam_model, each beam with an echo scores the mixture of the beam model instead of its hit,
+// and with mixture.free_space, each beam without echo scores 1 if the map is free along it
+// the ranges are read position by position, and no bound of the pyramid applies to them: the searches find the rerank_candidates
+// best positions of the hits of the beams with an echo, with the bounds and the vectorized kernels, and return the best of them scored with the ranges
+void set_ranges(const range_table* ranges, const beam_mixture& mixture, bool beam_model);
+
+// score of the position (x, y, o): number of hits close to an obstacle, or sum of their likelihoods
+// the vectorized kernel is used when the processor supports it
+float score(float x, float y, float o) const
+{
+    int nb_evaluated;
+    return ( bounded_score(x, y, o, no_threshold, nb_evaluated) );
+}
+
+// same score, but the scoring stops as soon as the beams left cannot bring the score up to threshold
+// (each beam scores at most 1): the score returned is then below threshold, but not the score of the position
+// nb_evaluated is the number of beams scored
+float bounded_score(float x, float y, float o, float threshold, int& nb_evaluated) const
+{
+    if ( ranges )
+        return ( range_score(x, y, o, threshold, nb_evaluated) );
+    return ( vectorized ? vectorized_score(x, y, o, threshold, nb_evaluated) : scalar_score(x, y, o, threshold, nb_evaluated) );
+}
+
+float scalar_score(float x, float y, float o, float threshold, int& nb_evaluated) const;
+// bounded score with the ranges expected from the position (see set_ranges)
+float range_score(float x, float y, float o, float threshold, int& nb_evaluated) const;
+
+// bounded scores of a batch of at most score_batch_size positions (x[k], y[k], o[k]) with the same threshold
+// the beams are scored one after the other for all the positions (beams outer, positions inner): the hits of a beam
+// from neighboring positions fall in the same cells, which stay in cache instead of reading the whole footprint of the scan for each position
+// the positions that cannot reach threshold are dropped every bound_check_beams beams, as by bounded_score:
+// scores[k] and nb_evaluated[k] are those of bounded_score for the position k
+void score_batch(int nb_positions, const float* x, const float* y, const float* o, float threshold, float* scores, int* nb_evaluated) const
+{
+    if ( ranges )
+        for (int loop = 0; loop < nb_positions; loop++)
+            scores[loop] = range_score(x[loop], y[loop], o[loop], threshold, nb_evaluated[loop]);
+    else
+        hit_score_batch(nb_positions, x, y, o, threshold, scores, nb_evaluated);
+}
+
+void scalar_score_batch(int nb_positions, const float* x, const float* y, const float* o, float threshold, float* scores, int* nb_evaluated) const;
+// 8 beams at a time for each position
+void vectorized_score_batch(int nb_positions, const float* x, const float* y, const float* o, float threshold, float* scores, int* nb_evaluated) const;
+
+// 8 beams at a time with AVX2: the beams are rotated with the precomputed cos and sin of their angles
+// and the cells of their hits are gathered from the distance field
+// the hits are computed with the same float operations as scalar_score: the numbers of hits are the same,
+// the sums of likelihoods only differ by the order of their additions (checked by scan_matcher_test)
+float vectorized_score(float x, float y, float o, float threshold, int& nb_evaluated) const;
+
+// true if the processor supports the vectorized kernels
+static bool simd_supported();
+
+// the vectorized kernels are only used if set and supported
+void set_vectorized(bool vectorized);
+
+// continuous refinement of the position found by a search: Levenberg-Marquardt on the likelihood of the hits,
+// bilinearly interpolated in the map, so that the position is no more quantized by the steps of the window
+// the position stays within one step of the window from the position found, otherwise the position found is kept
+// the score is the one of the position found
+search_result refine(const search_window& window, const search_result& found) const;
+
+// covariance of the position (x, y, o) from the curvature of the alignment cost around it (Laplace approximation):
+// the mean squared misalignment of the hits times the inverse of the gauss-newton hessian
+// a direction along which the scan slides without changing its score (a corridor) gets a large variance
+// returns false if the hessian is singular
+bool covariance(float x, float y, float o, double covariance[3][3]) const;
+
+// anytime searches: a search stops after deadline seconds and returns the best position found so far, 0 for no deadline
+// (a search always goes on until it has found a position)
+// with a deadline, the branch and bound search refines the blocks of the whole window in the order of their bounds, coarse to fine
+void set_deadline(double deadline);
+
+// the searches score the positions with the bounded scores (default), or over all their beams
+void set_bounded(bool bounded);
+
+// window of the positions tested by for (x = min_x; x < max_x; x += step) ...
+static search_window make_window(float min_x, float max_x, float min_y, float max_y, float min_orientation, float max_orientation, float step, float angle_step);
+
+// all the free positions of the window are scored, the first one with the highest score is returned
+search_result exhaustive_search(const search_window& window) const;
+
+// same result as exhaustive_search, but the window is explored coarse to fine with the resolution pyramid of the map
+// and the blocks of positions whose upper bound of the score cannot beat the best score are pruned
+search_result branch_and_bound_search(const search_window& window) const;
+
+// cells of the hits for each orientation of the window, when the robot is at (min_x, min_y)
+// the hits of the position (min_x + i * step, min_y + j * step) are in the same cells translated by (i, j)
+void rotate_scan(const search_window& window, vector<int>& cells_x, vector<int>& cells_y) const;
+
+// score of the hits cells_x[loop] + x, cells_y[loop] + y
+float correlative_score(const int* cells_x, const int* cells_y, int x, int y) const
+{
+    int nb_evaluated;
+    return ( bounded_correlative_score(cells_x, cells_y, x, y, no_threshold, nb_evaluated) );
+}
+
+float bounded_correlative_score(const int* cells_x, const int* cells_y, int x, int y, float threshold, int& nb_evaluated) const
+{
+    return ( vectorized ? vectorized_correlative_score(cells_x, cells_y, x, y, threshold, nb_evaluated)
+                        : scalar_correlative_score(cells_x, cells_y, x, y, threshold, nb_evaluated) );
+}
+
+float scalar_correlative_score(const int* cells_x, const int* cells_y, int x, int y, float threshold, int& nb_evaluated) const;
+float vectorized_correlative_score(const int* cells_x, const int* cells_y, int x, int y, float threshold, int& nb_evaluated) const;
+
+// batch of the correlative scores of the hits translated by (x[k], y[k]), as score_batch
+void correlative_score_batch(const int* cells_x, const int* cells_y, int nb_positions, const int* x, const int* y, float threshold, float* scores, int* nb_evaluated) const
+{
+    if ( vectorized )
+        vectorized_correlative_score_batch(cells_x, cells_y, nb_positions, x, y, threshold, scores, nb_evaluated);
+    else
+        scalar_correlative_score_batch(cells_x, cells_y, nb_positions, x, y, threshold, scores, nb_evaluated);
+}
+
+void scalar_correlative_score_batch(const int* cells_x, const int* cells_y, int nb_positions, const int* x, const int* y, float threshold, float* scores, int* nb_evaluated) const;
+void vectorized_correlative_score_batch(const int* cells_x, const int* cells_y, int nb_positions, const int* x, const int* y, float threshold, float* scores, int* nb_evaluated) const;
+
+private:
+    const localization_map& map;
+    bool likelihood;
+    bool correlative;
+    int nb_threads;
+    work_stealing_pool* pool;
+    // changes of the map, 0 if none
+    const overlay_layer* layer;
+    bool vectorized;
+    bool bounded;
+    double deadline;
+
+    // beams scored by their hits: the beams with an echo with the ranges, all of them otherwise
+    int nb_beams;
+    vector<float> r, theta;
+    // 1 for the beams with an echo
+    vector<uint8_t> echo;
+    int nb_echoes;
+
+    // ranges expected from the positions, 0 if the hits only are scored
+    const range_table* ranges;
+    beam_mixture mixture;
+    bool beam_model;
+    // for the vectorized kernel: cos and sin of the angle of each beam
+    vector<float> beam_cos, beam_sin;
+
+    // block of 2^level x 2^level positions of the window, with the same orientation
+    struct search_node
+    {
+        int x, y, orientation;
+        int level;
+        float bound;
+        // squared distance in steps from the center of the block to the center of the window, the predicted position
+        float distance;
+    };
+
+    // position of the window, with its score
+    struct search_candidate
+    {
+        float score;
+        int x, y, orientation;
+    };
+
+    // state of a search in one thread
+    struct search_state
+    {
+        const search_window* window;
+        // cells of the hits for the position (min_x, min_y) of the window, for each orientation
+        const vector<int>* cells_x;
+        const vector<int>* cells_y;
+        search_result best;
+        int best_x, best_y, best_orientation;
+        // with the ranges: heap of the best positions of the hits, the worst one first
+        vector<search_candidate> candidates;
+        // best score found by all the threads
+        atomic<float>* shared_score;
+        // end of the search, if timed
+        bool timed, expired;
+        chrono::steady_clock::time_point end;
+        long nb_covered; // positions scored or pruned
+    };
+
+// score_batch with the hits only, for the searches
+void hit_score_batch(int nb_positions, const float* x, const float* y, const float* o, float threshold, float* scores, int* nb_evaluated) const
+{
+    if ( vectorized )
+        vectorized_score_batch(nb_positions, x, y, o, threshold, scores, nb_evaluated);
+    else
+        scalar_score_batch(nb_positions, x, y, o, threshold, scores, nb_evaluated);
+}
+
+// the cells of the map, with the changes of the layer
+bool cell_hit(int x_int, int y_int) const
+{
+    return layer ? layer->cell_hit(x_int, y_int) : map.cell_hit(x_int, y_int);
+}
+
+float cell_likelihood(int x_int, int y_int) const
+{
+    return layer ? layer->cell_likelihood(x_int, y_int) : map.cell_likelihood(x_int, y_int);
+}
+
+int cell_value(float x, float y) const
+{
+    return layer ? layer->cell_value(x, y) : map.cell_value(x, y);
+}
+
+float interpolated_likelihood(float x, float y, float& gradient_x, float& gradient_y) const
+{
+    return layer ? layer->interpolated_likelihood(x, y, gradient_x, gradient_y) : map.interpolated_likelihood(x, y, gradient_x, gradient_y);
+}
+
+bool level_hit(int level, int x_int, int y_int) const
+{
+    return layer ? layer->level_hit(level, x_int, y_int) : map.level_hit(level, x_int, y_int);
+}
+
+float level_likelihood(int level, int x_int, int y_int) const
+{
+    return layer ? layer->level_likelihood(level, x_int, y_int) : map.level_likelihood(level, x_int, y_int);
+}
+
+// tile of the positions (x, y) to (x + 2^score_tile_bits - 1, y + 2^score_tile_bits - 1) of the window
+struct search_position
+{
+    int x, y;
+};
+
+// runs work(0) to work(nb_workers - 1) at the same time: the last one in the calling thread, the others in threads or in jobs of the pool
+void run_workers(int nb_workers, const function<void(int)>& work) const;
+void start(search_state& state, const search_window& window, const vector<int>& cells_x, const vector<int>& cells_y, atomic<float>* shared_score,
+           chrono::steady_clock::time_point begin) const;
+bool out_of_time(search_state& state) const;
+void exhaustive_positions(search_state& state, bool translate, const vector<search_position>& tiles, int first, int step) const;
+float threshold(const search_state& state) const;
+
+// sum of the squared misalignments (1 - interpolated likelihood) of the hits of (x, y, o), with the normal equations of its minimization
+double alignment_cost(float x, float y, float o, double hessian[3][3], double gradient[3]) const;
+
+float upper_bound(const search_state& state, int level, int x, int y, int orientation) const;
+float center_distance(const search_window& window, int level, int x, int y, int orientation) const;
+// order of exploration of the blocks: highest bound first, then closest to the predicted position
+static bool more_promising(const search_node& a, const search_node& b);
+void explore(search_state& state, const search_node& node) const;
+void explore_best_first(search_state& state, const vector<search_node>& roots, int first, int step) const;
+// the leaves of a block of level 1, scored as one batch
+void score_leaves(search_state& state, const search_node* leaves, int nb_leaves) const;
+bool pruned(search_state& state, const search_node& node) const;
+int split(const search_state& state, const search_node& node, search_node children[4]) const;
+bool better(const search_state& state, float score, int x, int y, int orientation) const;
+void keep_best(search_state& state, float score, int x, int y, int orientation) const;
+// the position scored by a search: kept if it is the best one, and among the candidates with the ranges
+void consider(search_state& state, float score, int x, int y, int orientation) const;
+// order of the candidates: higher score first, then the order of better
+static bool ranked_before(const search_candidate& a, const search_candidate& b);
+// lowest score a position must beat to enter the candidates of the thread, no_threshold until they are full
+float candidate_threshold(const search_state& state) const;
+search_result merge(const vector<search_state>& states) const;
+// with the ranges: the candidates of all the threads scored with the ranges, the best one is the result
+search_result rerank(const vector<search_state>& states) const;
+
+};
+
+// solution of a x = b for a 3x3 matrix, by Cramer's rule, false if a is singular
+// used by the refinements of the positions
+bool solve_3x3(const double a[3][3], const double b[3], double x[3]);
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef SCAN_ODOMETRY_H
+#define SCAN_ODOMETRY_H
+
+// motion of the robot measured by matching each scan with the previous one (point-to-line icp, Censi 2008)
+// the wheels slip, the walls do not: the motion of the scans replaces the one of the odometry in the prediction of the position,
+// except when the scans do not constrain it (a long corridor, an open space)
+
+#include <vector>
+
+#define icp_iterations 30 // maximum number of iterations of a match
+#define icp_max_distance 0.3 // in meters, a point is paired with its nearest point of the previous scan if it is closer than this distance,
+#define icp_min_distance 0.05 // which decreases along the iterations down to icp_min_distance
+#define icp_neighbor_distance 0.2 // in meters, the line through a point is estimated with its neighbors in the scan closer than this distance
+#define icp_min_pairs 50 // a match needs at least this number of pairs of points
+#define icp_max_error 0.03 // in meters, and a root mean square distance of the points to the lines below this value
+#define icp_min_constraint 0.1 // and the lines must constrain the translation in every direction: smallest eigenvalue of the mean of n n^T
+
+using namespace std;
+
+class scan_odometry
+{
+
+public:
+    // pose of the robot integrated from the motions between the scans, in the frame of the first scan
+    float x, y, orientation;
+    // scans whose motion has been taken from the odometry since the last reset_failures
+    int failures;
+
+scan_odometry();
+
+// matches the scan with the previous one, the motion of the odometry (odom_x, odom_y, odom_orientation) since the previous scan is the initial guess
+// returns false if the motion is not constrained by the scans, the motion of the odometry is then used
+bool add_scan(int nb_beams, const float* r, const float* theta, const bool* valid, float odom_x, float odom_y, float odom_orientation);
+
+void reset_failures()
+{
+    failures = 0;
+}
+
+private:
+    bool has_previous;
+    float previous_odom_x, previous_odom_y, previous_odom_orientation;
+
+    // points of the previous scan with the normal of their line, ordered as an implicit k-d tree:
+    // the median of each range splits it along x at even depths and along y at odd depths
+    vector<float> points_x, points_y, normals_x, normals_y;
+
+// points and normals of a scan in the frame of the robot, the points without line are dropped
+static void scan_points(int nb_beams, const float* r, const float* theta, const bool* valid,
+                        vector<float>& points_x, vector<float>& points_y, vector<float>& normals_x, vector<float>& normals_y);
+
+// orders the points of [begin, end[ as a k-d tree
+void build_tree(vector<int>& order, int begin, int end, int depth) const;
+
+// nearest point of the previous scan to (x, y) in [begin, end[, closer than sqrt(best_distance)
+void nearest(float x, float y, int begin, int end, int depth, int& best, float& best_distance) const;
+
+// motion (dx, dy, dorientation) from the previous scan to the points, starting from the initial guess
+bool match(const vector<float>& current_x, const vector<float>& current_y, float& dx, float& dy, float& dorientation) const;
+
+};
+
+#endif
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifndef SCAN_REDUCTION_H
+#define SCAN_REDUCTION_H
+
+// reduction of the laser data before the scan matching
+// adjacent beams on the same wall hit the same cells and add little to the score of a position,
+// and the beams without echo (r = range_max) hit nothing: both only cost time in the search
+
+#include <vector>
+
+using namespace std;
+
+struct scan_reduction
+{
+    bool drop_invalid; // drop the beams without echo
+    float voxel_size; // keep one beam per square of voxel_size x voxel_size meters, 0 to keep them all
+    int nb_informative; // keep at most nb_informative beams, selected to constrain every direction, 0 to keep them all
+};
+
+// reduced laser data (r_out, theta_out), in the same order as the original beams, returns the number of beams kept
+int reduce_scan(const scan_reduction& reduction, int nb_beams, const float* r, const float* theta, const bool* valid, vector<float>& r_out, vector<float>& theta_out);
+
+#endif
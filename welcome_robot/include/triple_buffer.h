@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+// lock-free handoff of the latest value from one producer thread to one consumer thread
+// the producer fills the back buffer and publishes it, the consumer takes the last published buffer:
+// neither of them ever waits, and the values published between two reads are dropped
+
+#include <atomic>
+
+using namespace std;
+
+template <typename T>
+class triple_buffer
+{
+
+public:
+
+triple_buffer()
+    : state(1)
+{
+    back = 0;
+    front = 2;
+}
+
+// producer: buffer to fill, then publish it
+T& write_buffer()
+{
+    return buffers[back];
+}
+
+void publish()
+{
+    back = state.exchange(back | fresh, memory_order_acq_rel) & index_mask;
+}
+
+// consumer: takes the last published buffer, returns false if nothing has been published since the last call
+bool update()
+{
+    if ( !( state.load(memory_order_acquire) & fresh ) )
+        return false;
+    front = state.exchange(front, memory_order_acq_rel) & index_mask;
+    return true;
+}
+
+const T& read_buffer() const
+{
+    return buffers[front];
+}
+
+private:
+    enum { index_mask = 3, fresh = 4 };
+
+    T buffers[3];
+    // index of the middle buffer, exchanged between the producer and the consumer, and if it has not been read yet
+    atomic<int> state;
+    int back, front;
+
+};
+
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+#ifndef WORK_STEALING_POOL_H
+#define WORK_STEALING_POOL_H
+
+// pool of threads shared by the robots of the fleet service
+// each thread has its own queue of jobs: it takes its newest job first, when its data is still in its caches,
+// and when its queue is empty it steals the oldest job of another thread, so that no thread stays idle while another one has several jobs
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+class work_stealing_pool
+{
+
+public:
+
+// nb_threads <= 0: one thread per core
+work_stealing_pool(int nb_threads);
+// the jobs already submitted are run before the threads stop
+~work_stealing_pool();
+
+// a job submitted by a job goes to the queue of its thread, the others are dealt to the queues in turn
+void submit(function<void()> job);
+
+// waits until all the jobs submitted have been run
+void wait_idle();
+
+// waits until done returns true, for a job waiting for the jobs it submitted: meanwhile its thread runs the jobs of its own queue,
+// newest first, ie the jobs it submitted that no other thread has stolen, instead of sleeping while they wait in its queue
+void wait_until(const function<bool()>& done);
+
+int size() const
+{
+    return threads.size();
+}
+
+// number of jobs run by another thread than the one of their queue
+long nb_stolen() const
+{
+    return stolen;
+}
+
+private:
+    struct job_queue
+    {
+        mutex lock;
+        deque< function<void()> > jobs;
+    };
+    vector< unique_ptr<job_queue> > queues;
+    vector<thread> threads;
+
+    atomic<bool> stop;
+    atomic<int> nb_queued; // jobs in the queues
+    atomic<int> nb_pending; // jobs in the queues or running
+    atomic<unsigned> next_queue;
+    atomic<long> stolen;
+
+    // the idle threads sleep until a job is submitted, wait_idle until the last job is done
+    mutex sleep_lock;
+    condition_variable wake;
+    condition_variable idle;
+
+void run(int index);
+bool take(int index, bool steal, function<void()>& job);
+void run_job(function<void()>& job);
+
+};
+
+#endif
@@ -0,0 +1,1305 @@
+// benchmark of the localization hot paths, without ROS
+// usage: localization_benchmark [map.yaml [scans.txt]] [--save baseline.txt | --check baseline.txt]
+// without map, the 2nd_floor map of the package if it is in the current directory, otherwise a synthetic floor of 200 x 200 meters
+// without scans, the scans are simulated from random free positions of the map
+// the recorded scans are read from a text file: a first line "nb_beams angle_min angle_increment range_max",
+// then one line "x y orientation r_0 ... r_(nb_beams - 1)" per scan, with the true position of the robot
+// with --save or --check, only the scoring and search variants are run: --save writes their times and errors to the baseline file,
+// --check compares them with the baseline and fails if a variant is slower or less accurate (the first check saves the baseline)
+// the times are only comparable on the same computer, when it is idle
+#include <localization_map.h>
+#include <scan_matcher.h>
+#include <scan_reduction.h>
+#include <place_index.h>
+#include <scan_odometry.h>
+#include <work_stealing_pool.h>
+#include <map_overlay.h>
+#include <range_table.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define nb_scans 50
+#define nb_random_poses 20000
+#define scan_beams 720
+#define scan_range_max 12.0
+#define scan_angle_min -2.35619 // 270 degrees field of view
+#define scan_angle_max 2.35619
+#define scan_noise 0.01 // standard deviation (in meters) of the simulated ranges
+#define fleet_searches 10 // searches of each robot of the fleet load test
+#define node_search_threads 4 // threads of the search of a node, one node per robot
+#define default_map "2nd_floor.yaml" // map used without argument, if it can be read
+#define variant_repeats 5 // each tile of positions and each search is timed several times, the fastest time is kept
+#define variant_deadline 0.002 // in seconds, deadline of the anytime search variant
+#define regression_time_tolerance 0.25 // a variant is a regression if it is more than 25% slower than the baseline,
+#define regression_error_tolerance 0.01 // or if the error of its positions grows by more than 1 cm,
+#define regression_angle_tolerance 0.5 // or 0.5 degree,
+#define regression_rank_tolerance 0.01 // or if the fraction of the positions it scores above the true position grows by more than 1%
+
+// cache misses of the process, read from the hardware counters when they are available
+class cache_counter
+{
+
+public:
+
+cache_counter()
+{
+
+    fd = -1;
+#ifdef __linux__
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+
+}
+
+~cache_counter()
+{
+
+    if ( fd >= 0 )
+        close(fd);
+
+}
+
+bool available() const
+{
+    return fd >= 0;
+}
+
+void start()
+{
+
+#ifdef __linux__
+    if ( fd >= 0 )
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+
+}
+
+long long stop()
+{
+
+    long long count = -1;
+#ifdef __linux__
+    if ( fd >= 0 )
+    {
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        if ( read(fd, &count, sizeof(count)) != sizeof(count) )
+            count = -1;
+    }
+#endif
+    return (count);
+
+}
+
+private:
+    int fd;
+
+};
+
+static double now()
+{
+
+    return (chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count());
+
+}
+
+// floor of rooms and corridors surrounded by unknown cells, like a map built by a slam
+static void synthetic_floor(int& width, int& height, float& resolution, float& origin_x, float& origin_y, vector<int8_t>& occupancy)
+{
+
+    width = height = 4000;
+    resolution = 0.05;
+    origin_x = origin_y = -100;
+    occupancy.assign(size_t(width) * height, -1);
+
+    const int border = 400, room = 160;
+    for (int loop_y = border; loop_y < height - border; loop_y++)
+        for (int loop_x = border; loop_x < width - border; loop_x++)
+        {
+            int x = loop_x - border, y = loop_y - border;
+            bool wall = ( x % room == 0 ) || ( y % room == 0 ) || ( loop_x == width - border - 1 ) || ( loop_y == height - border - 1 );
+            // doors in the middle of each wall
+            bool door = ( abs(x % room - room / 2) < 16 ) || ( abs(y % room - room / 2) < 16 );
+            occupancy[size_t(width) * loop_y + loop_x] = ( wall && !door ) ? 100 : 0;
+        }
+
+    // furniture
+    srand(1);
+    for (int loop = 0; loop < 20000; loop++)
+    {
+        int x = border + rand() % ( width - 2 * border - 20 ), y = border + rand() % ( height - 2 * border - 20 );
+        int size_x = 2 + rand() % 16, size_y = 2 + rand() % 16;
+        for (int loop_y = y; loop_y < y + size_y; loop_y++)
+            for (int loop_x = x; loop_x < x + size_x; loop_x++)
+                occupancy[size_t(width) * loop_y + loop_x] = 100;
+    }
+
+}
+
+struct simulated_scan
+{
+    float x, y, orientation;
+    vector<float> r, theta;
+    // beams with an echo
+    vector<bool> valid;
+};
+
+static float random_float(float min, float max)
+{
+
+    return (min + ( max - min ) * rand() / RAND_MAX);
+
+}
+
+// ranges of the beams of a laser at (x, y, orientation), by ray marching in the map
+static void simulate_scan(const localization_map& map, simulated_scan& scan)
+{
+
+    float angle_inc = ( scan_angle_max - scan_angle_min ) / scan_beams;
+    scan.r.resize(scan_beams);
+    scan.theta.resize(scan_beams);
+    scan.valid.resize(scan_beams);
+    for (int loop = 0; loop < scan_beams; loop++)
+    {
+        scan.theta[loop] = scan_angle_min + loop * angle_inc;
+        float c = cos(scan.orientation + scan.theta[loop]), s = sin(scan.orientation + scan.theta[loop]);
+        float range = 0;
+        while ( ( range < scan_range_max ) && ( map.cell_value(scan.x + range * c, scan.y + range * s) != 100 ) )
+            range += map.cell_size / 8;
+        scan.valid[loop] = range < scan_range_max;
+        if ( scan.valid[loop] )
+        {
+            // gaussian noise (Box-Muller)
+            float u = random_float(1e-6, 1), v = random_float(0, 1);
+            range += scan_noise * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+        }
+        scan.r[loop] = min<float>(range, scan_range_max);
+    }
+
+}
+
+static bool read_scan_file(const char* file, vector<simulated_scan>& scans)
+{
+
+    ifstream in(file);
+    int nb_beams;
+    float angle_min, angle_increment, range_max;
+    if ( !( in >> nb_beams >> angle_min >> angle_increment >> range_max ) || ( nb_beams <= 0 ) )
+        return (false);
+
+    simulated_scan scan;
+    while ( in >> scan.x >> scan.y >> scan.orientation )
+    {
+        scan.r.resize(nb_beams);
+        scan.theta.resize(nb_beams);
+        scan.valid.resize(nb_beams);
+        for (int loop = 0; loop < nb_beams; loop++)
+        {
+            in >> scan.r[loop];
+            scan.theta[loop] = angle_min + loop * angle_increment;
+            scan.valid[loop] = ( scan.r[loop] > 0 ) && ( scan.r[loop] < range_max );
+            if ( !scan.valid[loop] )
+                scan.r[loop] = range_max;
+        }
+        if ( !in )
+            return (false);
+        scans.push_back(scan);
+    }
+
+    return (!scans.empty());
+
+}
+
+// accuracy and time of the search for each reduction of the scans, with or without the continuous refinement
+static void benchmark_reductions(const localization_map& map, const vector<simulated_scan>& scans)
+{
+
+    struct
+    {
+        const char* name;
+        scan_reduction reduction;
+        bool refine;
+    } reductions[] = {
+        { "all beams", { false, 0, 0 }, false },
+        { "valid", { true, 0, 0 }, false },
+        { "voxel 0.05", { true, 0.05, 0 }, false },
+        { "voxel 0.1", { true, 0.1, 0 }, false },
+        { "voxel 0.2", { true, 0.2, 0 }, false },
+        { "info 120", { true, 0, 120 }, false },
+        { "info 60", { true, 0, 60 }, false },
+        { "voxel+info", { true, 0.1, 120 }, false },
+        { "valid+LM", { true, 0, 0 }, true },
+        { "info 120+LM", { true, 0, 120 }, true },
+    };
+    const int nb_reductions = sizeof(reductions) / sizeof(reductions[0]);
+
+    printf("\n%-12s %10s %12s %10s %12s %12s %14s\n", "reduction", "beams", "ms/search", "speedup", "error (m)", "max (m)", "error (deg)");
+    double reference_duration = 0;
+    scan_matcher matcher(map, false, true);
+    for (int loop_reduction = 0; loop_reduction < nb_reductions; loop_reduction++)
+    {
+        // the same predictions for every reduction
+        srand(4);
+        double duration = 0, error = 0, error_max = 0, error_orientation = 0, nb_kept = 0;
+        for (size_t loop = 0; loop < scans.size(); loop++)
+        {
+            const simulated_scan& scan = scans[loop];
+            vector<float> r, theta;
+            // vector<bool> is packed, the reduction takes an array of flags
+            vector<char> valid(scan.valid.begin(), scan.valid.end());
+            int nb_reduced = reduce_scan(reductions[loop_reduction].reduction, scan.r.size(), &scan.r[0], &scan.theta[0], (const bool*)&valid[0], r, theta);
+            nb_kept += nb_reduced;
+
+            float predicted_x = scan.x + random_float(-0.2, 0.2), predicted_y = scan.y + random_float(-0.2, 0.2);
+            float predicted_orientation = scan.orientation + random_float(-0.2, 0.2);
+            search_window window = scan_matcher::make_window(predicted_x - 0.5, predicted_x + 0.5, predicted_y - 0.5, predicted_y + 0.5,
+                                                             predicted_orientation - M_PI / 6, predicted_orientation + M_PI / 6, map.cell_size, M_PI / 36);
+            double start = now();
+            matcher.set_scan(nb_reduced, r.data(), theta.data());
+            search_result best = matcher.branch_and_bound_search(window);
+            if ( reductions[loop_reduction].refine )
+                best = matcher.refine(window, best);
+            duration += now() - start;
+
+            float position_error = hypot(best.x - scan.x, best.y - scan.y);
+            error += position_error;
+            error_max = max<double>(error_max, position_error);
+            error_orientation += fabs(remainder(best.orientation - scan.orientation, 2 * M_PI));
+        }
+        if ( loop_reduction == 0 )
+            reference_duration = duration;
+
+        printf("%-12s %10.0f %12.3f %10.2f %12.3f %12.3f %14.2f\n", reductions[loop_reduction].name, nb_kept / scans.size(),
+               duration * 1000 / scans.size(), reference_duration / duration, error / scans.size(), error_max, error_orientation * 180 / M_PI / scans.size());
+    }
+
+}
+
+// exhaustive and branch and bound searches with and without the bounded scores
+static void benchmark_early_termination(const localization_map& map, const vector<simulated_scan>& scans)
+{
+
+    printf("\n%-24s %12s %14s %16s %10s\n", "search", "ms/search", "positions", "beams skipped", "parity");
+    for (int loop_search = 0; loop_search < 2; loop_search++)
+    {
+        search_result results[2][nb_scans];
+        for (int loop_bounded = 0; loop_bounded < 2; loop_bounded++)
+        {
+            scan_matcher matcher(map, false, true);
+            matcher.set_bounded(loop_bounded);
+            srand(5);
+            double duration = 0, nb_positions = 0, nb_beams = 0, nb_skipped = 0;
+            const int nb_tested = min<int>(scans.size(), nb_scans);
+            for (int loop = 0; loop < nb_tested; loop++)
+            {
+                const simulated_scan& scan = scans[loop];
+                matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+                float predicted_x = scan.x + random_float(-0.2, 0.2), predicted_y = scan.y + random_float(-0.2, 0.2);
+                float predicted_orientation = scan.orientation + random_float(-0.2, 0.2);
+                search_window window = scan_matcher::make_window(predicted_x - 0.5, predicted_x + 0.5, predicted_y - 0.5, predicted_y + 0.5,
+                                                                 predicted_orientation - M_PI / 6, predicted_orientation + M_PI / 6, map.cell_size, M_PI / 36);
+                double start = now();
+                search_result& best = results[loop_bounded][loop];
+                best = ( loop_search == 0 ) ? matcher.exhaustive_search(window) : matcher.branch_and_bound_search(window);
+                duration += now() - start;
+                nb_positions += best.nb_scored;
+                nb_beams += double(best.nb_scored) * scan.r.size();
+                nb_skipped += double(best.nb_scored) * scan.r.size() - best.nb_beams_scored;
+            }
+
+            // the bounded scores must find the same positions with the same scores
+            bool parity = true;
+            for (int loop = 0; loop_bounded && ( loop < nb_tested ); loop++)
+                parity = parity && ( results[0][loop].x == results[1][loop].x ) && ( results[0][loop].y == results[1][loop].y )
+                                && ( results[0][loop].orientation == results[1][loop].orientation ) && ( results[0][loop].score == results[1][loop].score );
+
+            char name[64];
+            snprintf(name, sizeof(name), "%s %s", ( loop_search == 0 ) ? "exhaustive" : "branch and bound", loop_bounded ? "bounded" : "full");
+            printf("%-24s %12.3f %14.0f %15.1f%% %10s\n", name, duration * 1000 / nb_tested, nb_positions / nb_tested, 100 * nb_skipped / nb_beams,
+                   loop_bounded ? ( parity ? "yes" : "NO" ) : "-");
+        }
+    }
+
+}
+
+// branch and bound searches stopped at a deadline
+static void benchmark_anytime(const localization_map& map, const vector<simulated_scan>& scans)
+{
+
+    const double deadlines[] = { 0, 2e-3, 1e-3, 0.5e-3, 0.25e-3, 0.1e-3 };
+    const int nb_deadlines = sizeof(deadlines) / sizeof(deadlines[0]);
+    const int nb_tested = min<int>(scans.size(), nb_scans);
+
+    printf("\n%-12s %12s %12s %12s %12s %14s\n", "deadline", "ms/search", "coverage", "complete", "error (m)", "same position");
+    vector<search_result> complete_results(nb_tested);
+    scan_matcher matcher(map, false, true);
+    for (int loop_deadline = 0; loop_deadline < nb_deadlines; loop_deadline++)
+    {
+        matcher.set_deadline(deadlines[loop_deadline]);
+        srand(6);
+        double duration = 0, coverage = 0, error = 0;
+        int nb_complete = 0, nb_same = 0;
+        for (int loop = 0; loop < nb_tested; loop++)
+        {
+            const simulated_scan& scan = scans[loop];
+            matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+            float predicted_x = scan.x + random_float(-0.2, 0.2), predicted_y = scan.y + random_float(-0.2, 0.2);
+            float predicted_orientation = scan.orientation + random_float(-0.2, 0.2);
+            search_window window = scan_matcher::make_window(predicted_x - 0.5, predicted_x + 0.5, predicted_y - 0.5, predicted_y + 0.5,
+                                                             predicted_orientation - M_PI / 6, predicted_orientation + M_PI / 6, map.cell_size, M_PI / 36);
+            double start = now();
+            search_result best = matcher.branch_and_bound_search(window);
+            duration += now() - start;
+
+            if ( loop_deadline == 0 )
+                complete_results[loop] = best;
+            coverage += best.coverage;
+            nb_complete += best.complete;
+            nb_same += ( best.x == complete_results[loop].x ) && ( best.y == complete_results[loop].y ) && ( best.orientation == complete_results[loop].orientation );
+            error += hypot(best.x - scan.x, best.y - scan.y);
+        }
+
+        char name[32];
+        if ( deadlines[loop_deadline] > 0 )
+            snprintf(name, sizeof(name), "%.2f ms", deadlines[loop_deadline] * 1000);
+        else
+            snprintf(name, sizeof(name), "none");
+        printf("%-12s %12.3f %11.1f%% %11.0f%% %12.3f %13.0f%%\n", name, duration * 1000 / nb_tested, 100 * coverage / nb_tested,
+               100.0 * nb_complete / nb_tested, error / nb_tested, 100.0 * nb_same / nb_tested);
+    }
+
+}
+
+// global relocalization: the place index is queried with each scan, and its candidates are verified by a search
+// the robot is relocalized if the position found is at less than 0.2 m and 10 degrees from the true position
+static void benchmark_relocalization(const localization_map& map, const vector<simulated_scan>& scans)
+{
+
+    const int nb_tested = scans.size();
+
+    printf("\n%-10s %12s %10s %12s %10s %12s %14s\n", "step (m)", "places", "build (s)", "candidates", "query ms", "verify ms", "relocalized");
+    const float steps[] = { 1.0, 0.5 };
+    const int nb_candidates[] = { 1, 10, 50 };
+    for (int loop_step = 0; loop_step < 2; loop_step++)
+    {
+        place_index places;
+        double start = now();
+        places.build(map, steps[loop_step], scan_range_max);
+        double build_duration = now() - start;
+
+        scan_matcher matcher(map, false, true);
+        matcher.set_nb_threads(4);
+        for (int loop_candidates = 0; loop_candidates < 3; loop_candidates++)
+        {
+            double query_duration = 0, verify_duration = 0;
+            int nb_relocalized = 0;
+            for (int loop = 0; loop < nb_tested; loop++)
+            {
+                const simulated_scan& scan = scans[loop];
+                const int nb_beams = scan.r.size();
+                vector<char> valid_beams(scan.valid.begin(), scan.valid.end());
+                const bool* valid = (const bool*)&valid_beams[0];
+
+                vector<place_candidate> candidates;
+                start = now();
+                places.query(nb_beams, &scan.r[0], &scan.theta[0], valid, nb_candidates[loop_candidates], candidates);
+                query_duration += now() - start;
+
+                vector<float> reduced_r, reduced_theta;
+                scan_reduction reduction = { true, 0, 120 };
+                int nb_reduced = reduce_scan(reduction, nb_beams, &scan.r[0], &scan.theta[0], valid, reduced_r, reduced_theta);
+                start = now();
+                matcher.set_scan(nb_reduced, &reduced_r[0], &reduced_theta[0]);
+                search_result best = places.verify(matcher, candidates, map.cell_size, M_PI / 36, true);
+                verify_duration += now() - start;
+
+                float angle_error = fabs(remainder(best.orientation - scan.orientation, 2 * M_PI));
+                if ( best.found && ( hypot(best.x - scan.x, best.y - scan.y) < 0.2 ) && ( angle_error < 10 * M_PI / 180 ) )
+                    nb_relocalized++;
+            }
+
+            printf("%-10.2f %12d %10.2f %12d %10.3f %12.3f %13.0f%%\n", steps[loop_step], places.size(), build_duration, nb_candidates[loop_candidates],
+                   query_duration * 1000 / nb_tested, verify_duration * 1000 / nb_tested, 100.0 * nb_relocalized / nb_tested);
+        }
+    }
+
+}
+
+// motion between two consecutive scans measured by the scan odometry, against an odometry whose wheels slip by up to 30%
+// the scans are simulated from the map, one step of 5 to 15 cm and up to 10 degrees apart
+static void benchmark_scan_odometry(const localization_map& map)
+{
+
+    const int nb_tested = 200;
+    srand(5);
+    double odom_error = 0, odom_angle_error = 0, scan_error = 0, scan_angle_error = 0, duration = 0;
+    int nb_matched = 0;
+    for (int loop = 0; loop < nb_tested; loop++)
+    {
+        simulated_scan first, second;
+        float step, turn;
+        do
+        {
+            do
+            {
+                first.x = random_float(map.min_x, map.max_x);
+                first.y = random_float(map.min_y, map.max_y);
+            }
+            while ( map.cell_value(first.x, first.y) != 0 );
+            first.orientation = random_float(-M_PI, M_PI);
+            step = random_float(0.05, 0.15);
+            turn = random_float(-10, 10) * M_PI / 180;
+            second.orientation = first.orientation + turn;
+            second.x = first.x + step * cos(first.orientation);
+            second.y = first.y + step * sin(first.orientation);
+        }
+        while ( map.cell_value(second.x, second.y) != 0 );
+        simulate_scan(map, first);
+        simulate_scan(map, second);
+
+        // the odometry sees the motion with a slip
+        float slip = random_float(0.7, 1.3), angle_slip = random_float(0.7, 1.3);
+        float odom_step = step * slip, odom_turn = turn * angle_slip;
+
+        scan_odometry odometry;
+        vector<char> first_valid(first.valid.begin(), first.valid.end()), second_valid(second.valid.begin(), second.valid.end());
+        odometry.add_scan(first.r.size(), &first.r[0], &first.theta[0], (const bool*)&first_valid[0], 0, 0, 0);
+        double start = now();
+        bool matched = odometry.add_scan(second.r.size(), &second.r[0], &second.theta[0], (const bool*)&second_valid[0], odom_step, 0, odom_turn);
+        duration += now() - start;
+
+        odom_error += fabs(odom_step - step);
+        odom_angle_error += fabs(odom_turn - turn);
+        scan_error += hypot(odometry.x - step, odometry.y);
+        scan_angle_error += fabs(remainder(odometry.orientation - turn, 2 * M_PI));
+        nb_matched += matched;
+    }
+
+    printf("\n%-16s %12s %12s %12s %10s\n", "motion", "error (m)", "error (deg)", "matched", "ms/scan");
+    printf("%-16s %12.4f %12.3f %12s %10s\n", "odometry", odom_error / nb_tested, odom_angle_error / nb_tested * 180 / M_PI, "", "");
+    printf("%-16s %12.4f %12.3f %11.0f%% %10.3f\n", "scan odometry", scan_error / nb_tested, scan_angle_error / nb_tested * 180 / M_PI,
+           100.0 * nb_matched / nb_tested, duration * 1000 / nb_tested);
+
+}
+
+// fraction of the beams with an echo of the scan that hit an obstacle of the map, or of the map with the changes of the layer
+static float hit_ratio(const localization_map& map, const overlay_layer* layer, const simulated_scan& scan)
+{
+
+    int nb_valid = 0, nb_hits = 0;
+    for (size_t loop = 0; loop < scan.r.size(); loop++)
+    {
+        if ( !scan.valid[loop] )
+            continue;
+        nb_valid++;
+        int x_int, y_int;
+        if ( map.cell_index(scan.x + scan.r[loop] * cos(scan.orientation + scan.theta[loop]), scan.y + scan.r[loop] * sin(scan.orientation + scan.theta[loop]), x_int, y_int) )
+            nb_hits += layer ? layer->cell_hit(x_int, y_int) : map.cell_hit(x_int, y_int);
+    }
+
+    return (nb_valid ? float(nb_hits) / nb_valid : 0);
+
+}
+
+// furniture added to the floor after the map was made: the scans are simulated in the changed floor,
+// the overlay learns the changes from the scans of a first tour, and the scores of a second tour are compared with and without the layer it publishes
+static void benchmark_overlay(const localization_map& map, int width, int height, float resolution, float origin_x, float origin_y, const vector<int8_t>& occupancy)
+{
+
+    vector<int8_t> changed(occupancy);
+    srand(8);
+    for (int loop = 0; loop < 3000; loop++)
+    {
+        int x = rand() % ( width - 20 ), y = rand() % ( height - 20 );
+        int size_x = 4 + rand() % 12, size_y = 4 + rand() % 12;
+        for (int loop_y = y; loop_y < y + size_y; loop_y++)
+            for (int loop_x = x; loop_x < x + size_x; loop_x++)
+                if ( changed[size_t(width) * loop_y + loop_x] == 0 )
+                    changed[size_t(width) * loop_y + loop_x] = 100;
+    }
+    localization_map world;
+    world.load(width, height, resolution, origin_x, origin_y, &changed[0], 0.05, false);
+
+    // two tours of the same positions, the second one 0.2 m and 10 degrees away from the first one
+    const int nb_tested = nb_scans;
+    vector<simulated_scan> first(nb_tested), second(nb_tested);
+    for (int loop = 0; loop < nb_tested; loop++)
+    {
+        do
+        {
+            first[loop].x = random_float(world.min_x, world.max_x);
+            first[loop].y = random_float(world.min_y, world.max_y);
+            first[loop].orientation = random_float(-M_PI, M_PI);
+            second[loop].x = first[loop].x + 0.2;
+            second[loop].y = first[loop].y;
+            second[loop].orientation = first[loop].orientation + 10 * M_PI / 180;
+        }
+        while ( ( world.cell_value(first[loop].x, first[loop].y) != 0 ) || ( world.cell_value(second[loop].x, second[loop].y) != 0 ) );
+        simulate_scan(world, first[loop]);
+        simulate_scan(world, second[loop]);
+    }
+
+    // cost of cell_value on the hot path, at the hits of the scans, without and with the changes of the layer
+    vector<float> hits;
+    for (int loop = 0; loop < nb_tested; loop++)
+        for (size_t loop_beam = 0; loop_beam < second[loop].r.size(); loop_beam++)
+        {
+            hits.push_back(second[loop].x + second[loop].r[loop_beam] * cos(second[loop].orientation + second[loop].theta[loop_beam]));
+            hits.push_back(second[loop].y + second[loop].r[loop_beam] * sin(second[loop].orientation + second[loop].theta[loop_beam]));
+        }
+
+    map_overlay overlay(map);
+    shared_ptr<const overlay_layer> layer = overlay.publish();
+    double cell_durations[3], publish_durations[2];
+    for (int loop_pass = 0; loop_pass < 2; loop_pass++)
+    {
+        int nb_occupied = 0;
+        double start = now();
+        for (size_t loop = 0; loop < hits.size(); loop += 2)
+            nb_occupied += map.cell_value(hits[loop], hits[loop + 1]) == 100;
+        cell_durations[0] = ( now() - start ) * 2e9 / hits.size();
+        start = now();
+        for (size_t loop = 0; loop < hits.size(); loop += 2)
+            nb_occupied += layer->cell_value(hits[loop], hits[loop + 1]) == 100;
+        cell_durations[loop_pass + 1] = ( now() - start ) * 2e9 / hits.size();
+        if ( nb_occupied < 0 )
+            printf("%d\n", nb_occupied);
+
+        if ( loop_pass == 0 )
+        {
+            start = now();
+            for (int loop = 0; loop < nb_tested; loop++)
+            {
+                vector<char> valid(first[loop].valid.begin(), first[loop].valid.end());
+                overlay.integrate(first[loop].x, first[loop].y, first[loop].orientation, first[loop].r.size(), &first[loop].r[0], &first[loop].theta[0], (const bool*)&valid[0]);
+            }
+            printf("\noverlay: %d scans integrated in %.3f ms/scan\n", nb_tested, ( now() - start ) * 1000 / nb_tested);
+
+            // the first layer with all the changes, then the layer of the changes of one more scan, as published by the node
+            start = now();
+            layer = overlay.publish();
+            publish_durations[0] = now() - start;
+            vector<char> valid(second[0].valid.begin(), second[0].valid.end());
+            for (int loop = 0; loop < 3; loop++)
+                overlay.integrate(second[0].x, second[0].y, second[0].orientation, second[0].r.size(), &second[0].r[0], &second[0].theta[0], (const bool*)&valid[0]);
+            start = now();
+            layer = overlay.publish();
+            publish_durations[1] = now() - start;
+            printf("layer: published in %.3f ms, then in %.3f ms after one more scan\n", publish_durations[0] * 1000, publish_durations[1] * 1000);
+        }
+    }
+
+    double static_ratio = 0, overlay_ratio = 0;
+    for (int loop = 0; loop < nb_tested; loop++)
+    {
+        static_ratio += hit_ratio(map, 0, second[loop]);
+        overlay_ratio += hit_ratio(map, layer.get(), second[loop]);
+    }
+    // the blocks of the overlay are the log-odds learned, the blocks of the layer the sure changes the searches read
+    printf("%-16s %12s %12s %14s %16s\n", "map", "hits/beam", "blocks", "memory (KB)", "ns/cell_value");
+    printf("%-16s %12.3f %12s %14.0f %16.1f\n", "static", static_ratio / nb_tested, "-", map.memory_size() / 1024.0, cell_durations[0]);
+    printf("%-16s %12s %12d %14s %16.1f\n", "empty overlay", "", 0, "", cell_durations[1]);
+    printf("%-16s %12.3f %12d %14.0f %16.1f\n", "with overlay", overlay_ratio / nb_tested, overlay.nb_blocks(), overlay.memory_size() / 1024.0, cell_durations[2]);
+    printf("%-16s %12s %12d %14.0f %16s\n", "layer", "", layer->nb_blocks(), layer->memory_size() / 1024.0, "");
+
+    // the searches of the second tour in the map, and in the map with the changes of the layer, as the localization node searches it
+    printf("\n%-16s %12s %12s %14s\n", "searched map", "error (m)", "score/beam", "ms/search");
+    for (int loop_map = 0; loop_map < 2; loop_map++)
+    {
+        scan_matcher matcher(map, false, true);
+        matcher.set_overlay(( loop_map == 0 ) ? 0 : layer.get());
+        double error = 0, score = 0;
+        double start = now();
+        srand(9);
+        for (int loop = 0; loop < nb_tested; loop++)
+        {
+            const simulated_scan& scan = second[loop];
+            matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+            float predicted_x = scan.x + random_float(-0.2, 0.2), predicted_y = scan.y + random_float(-0.2, 0.2);
+            float predicted_orientation = scan.orientation + random_float(-0.2, 0.2);
+            search_window window = scan_matcher::make_window(predicted_x - 0.5, predicted_x + 0.5, predicted_y - 0.5, predicted_y + 0.5,
+                                                             predicted_orientation - M_PI / 6, predicted_orientation + M_PI / 6, map.cell_size, M_PI / 36);
+            search_result best = matcher.branch_and_bound_search(window);
+            error += hypot(best.x - scan.x, best.y - scan.y);
+            score += best.score / scan.r.size();
+        }
+        printf("%-16s %12.4f %12.3f %14.3f\n", ( loop_map == 0 ) ? "static" : "overlay layer", error / nb_tested, score / nb_tested, ( now() - start ) * 1000 / nb_tested);
+    }
+
+}
+
+// scoring of tiles of neighboring positions, one position after the other (beams inner) or as batches (beams outer)
+// each tile is around another scan, so that its cells of the map are not in cache; the scores must be the same
+static void benchmark_batch(const localization_map& map, const vector<simulated_scan>& scans, cache_counter& counter)
+{
+
+    const int tile_size = 1 << score_tile_bits;
+    const int nb_positions = tile_size * tile_size;
+    printf("\n%-12s %-10s %-8s %12s %14s %12s\n", "score", "kernel", "scoring", "ns/pose", "misses/pose", "score sum");
+    for (int loop_mode = 0; loop_mode < 4; loop_mode++)
+    {
+        const bool likelihood = loop_mode & 1, vectorized = loop_mode & 2;
+        if ( vectorized && !scan_matcher::simd_supported() )
+            continue;
+        scan_matcher matcher(map, likelihood, false);
+        matcher.set_vectorized(vectorized);
+
+        for (int loop_batch = 0; loop_batch < 2; loop_batch++)
+        {
+            double duration = 0, score = 0;
+            long long misses = 0;
+            long nb_scored = 0;
+            srand(7);
+            for (int loop_repeat = 0; loop_repeat < nb_random_poses / ( nb_positions * int(scans.size()) ); loop_repeat++)
+                for (size_t loop = 0; loop < scans.size(); loop++)
+                {
+                    const simulated_scan& scan = scans[loop];
+                    matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+                    float x[score_batch_size], y[score_batch_size], o[score_batch_size], scores[score_batch_size];
+                    int nb_evaluated[score_batch_size];
+                    float tile_x = scan.x + random_float(-0.5, 0.5), tile_y = scan.y + random_float(-0.5, 0.5), tile_o = scan.orientation + random_float(-0.5, 0.5);
+                    for (int loop_position = 0; loop_position < nb_positions; loop_position++)
+                    {
+                        x[loop_position] = tile_x + ( loop_position % tile_size ) * map.cell_size;
+                        y[loop_position] = tile_y + ( loop_position / tile_size ) * map.cell_size;
+                        o[loop_position] = tile_o;
+                    }
+
+                    counter.start();
+                    double start = now();
+                    if ( loop_batch )
+                        matcher.score_batch(nb_positions, x, y, o, no_threshold, scores, nb_evaluated);
+                    else
+                        for (int loop_position = 0; loop_position < nb_positions; loop_position++)
+                            scores[loop_position] = matcher.score(x[loop_position], y[loop_position], o[loop_position]);
+                    duration += now() - start;
+                    misses += counter.stop();
+                    for (int loop_position = 0; loop_position < nb_positions; loop_position++)
+                        score += scores[loop_position];
+                    nb_scored += nb_positions;
+                }
+
+            printf("%-12s %-10s %-8s %12.1f %14.1f %12.1f\n", likelihood ? "likelihood" : "hits", vectorized ? "avx2" : "scalar", loop_batch ? "batch" : "single",
+                   duration * 1e9 / nb_scored, counter.available() ? double(misses) / nb_scored : -1.0, score);
+        }
+    }
+
+}
+
+// expected ranges of the beams of the scans: ray marching in the map, as simulate_scan, against the range table
+static void benchmark_range_table(const localization_map& map, const vector<simulated_scan>& scans)
+{
+
+    range_table built;
+    double start = now();
+    if ( !built.build(map, node_search_threads) )
+    {
+        printf("\nthe map is too large for the range table\n");
+        return;
+    }
+    double build = now() - start;
+
+    // the table written by map_compiler is mapped by the nodes: the ranges are read from the mapped file
+    const char* file = "localization_benchmark.ranges";
+    range_table ranges;
+    start = now();
+    bool saved = built.save(file);
+    double save = now() - start;
+    start = now();
+    bool mapped = saved && ranges.open(file, map);
+    double open = now() - start;
+    remove(file);
+    if ( !mapped )
+    {
+        printf("\ncannot save and map the range table\n");
+        return;
+    }
+
+    vector<float> marched, read;
+    double march_duration = 0, table_duration = 0;
+    for (size_t loop = 0; loop < scans.size(); loop++)
+    {
+        const simulated_scan& scan = scans[loop];
+        start = now();
+        for (size_t loop_beam = 0; loop_beam < scan.theta.size(); loop_beam++)
+        {
+            float c = cos(scan.orientation + scan.theta[loop_beam]), s = sin(scan.orientation + scan.theta[loop_beam]);
+            float range = 0;
+            while ( ( range < scan_range_max ) && ( map.cell_value(scan.x + range * c, scan.y + range * s) != 100 ) )
+                range += map.cell_size / 8;
+            marched.push_back(min<float>(range, scan_range_max));
+        }
+        march_duration += now() - start;
+
+        start = now();
+        for (size_t loop_beam = 0; loop_beam < scan.theta.size(); loop_beam++)
+            read.push_back(ranges.range(scan.x, scan.y, scan.orientation + scan.theta[loop_beam], scan_range_max));
+        table_duration += now() - start;
+    }
+
+    vector<float> errors(read.size());
+    for (size_t loop = 0; loop < read.size(); loop++)
+        errors[loop] = fabs(read[loop] - marched[loop]);
+    sort(errors.begin(), errors.end());
+    const size_t nb_ranges = errors.size();
+    printf("\nrange table: built in %.2f s with %d threads, %.1f MB, saved in %.2f s, mapped in %.3f s\n", build, node_search_threads,
+           ranges.memory_size() / 1048576.0, save, open);
+    printf("%-12s %12s %12s %12s %12s %12s\n", "", "ns/range", "median (m)", "p90 (m)", "p99 (m)", "< 5 cm");
+    printf("%-12s %12.1f\n", "marching", march_duration * 1e9 / nb_ranges);
+    printf("%-12s %12.1f %12.3f %12.3f %12.3f %11.1f%%\n", "table", table_duration * 1e9 / nb_ranges, errors[nb_ranges / 2], errors[nb_ranges * 9 / 10],
+           errors[nb_ranges * 99 / 100], 100.0 * ( lower_bound(errors.begin(), errors.end(), 0.05f) - errors.begin() ) / nb_ranges);
+
+    // searches scoring the hits, and the beam model read in the table for the best positions of the hits, with one beam out of 6
+    const beam_mixture mixture = { 0.1, 0.7, 0.2, 0.1, 0.5, scan_range_max, true };
+    printf("%-12s %12s %12s %12s\n", "search", "ms/search", "error (m)", "error (deg)");
+    for (int loop_model = 0; loop_model < 2; loop_model++)
+    {
+        scan_matcher matcher(map, false, false);
+        if ( loop_model == 1 )
+            matcher.set_ranges(&ranges, mixture, true);
+        double duration = 0, error = 0, angle_error = 0;
+        srand(11);
+        for (size_t loop = 0; loop < scans.size(); loop++)
+        {
+            const simulated_scan& scan = scans[loop];
+            vector<float> r, theta;
+            bool echo[scan_beams];
+            for (size_t loop_beam = 0; loop_beam < scan.r.size(); loop_beam += 6)
+            {
+                // the hits only score the beams with an echo, as the searches of the node
+                if ( ( loop_model == 0 ) && !scan.valid[loop_beam] )
+                    continue;
+                echo[r.size()] = scan.valid[loop_beam];
+                r.push_back(scan.r[loop_beam]);
+                theta.push_back(scan.theta[loop_beam]);
+            }
+            matcher.set_scan(r.size(), &r[0], &theta[0], echo);
+            float predicted_x = scan.x + random_float(-0.1, 0.1), predicted_y = scan.y + random_float(-0.1, 0.1);
+            float predicted_orientation = scan.orientation + random_float(-0.05, 0.05);
+            search_window window = scan_matcher::make_window(predicted_x - 0.2, predicted_x + 0.2, predicted_y - 0.2, predicted_y + 0.2,
+                                                             predicted_orientation - M_PI / 36, predicted_orientation + M_PI / 36, map.cell_size, M_PI / 180);
+            start = now();
+            search_result best = matcher.branch_and_bound_search(window);
+            duration += now() - start;
+            error += hypot(best.x - scan.x, best.y - scan.y);
+            angle_error += fabs(remainder(best.orientation - scan.orientation, 2 * M_PI)) * 180 / M_PI;
+        }
+        printf("%-12s %12.1f %12.4f %12.3f\n", ( loop_model == 0 ) ? "hits" : "beam model", duration * 1000 / scans.size(), error / scans.size(),
+               angle_error / scans.size());
+    }
+
+}
+
+// time and accuracy of a scoring or search variant, compared with the baseline
+struct variant_result
+{
+    string name;
+    bool search;
+    // ns per position for the scores, ms per search for the searches
+    double time;
+    // scores: fraction of the positions scored at least as high as the true position
+    // searches: errors of the position found, in meters and degrees
+    double error, angle_error;
+};
+
+// the scoring kernels on tiles of 4 x 4 neighboring positions around the true position, as scored by the searches
+static void benchmark_score_variants(const localization_map& map, const vector<simulated_scan>& scans, cache_counter& counter, vector<variant_result>& results)
+{
+
+    const int tile_size = 1 << score_tile_bits;
+    const int nb_positions = tile_size * tile_size;
+    const int nb_tiles = max(nb_random_poses / ( nb_positions * int(scans.size()) ), 1);
+    printf("\n%-24s %12s %12s %14s %12s\n", "score", "ns/pose", "poses/s", "misses/pose", "above true");
+    for (int loop_variant = 0; loop_variant < 8; loop_variant++)
+    {
+        const bool likelihood = loop_variant & 1, vectorized = loop_variant & 2, batch = loop_variant & 4;
+        if ( vectorized && !scan_matcher::simd_supported() )
+            continue;
+        scan_matcher matcher(map, likelihood, false);
+        matcher.set_vectorized(vectorized);
+
+        double duration = 0;
+        long long misses = 0;
+        long nb_scored = 0, nb_above = 0;
+        srand(11);
+        for (size_t loop = 0; loop < scans.size(); loop++)
+        {
+            const simulated_scan& scan = scans[loop];
+            matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+            const float true_score = matcher.score(scan.x, scan.y, scan.orientation);
+            for (int loop_tile = 0; loop_tile < nb_tiles; loop_tile++)
+            {
+                float x[score_batch_size], y[score_batch_size], o[score_batch_size], scores[score_batch_size];
+                int nb_evaluated[score_batch_size];
+                float tile_x = scan.x + random_float(-0.3, 0.3), tile_y = scan.y + random_float(-0.3, 0.3), tile_o = scan.orientation + random_float(-0.3, 0.3);
+                for (int loop_position = 0; loop_position < nb_positions; loop_position++)
+                {
+                    x[loop_position] = tile_x + ( loop_position % tile_size ) * map.cell_size;
+                    y[loop_position] = tile_y + ( loop_position / tile_size ) * map.cell_size;
+                    o[loop_position] = tile_o;
+                }
+
+                // the fastest of the repeats, the others were slowed down by the rest of the system
+                double best_duration = 0;
+                long long best_misses = 0;
+                for (int loop_repeat = 0; loop_repeat < variant_repeats; loop_repeat++)
+                {
+                    counter.start();
+                    double start = now();
+                    if ( batch )
+                        matcher.score_batch(nb_positions, x, y, o, no_threshold, scores, nb_evaluated);
+                    else
+                        for (int loop_position = 0; loop_position < nb_positions; loop_position++)
+                            scores[loop_position] = matcher.score(x[loop_position], y[loop_position], o[loop_position]);
+                    double tile_duration = now() - start;
+                    long long tile_misses = counter.stop();
+                    if ( ( loop_repeat == 0 ) || ( tile_duration < best_duration ) )
+                    {
+                        best_duration = tile_duration;
+                        best_misses = tile_misses;
+                    }
+                }
+                duration += best_duration;
+                misses += best_misses;
+
+                for (int loop_position = 0; loop_position < nb_positions; loop_position++)
+                    nb_above += scores[loop_position] >= true_score;
+                nb_scored += nb_positions;
+            }
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "%s/%s/%s", likelihood ? "likelihood" : "hits", vectorized ? "avx2" : "scalar", batch ? "batch" : "single");
+        variant_result result = { name, false, duration * 1e9 / nb_scored, double(nb_above) / nb_scored, 0 };
+        results.push_back(result);
+        printf("%-24s %12.1f %12.0f %14.1f %11.2f%%\n", name, result.time, nb_scored / duration, counter.available() ? double(misses) / nb_scored : -1.0,
+               100 * result.error);
+    }
+
+}
+
+// the searches of find_best_position after a motion: +-0.5 m, +-30 degrees around a prediction off by up to 0.2 m and 0.2 radian
+static void benchmark_search_variants(const localization_map& map, const vector<simulated_scan>& scans, cache_counter& counter, vector<variant_result>& results)
+{
+
+    // the likelihood searches need the pyramid of distances, not built for the reference map
+    const char* names[] = { "exhaustive", "exhaustive/correlative", "bnb", "bnb/refine", "bnb/deadline", "bnb/threads" };
+    vector<search_result> reference(scans.size());
+    printf("\n%-24s %12s %12s %14s %12s %12s %8s\n", "search", "ms/search", "poses/s", "misses/search", "error (m)", "error (deg)", "parity");
+    for (int loop_variant = 0; loop_variant < 6; loop_variant++)
+    {
+        const string name = names[loop_variant];
+        scan_matcher matcher(map, false, name != "exhaustive");
+        if ( name == "bnb/deadline" )
+            matcher.set_deadline(variant_deadline);
+        if ( name == "bnb/threads" )
+            matcher.set_nb_threads(node_search_threads);
+
+        double duration = 0, error = 0, angle_error = 0;
+        long long misses = 0;
+        long nb_scored = 0;
+        bool parity = true;
+        srand(13);
+        for (size_t loop = 0; loop < scans.size(); loop++)
+        {
+            const simulated_scan& scan = scans[loop];
+            matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+            float predicted_x = scan.x + random_float(-0.2, 0.2), predicted_y = scan.y + random_float(-0.2, 0.2);
+            float predicted_orientation = scan.orientation + random_float(-0.2, 0.2);
+            search_window window = scan_matcher::make_window(predicted_x - 0.5, predicted_x + 0.5, predicted_y - 0.5, predicted_y + 0.5,
+                                                             predicted_orientation - M_PI / 6, predicted_orientation + M_PI / 6, map.cell_size, M_PI / 36);
+
+            // the fastest of the repeats, the others were slowed down by the rest of the system
+            search_result best;
+            double best_duration = 0;
+            long long best_misses = 0;
+            for (int loop_repeat = 0; loop_repeat < variant_repeats; loop_repeat++)
+            {
+                counter.start();
+                double start = now();
+                best = ( loop_variant < 2 ) ? matcher.exhaustive_search(window) : matcher.branch_and_bound_search(window);
+                if ( name == "bnb/refine" )
+                    best = matcher.refine(window, best);
+                double search_duration = now() - start;
+                long long search_misses = counter.stop();
+                if ( ( loop_repeat == 0 ) || ( search_duration < best_duration ) )
+                {
+                    best_duration = search_duration;
+                    best_misses = search_misses;
+                }
+            }
+            duration += best_duration;
+            misses += best_misses;
+
+            nb_scored += best.nb_scored;
+            error += hypot(best.x - scan.x, best.y - scan.y);
+            angle_error += fabs(remainder(best.orientation - scan.orientation, 2 * M_PI)) * 180 / M_PI;
+
+            // the complete searches over the hits find the same position as the correlative exhaustive search
+            if ( loop_variant == 1 )
+                reference[loop] = best;
+            else if ( ( name == "bnb" ) || ( name == "bnb/threads" ) )
+                parity = parity && ( best.x == reference[loop].x ) && ( best.y == reference[loop].y ) && ( best.orientation == reference[loop].orientation );
+        }
+
+        const int nb_tested = scans.size();
+        variant_result result = { name, true, duration * 1000 / nb_tested, error / nb_tested, angle_error / nb_tested };
+        // a search that loses the parity is a regression, whatever its baseline
+        if ( !parity )
+            result.error = 1e9;
+        results.push_back(result);
+        printf("%-24s %12.3f %12.0f %14.1f %12.4f %12.3f %8s\n", name.c_str(), result.time, nb_scored / duration,
+               counter.available() ? double(misses) / nb_tested : -1.0, error / nb_tested, result.angle_error,
+               ( ( name == "bnb" ) || ( name == "bnb/threads" ) ) ? ( parity ? "yes" : "NO" ) : "-");
+    }
+
+}
+
+static bool save_baseline(const string& file, const vector<variant_result>& results)
+{
+
+    FILE* out = fopen(file.c_str(), "w");
+    if ( !out )
+        return (false);
+    for (size_t loop = 0; loop < results.size(); loop++)
+        fprintf(out, "%s %g %g %g\n", results[loop].name.c_str(), results[loop].time, results[loop].error, results[loop].angle_error);
+    return (fclose(out) == 0);
+
+}
+
+// returns false if a variant is slower or less accurate than in the baseline
+// the variants missing from the baseline, or from this run (no AVX2), are not compared
+static bool check_baseline(const string& file, const vector<variant_result>& results)
+{
+
+    ifstream in(file.c_str());
+    std::map<string, variant_result> baseline;
+    variant_result saved;
+    while ( in >> saved.name >> saved.time >> saved.error >> saved.angle_error )
+        baseline[saved.name] = saved;
+
+    bool passed = true;
+    printf("\n%-24s %12s %12s %12s %12s\n", "variant", "time", "baseline", "error", "baseline");
+    for (size_t loop = 0; loop < results.size(); loop++)
+    {
+        const variant_result& result = results[loop];
+        auto found = baseline.find(result.name);
+        if ( found == baseline.end() )
+            continue;
+        const variant_result& reference = found->second;
+        bool slower = result.time > reference.time * ( 1 + regression_time_tolerance );
+        bool less_accurate = result.search ? ( result.error > reference.error + regression_error_tolerance ) || ( result.angle_error > reference.angle_error + regression_angle_tolerance )
+                                           : ( result.error > reference.error + regression_rank_tolerance );
+        printf("%-24s %12.3f %12.3f %12.4f %12.4f %s\n", result.name.c_str(), result.time, reference.time, result.error, reference.error,
+               slower ? "SLOWER" : less_accurate ? "LESS ACCURATE" : "ok");
+        passed = passed && !slower && !less_accurate;
+    }
+
+    return (passed);
+
+}
+
+// search of the fleet load test: the search number search of the robot, around a prediction off by 0.1 m and 0.1 radian
+// returns the duration of the search
+static double fleet_search(scan_matcher& matcher, float resolution, const vector<simulated_scan>& scans, int robot, int search, double& error)
+{
+
+    const simulated_scan& scan = scans[( robot * fleet_searches + search ) % scans.size()];
+    matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+    float predicted_x = scan.x + 0.1 * cos(robot + search), predicted_y = scan.y + 0.1 * sin(robot + search);
+    float predicted_orientation = scan.orientation + 0.1 * cos(robot * search);
+    search_window window = scan_matcher::make_window(predicted_x - 0.5, predicted_x + 0.5, predicted_y - 0.5, predicted_y + 0.5,
+                                                     predicted_orientation - M_PI / 6, predicted_orientation + M_PI / 6, resolution, M_PI / 36);
+    double start = now();
+    search_result best = matcher.branch_and_bound_search(window);
+    error = hypot(best.x - scan.x, best.y - scan.y);
+
+    return (now() - start);
+
+}
+
+// one robot in the pool: each search is a job, which submits the next search of the robot when it is done
+// the matcher of the robot is kept from one search to the next, and splits each search in jobs of the pool
+static void fleet_robot(work_stealing_pool& pool, scan_matcher& matcher, float resolution, const vector<simulated_scan>& scans, int robot, int search, double* durations, double* errors)
+{
+
+    durations[search] = fleet_search(matcher, resolution, scans, robot, search, errors[search]);
+    if ( search + 1 < fleet_searches )
+        pool.submit([&pool, &matcher, resolution, &scans, robot, search, durations, errors] { fleet_robot(pool, matcher, resolution, scans, robot, search + 1, durations, errors); });
+
+}
+
+// load test of the fleet service: all the robots search their positions at the same time, each search after the previous one of its robot,
+// either with a node per robot, each with its map and its search threads, or with the map and a pool of threads shared by the robots
+static void benchmark_fleet(const localization_map& map, const vector<simulated_scan>& scans)
+{
+
+    const int fleet_sizes[] = { 1, 2, 4, 8, 16 };
+    printf("\n%-8s %-8s %12s %12s %12s %12s %10s %10s\n", "robots", "threads", "searches/s", "ms/search", "max ms", "map (MB)", "error (m)", "stolen");
+    for (int loop_size = 0; loop_size < 5; loop_size++)
+    {
+        const int nb_robots = fleet_sizes[loop_size];
+        for (int loop_mode = 0; loop_mode < 2; loop_mode++)
+        {
+            vector<double> durations(nb_robots * fleet_searches), errors(nb_robots * fleet_searches);
+            long stolen = 0;
+            int nb_threads;
+            double start = now();
+            if ( loop_mode == 0 )
+            {
+                vector<thread> nodes;
+                for (int loop = 0; loop < nb_robots; loop++)
+                    nodes.push_back(thread([&, loop]
+                    {
+                        scan_matcher matcher(map, false, true);
+                        matcher.set_nb_threads(node_search_threads);
+                        for (int loop_search = 0; loop_search < fleet_searches; loop_search++)
+                            durations[loop * fleet_searches + loop_search] = fleet_search(matcher, map.cell_size, scans, loop, loop_search, errors[loop * fleet_searches + loop_search]);
+                    }));
+                for (thread& node : nodes)
+                    node.join();
+                nb_threads = nb_robots * node_search_threads;
+            }
+            else
+            {
+                work_stealing_pool pool(0);
+                vector< unique_ptr<scan_matcher> > matchers;
+                for (int loop = 0; loop < nb_robots; loop++)
+                {
+                    matchers.push_back(unique_ptr<scan_matcher>(new scan_matcher(map, false, true)));
+                    scan_matcher& matcher = *matchers.back();
+                    matcher.set_nb_threads(node_search_threads);
+                    matcher.set_pool(&pool);
+                    double* robot_durations = &durations[loop * fleet_searches];
+                    double* robot_errors = &errors[loop * fleet_searches];
+                    const float resolution = map.cell_size;
+                    pool.submit([&pool, &matcher, resolution, &scans, loop, robot_durations, robot_errors]
+                    {
+                        fleet_robot(pool, matcher, resolution, scans, loop, 0, robot_durations, robot_errors);
+                    });
+                }
+                pool.wait_idle();
+                stolen = pool.nb_stolen();
+                nb_threads = pool.size();
+            }
+            double duration = now() - start;
+
+            double total = 0, longest = 0, error = 0;
+            for (size_t loop = 0; loop < durations.size(); loop++)
+            {
+                total += durations[loop];
+                longest = max(longest, durations[loop]);
+                error += errors[loop];
+            }
+            // each node has its own copy of the map
+            double memory = double(map.memory_size()) * ( loop_mode == 0 ? nb_robots : 1 ) / ( 1 << 20 );
+            printf("%-8d %-8d %12.1f %12.3f %12.3f %12.1f %10.3f %10s\n", nb_robots, nb_threads, durations.size() / duration, total * 1000 / durations.size(),
+                   longest * 1000, memory, error / durations.size(), loop_mode ? to_string(stolen).c_str() : "-");
+        }
+    }
+
+}
+
+static void usage(const char* name)
+{
+
+    printf("usage: %s [map.yaml [scans.txt]] [--save baseline.txt | --check baseline.txt]\n", name);
+
+}
+
+int main(int argc, char **argv)
+{
+
+    // files given on the command line, and the baseline to save or check
+    vector<string> files;
+    string baseline;
+    bool check = false;
+    for (int loop = 1; loop < argc; loop++)
+        if ( ( ( strcmp(argv[loop], "--save") == 0 ) || ( strcmp(argv[loop], "--check") == 0 ) ) && ( loop + 1 < argc ) )
+        {
+            check = strcmp(argv[loop], "--check") == 0;
+            baseline = argv[++loop];
+        }
+        else if ( ( strcmp(argv[loop], "--help") == 0 ) || ( strcmp(argv[loop], "-h") == 0 ) )
+        {
+            usage(argv[0]);
+            return 0;
+        }
+        else if ( ( strncmp(argv[loop], "--", 2) == 0 ) || ( files.size() == 2 ) )
+        {
+            // an unknown option, --save or --check without their file, or a third file
+            printf("unexpected argument %s\n", argv[loop]);
+            usage(argv[0]);
+            return 1;
+        }
+        else
+            files.push_back(argv[loop]);
+
+    int width, height;
+    float resolution, origin_x, origin_y;
+    vector<int8_t> occupancy;
+    if ( !files.empty() )
+    {
+        if ( !read_map_file(files[0], width, height, resolution, origin_x, origin_y, occupancy) )
+        {
+            printf("cannot read the map %s\n", files[0].c_str());
+            return 1;
+        }
+    }
+    else if ( read_map_file(default_map, width, height, resolution, origin_x, origin_y, occupancy) )
+        printf("map %s\n", default_map);
+    else
+        synthetic_floor(width, height, resolution, origin_x, origin_y, occupancy);
+    printf("map: %d x %d cells of %f m\n", width, height, resolution);
+
+    cache_counter counter;
+    if ( !counter.available() )
+        printf("hardware cache counters not available, only the time is measured\n");
+
+    // recorded scans, or scans from random free positions
+    localization_map reference;
+    reference.load(width, height, resolution, origin_x, origin_y, &occupancy[0], 0.05, false);
+    vector<simulated_scan> scans;
+    if ( files.size() > 1 )
+    {
+        if ( !read_scan_file(files[1].c_str(), scans) )
+        {
+            printf("cannot read the scans %s\n", files[1].c_str());
+            return 1;
+        }
+        printf("%lu recorded scans\n", scans.size());
+    }
+    else
+    {
+        srand(2);
+        scans.resize(nb_scans);
+        for (int loop = 0; loop < nb_scans; loop++)
+        {
+            do
+            {
+                scans[loop].x = random_float(reference.min_x, reference.max_x);
+                scans[loop].y = random_float(reference.min_y, reference.max_y);
+            }
+            while ( reference.cell_value(scans[loop].x, scans[loop].y) != 0 );
+            scans[loop].orientation = random_float(-M_PI, M_PI);
+            simulate_scan(reference, scans[loop]);
+        }
+    }
+
+    // the variants of the scores and of the searches, the regression gate
+    vector<variant_result> results;
+    benchmark_score_variants(reference, scans, counter, results);
+    benchmark_search_variants(reference, scans, counter, results);
+    if ( !baseline.empty() )
+    {
+        if ( !check || !ifstream(baseline.c_str()) )
+        {
+            if ( !save_baseline(baseline, results) )
+            {
+                printf("cannot write the baseline %s\n", baseline.c_str());
+                return 1;
+            }
+            printf("\nbaseline saved in %s\n", baseline.c_str());
+            return 0;
+        }
+        bool passed = check_baseline(baseline, results);
+        printf("\n%s\n", passed ? "no regression" : "REGRESSION");
+        return ( passed ? 0 : 1 );
+    }
+
+    printf("\n%-10s %14s %16s %14s %16s %10s %12s\n", "layout", "ns/pose", "misses/pose", "ms/search", "misses/search", "error (m)", "score sum");
+    const int nb_tested = scans.size();
+    for (int loop_layout = 0; loop_layout < 2; loop_layout++)
+    {
+        bool tiled = loop_layout == 1;
+        localization_map map;
+        map.set_tiled(tiled);
+        map.load(width, height, resolution, origin_x, origin_y, &occupancy[0], 0.05, false);
+
+        // scoring of positions around the scans, as the sensor model does in a search
+        scan_matcher matcher(map, false, false);
+        srand(3);
+        double duration = 0, score = 0;
+        long long misses = 0;
+        for (int loop = 0; loop < nb_tested; loop++)
+        {
+            const simulated_scan& scan = scans[loop];
+            matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+            vector<float> poses(3 * nb_random_poses / nb_tested);
+            for (size_t loop_pose = 0; loop_pose < poses.size(); loop_pose += 3)
+            {
+                poses[loop_pose] = scan.x + random_float(-1, 1);
+                poses[loop_pose + 1] = scan.y + random_float(-1, 1);
+                poses[loop_pose + 2] = scan.orientation + random_float(-M_PI, M_PI);
+            }
+            counter.start();
+            double start = now();
+            for (size_t loop_pose = 0; loop_pose < poses.size(); loop_pose += 3)
+                score += matcher.score(poses[loop_pose], poses[loop_pose + 1], poses[loop_pose + 2]);
+            duration += now() - start;
+            misses += counter.stop();
+        }
+        double ns_per_pose = duration * 1e9 / nb_random_poses;
+        double misses_per_pose = double(misses) / nb_random_poses;
+
+        // find_best_position after a motion: +-0.5 m, +-30 degrees around a noisy prediction
+        scan_matcher search_matcher(map, false, true);
+        double search_duration = 0, error = 0;
+        long long search_misses = 0;
+        for (int loop = 0; loop < nb_tested; loop++)
+        {
+            const simulated_scan& scan = scans[loop];
+            search_matcher.set_scan(scan.r.size(), &scan.r[0], &scan.theta[0]);
+            float predicted_x = scan.x + random_float(-0.2, 0.2), predicted_y = scan.y + random_float(-0.2, 0.2);
+            float predicted_orientation = scan.orientation + random_float(-0.2, 0.2);
+            search_window window = scan_matcher::make_window(predicted_x - 0.5, predicted_x + 0.5, predicted_y - 0.5, predicted_y + 0.5,
+                                                             predicted_orientation - M_PI / 6, predicted_orientation + M_PI / 6, resolution, M_PI / 36);
+            counter.start();
+            double start = now();
+            search_result best = search_matcher.branch_and_bound_search(window);
+            search_duration += now() - start;
+            search_misses += counter.stop();
+            error += hypot(best.x - scan.x, best.y - scan.y);
+        }
+
+        // the score sum must be the same for all the layouts
+        printf("%-10s %14.1f %16.1f %14.3f %16.1f %10.3f %12.0f\n", tiled ? "tiled" : "row-major", ns_per_pose,
+               counter.available() ? misses_per_pose : -1.0, search_duration * 1000 / nb_tested,
+               counter.available() ? double(search_misses) / nb_tested : -1.0, error / nb_tested, score);
+    }
+
+    benchmark_batch(reference, scans, counter);
+    benchmark_reductions(reference, scans);
+    benchmark_early_termination(reference, scans);
+    benchmark_anytime(reference, scans);
+    benchmark_relocalization(reference, scans);
+    benchmark_scan_odometry(reference);
+    benchmark_range_table(reference, scans);
+    benchmark_overlay(reference, width, height, resolution, origin_x, origin_y, occupancy);
+    benchmark_fleet(reference, scans);
+
+    return 0;
+}
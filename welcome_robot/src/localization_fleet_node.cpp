@@ -0,0 +1,49 @@
+// localization of a fleet of robots in one process
+// usage: localization_fleet_node [nb_robots]
+// the robots share the map, its distance field, the place index and the range table, which are loaded once,
+// and their updates and searches are run by one pool of threads instead of a node and a worker per robot
+// robot i subscribes to robot_i/scan, robot_i/odom and robot_i/initialpose, publishes robot_i/localization
+// and the transform from map to robot_i/odom, and saves its position in ~/.ros/robot_i_localization_pose.txt
+#include <localization.h>
+#include <memory>
+
+int main(int argc, char **argv)
+{
+
+    ros::init(argc, argv, "localization_fleet_node");
+
+    int nb_robots = ( argc > 1 ) ? atoi(argv[1]) : fleet_size;
+    if ( nb_robots <= 0 )
+    {
+        ROS_ERROR("usage: localization_fleet_node [nb_robots]");
+        return 1;
+    }
+
+    localization_map grid;
+    localization::load_map(grid);
+    place_index places;
+    localization::load_place_index(places);
+    range_table ranges;
+    localization::load_range_table(grid, ranges);
+
+    // the pool is destroyed after the robots, which wait for their jobs
+    work_stealing_pool pool(fleet_threads);
+    vector< unique_ptr<localization> > robots;
+    for (int loop = 0; loop < nb_robots; loop++)
+        robots.push_back(unique_ptr<localization>(new localization(fleet_namespace + to_string(loop), grid, places, ranges, pool)));
+    ROS_INFO("%i robots localized with %i threads", nb_robots, pool.size());
+
+    // each robot is updated at the rate of the odometry, a robot still busy with its previous update skips a period
+    ros::Rate r(odometry_rate);
+    while (ros::ok())
+    {
+        for (int loop = 0; loop < nb_robots; loop++)
+            robots[loop]->schedule_update();
+        r.sleep();
+    }
+
+    robots.clear();
+    ROS_INFO("%li jobs stolen", pool.nb_stolen());
+
+    return 0;
+}
@@ -0,0 +1,581 @@
+// map used by the localization
+#include <localization_map.h>
+#include <algorithm>
+#include <limits>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+localization_map::localization_map()
+{
+
+    width_max = 0;
+    height_max = 0;
+    cell_size = 1;
+    min_x = min_y = max_x = max_y = 0;
+    hit_radius = 0;
+    tiled = map_tiled;
+    package = 0;
+    package_size = 0;
+    distance_cells = 0;
+
+}
+
+localization_map::~localization_map()
+{
+
+    release_package();
+
+}
+
+void localization_map::release_package()
+{
+
+    if ( package )
+        munmap(package, package_size);
+    package = 0;
+    package_size = 0;
+
+}
+
+void localization_map::set_tiled(bool tiled)
+{
+
+    this->tiled = tiled;
+
+}
+
+void localization_map::load(int width, int height, float resolution, float origin_x, float origin_y, const int8_t* occupancy, float uncertainty, bool likelihood)
+{
+
+    width_max = width;
+    height_max = height;
+    cell_size = resolution;
+    min_x = origin_x;
+    min_y = origin_y;
+    max_x = min_x + width_max * cell_size;
+    max_y = min_y + height_max * cell_size;
+    release_package();
+
+    occupied.resize(width_max, height_max, tiled);
+    unknown.resize(width_max, height_max, tiled);
+    for (int loop_y = 0; loop_y < height_max; loop_y++)
+        for (int loop_x = 0; loop_x < width_max; loop_x++)
+        {
+            int8_t value = occupancy[width_max * loop_y + loop_x];
+            if ( value == 100 )
+                occupied.set(loop_x, loop_y);
+            else if ( value != 0 )
+                unknown.set(loop_x, loop_y);
+        }
+
+    // a beam hits an obstacle if its end is at less than uncertainty from an occupied cell
+    // with uncertainty = cell_size, this is the 3x3 neighborhood of the cell
+    hit_radius = lround(uncertainty / cell_size);
+
+    compute_distance_field();
+    compute_pyramid(likelihood);
+    compute_likelihood_table();
+
+}
+
+void localization_map::compute_likelihood_table()
+{
+
+    for (int loop = 0; loop <= distance_saturation; loop++)
+    {
+        float d = loop * cell_size;
+        likelihood_table[loop] = exp(-d * d / (2 * likelihood_sigma * likelihood_sigma));
+    }
+
+}
+
+int localization_map::cell_value(float x, float y) const
+{
+
+    int x_int, y_int;
+    if ( !cell_index(x, y, x_int, y_int) )
+        return (-1);
+    else
+        return (cell_state(x_int, y_int));
+
+}
+
+float localization_map::interpolated_likelihood(float x, float y, float& gradient_x, float& gradient_y) const
+{
+
+    // position in cells, relative to the center of the cell (0, 0)
+    float u = ( x - min_x ) / cell_size - 0.5;
+    float v = ( y - min_y ) / cell_size - 0.5;
+    int x_int = floor(u);
+    int y_int = floor(v);
+    float fx = u - x_int;
+    float fy = v - y_int;
+
+    // the cells outside of the map are far from any obstacle
+    float values[2][2];
+    for (int loop_y = 0; loop_y < 2; loop_y++)
+        for (int loop_x = 0; loop_x < 2; loop_x++)
+        {
+            int cell_x = x_int + loop_x, cell_y = y_int + loop_y;
+            if ( ( unsigned(cell_x) < unsigned(width_max) ) && ( unsigned(cell_y) < unsigned(height_max) ) )
+                values[loop_y][loop_x] = cell_likelihood(cell_x, cell_y);
+            else
+                values[loop_y][loop_x] = likelihood_table[distance_saturation];
+        }
+
+    float bottom = ( 1 - fx ) * values[0][0] + fx * values[0][1];
+    float top = ( 1 - fx ) * values[1][0] + fx * values[1][1];
+    gradient_x = ( ( 1 - fy ) * ( values[0][1] - values[0][0] ) + fy * ( values[1][1] - values[1][0] ) ) / cell_size;
+    gradient_y = ( top - bottom ) / cell_size;
+    return ( 1 - fy ) * bottom + fy * top;
+
+}
+
+size_t localization_map::memory_size() const
+{
+
+    if ( package )
+        return (package_size);
+
+    size_t size = occupied.size() + unknown.size() + distance.size() + hits.size();
+    for (size_t loop = 0; loop < pyramid.size(); loop++)
+        size += pyramid[loop].size();
+    for (size_t loop = 0; loop < pyramid_hits.size(); loop++)
+        size += pyramid_hits[loop].size();
+    return (size);
+
+}
+
+void localization_map::compute_distance_field()
+{
+    // euclidean distance transform of the occupied cells (Felzenszwalb & Huttenlocher)
+
+    distance.resize(width_max * height_max);
+
+    // first pass: distance to the nearest occupied cell in the same column
+    for (int loop_x = 0; loop_x < width_max; loop_x++)
+    {
+        int d = distance_saturation;
+        for (int loop_y = 0; loop_y < height_max; loop_y++)
+        {
+            if ( occupied.get(loop_x, loop_y) )
+                d = 0;
+            else if ( d < distance_saturation )
+                d++;
+            distance[width_max * loop_y + loop_x] = d;
+        }
+
+        d = distance_saturation;
+        for (int loop_y = height_max - 1; loop_y >= 0; loop_y--)
+        {
+            if ( distance[width_max * loop_y + loop_x] == 0 )
+                d = 0;
+            else if ( d < distance_saturation )
+                d++;
+            distance[width_max * loop_y + loop_x] = min<int>(d, distance[width_max * loop_y + loop_x]);
+        }
+    }
+
+    // second pass: lower envelope of the parabolas of each row
+    vector<float> f(width_max);
+    vector<float> z(width_max + 1);
+    vector<int> v(width_max);
+    for (int loop_y = 0; loop_y < height_max; loop_y++)
+    {
+        uint8_t* row = &distance[width_max * loop_y];
+        for (int loop_x = 0; loop_x < width_max; loop_x++)
+            f[loop_x] = float(row[loop_x]) * row[loop_x];
+
+        int k = 0;
+        v[0] = 0;
+        z[0] = -numeric_limits<float>::infinity();
+        z[1] = numeric_limits<float>::infinity();
+        for (int q = 1; q < width_max; q++)
+        {
+            float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+            while ( s <= z[k] )
+            {
+                k--;
+                s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+            }
+            k++;
+            v[k] = q;
+            z[k] = s;
+            z[k + 1] = numeric_limits<float>::infinity();
+        }
+
+        k = 0;
+        for (int q = 0; q < width_max; q++)
+        {
+            while ( z[k + 1] < q )
+                k++;
+            float d2 = float(q - v[k]) * (q - v[k]) + f[v[k]];
+            row[q] = min<long>(lround(sqrt(d2)), distance_saturation);
+        }
+    }
+
+    hits.resize(width_max, height_max, tiled);
+    for (int loop_y = 0; loop_y < height_max; loop_y++)
+        for (int loop_x = 0; loop_x < width_max; loop_x++)
+            if ( distance[width_max * loop_y + loop_x] <= hit_radius )
+                hits.set(loop_x, loop_y);
+
+    // padding for the 32 bit gathers of the vectorized sensor model
+    distance.resize(width_max * height_max + 3, distance_saturation);
+    distance_cells = &distance[0];
+
+}
+
+// minimum of in[(loop - 1 - offset) * stride .. (loop - 1 - offset + window - 1) * stride] for loop = 0 .. nb_out - 1
+// the values outside of in[0 .. nb_in - 1] are considered as saturated
+static void sliding_min(const uint8_t* in, int nb_in, int in_stride, uint8_t* out, int nb_out, int out_stride, int offset, int window)
+{
+
+    deque<int> candidates; // indices of in, with increasing values
+    int next = 0;
+    for (int loop = 0; loop < nb_out; loop++)
+    {
+        int start = loop - 1 - offset;
+        int end = min(start + window, nb_in);
+        for (; next < end; next++)
+        {
+            while ( !candidates.empty() && ( in[candidates.back() * in_stride] >= in[next * in_stride] ) )
+                candidates.pop_back();
+            candidates.push_back(next);
+        }
+        while ( !candidates.empty() && ( candidates.front() < start ) )
+            candidates.pop_front();
+        out[loop * out_stride] = candidates.empty() ? distance_saturation : in[candidates.front() * in_stride];
+    }
+
+}
+
+void localization_map::compute_pyramid(bool likelihood)
+{
+    // for each level, the distance field is min-pooled over blocks of (2^level + 2) x (2^level + 2) cells
+    // the levels are stored with a margin of 2^level cells before and one cell after the map
+    // so that every block that overlaps the map has a value
+
+    pyramid.assign(likelihood ? pyramid_depth : 0, vector<uint8_t>());
+    pyramid_cells.assign(likelihood ? pyramid_depth : 0, (const uint8_t*)0);
+    pyramid_hits.assign(pyramid_depth, bit_grid());
+    for (int level = 1; level <= pyramid_depth; level++)
+    {
+        const int margin = 1 << level;
+        const int width = width_max + margin + 1;
+        const int height = height_max + margin + 1;
+
+        // pooling along the rows then along the columns
+        vector<uint8_t> rows(width * height_max);
+        for (int loop_y = 0; loop_y < height_max; loop_y++)
+            sliding_min(&distance[width_max * loop_y], width_max, 1, &rows[width * loop_y], width, 1, margin, margin + 2);
+
+        vector<uint8_t> blocks(width * height);
+        for (int loop_x = 0; loop_x < width; loop_x++)
+            sliding_min(&rows[loop_x], height_max, width, &blocks[loop_x], height, width, margin, margin + 2);
+
+        bit_grid& block_hits = pyramid_hits[level - 1];
+        block_hits.resize(width, height, tiled);
+        for (int loop_y = 0; loop_y < height; loop_y++)
+            for (int loop_x = 0; loop_x < width; loop_x++)
+                if ( blocks[width * loop_y + loop_x] <= hit_radius )
+                    block_hits.set(loop_x, loop_y);
+
+        if ( likelihood )
+        {
+            pyramid[level - 1].swap(blocks);
+            pyramid_cells[level - 1] = &pyramid[level - 1][0];
+        }
+    }
+
+}
+
+// binary map package: a header followed by sections aligned on cache lines
+// the sections are, in this order: occupied, unknown, hits, distance, pyramid_hits[0 .. pyramid_depth - 1]
+// and pyramid[0 .. pyramid_depth - 1] (empty if the package has been built without likelihood)
+#define package_alignment 64
+#define package_max_sections 64
+
+struct package_header
+{
+    char magic[8];
+    uint32_t version;
+    // the package is only valid for the compile time parameters of the map
+    uint32_t saturation, depth, tile_size_bits;
+    int32_t width, height;
+    float cell_size, min_x, min_y;
+    int32_t hit_radius;
+    uint32_t tiled, likelihood;
+    uint32_t nb_sections;
+    uint64_t offset[package_max_sections], size[package_max_sections];
+};
+
+static const char package_magic[8] = { 'L', 'O', 'C', 'M', 'A', 'P', 0, 0 };
+
+bool localization_map::save_package(const string& file) const
+{
+
+    vector<const void*> sections;
+    vector<uint64_t> sizes;
+    const bit_grid* grids[3] = { &occupied, &unknown, &hits };
+    for (int loop = 0; loop < 3; loop++)
+    {
+        sections.push_back(grids[loop]->bits);
+        sizes.push_back(grids[loop]->size());
+    }
+    sections.push_back(distance_cells);
+    sizes.push_back(size_t(width_max) * height_max + 3);
+    for (int level = 1; level <= pyramid_depth; level++)
+    {
+        sections.push_back(pyramid_hits[level - 1].bits);
+        sizes.push_back(pyramid_hits[level - 1].size());
+    }
+    for (int level = 1; level <= pyramid_depth; level++)
+    {
+        const int margin = 1 << level;
+        bool present = level <= int(pyramid_cells.size());
+        sections.push_back(present ? pyramid_cells[level - 1] : 0);
+        sizes.push_back(present ? size_t(width_max + margin + 1) * ( height_max + margin + 1 ) : 0);
+    }
+
+    package_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, package_magic, sizeof(header.magic));
+    header.version = map_package_version;
+    header.saturation = distance_saturation;
+    header.depth = pyramid_depth;
+    header.tile_size_bits = tile_bits;
+    header.width = width_max;
+    header.height = height_max;
+    header.cell_size = cell_size;
+    header.min_x = min_x;
+    header.min_y = min_y;
+    header.hit_radius = hit_radius;
+    header.tiled = tiled;
+    header.likelihood = !pyramid_cells.empty();
+    header.nb_sections = sections.size();
+
+    uint64_t offset = ( sizeof(header) + package_alignment - 1 ) / package_alignment * package_alignment;
+    for (size_t loop = 0; loop < sections.size(); loop++)
+    {
+        header.offset[loop] = offset;
+        header.size[loop] = sizes[loop];
+        offset += ( sizes[loop] + package_alignment - 1 ) / package_alignment * package_alignment;
+    }
+
+    // written under a temporary name, so that a node never maps a partial package
+    string temporary = file + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if ( !out )
+        return (false);
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+    static const char padding[package_alignment] = { 0 };
+    uint64_t position = sizeof(header);
+    for (size_t loop = 0; written && ( loop < sections.size() ); loop++)
+    {
+        written = fwrite(padding, 1, header.offset[loop] - position, out) == header.offset[loop] - position;
+        if ( written && sizes[loop] )
+            written = fwrite(sections[loop], 1, sizes[loop], out) == sizes[loop];
+        position = header.offset[loop] + sizes[loop];
+    }
+    written = ( fclose(out) == 0 ) && written;
+    if ( !written || ( rename(temporary.c_str(), file.c_str()) != 0 ) )
+    {
+        remove(temporary.c_str());
+        return (false);
+    }
+
+    return (true);
+
+}
+
+bool localization_map::open_package(const string& file, float uncertainty, bool likelihood, bool huge_pages)
+{
+
+    int fd = open(file.c_str(), O_RDONLY);
+    if ( fd < 0 )
+        return (false);
+    struct stat status;
+    void* data = MAP_FAILED;
+    if ( ( fstat(fd, &status) == 0 ) && ( size_t(status.st_size) >= sizeof(package_header) ) )
+        data = mmap(0, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( data == MAP_FAILED )
+        return (false);
+    const size_t size = status.st_size;
+
+    // best effort: only honored by kernels with transparent huge pages for the page cache
+    if ( huge_pages )
+        madvise(data, size, MADV_HUGEPAGE);
+
+    const package_header& header = *(const package_header*)data;
+    bool valid = ( memcmp(header.magic, package_magic, sizeof(header.magic)) == 0 ) && ( header.version == map_package_version )
+              && ( header.saturation == distance_saturation ) && ( header.depth == pyramid_depth ) && ( header.tile_size_bits == tile_bits )
+              && ( header.nb_sections == 4 + 2 * pyramid_depth ) && ( header.width > 0 ) && ( header.height > 0 ) && ( header.cell_size > 0 )
+              && ( header.hit_radius == lround(uncertainty / header.cell_size) ) && ( header.likelihood || !likelihood );
+    for (uint32_t loop = 0; valid && ( loop < header.nb_sections ); loop++)
+        valid = ( header.offset[loop] % package_alignment == 0 ) && ( header.offset[loop] <= size ) && ( header.size[loop] <= size - header.offset[loop] );
+    if ( !valid )
+    {
+        munmap(data, size);
+        return (false);
+    }
+
+    release_package();
+    package = data;
+    package_size = size;
+
+    width_max = header.width;
+    height_max = header.height;
+    cell_size = header.cell_size;
+    min_x = header.min_x;
+    min_y = header.min_y;
+    max_x = min_x + width_max * cell_size;
+    max_y = min_y + height_max * cell_size;
+    hit_radius = header.hit_radius;
+    tiled = header.tiled;
+
+    // the sections are checked against the sizes of the structures they hold
+    const char* base = (const char*)data;
+    bit_grid* grids[3] = { &occupied, &unknown, &hits };
+    for (int loop = 0; loop < 3; loop++)
+    {
+        grids[loop]->attach(width_max, height_max, tiled, (const uint32_t*)( base + header.offset[loop] ));
+        valid = valid && ( grids[loop]->size() == header.size[loop] );
+    }
+    vector<uint8_t>().swap(distance);
+    distance_cells = (const uint8_t*)( base + header.offset[3] );
+    valid = valid && ( header.size[3] == size_t(width_max) * height_max + 3 );
+
+    pyramid.clear();
+    pyramid_hits.assign(pyramid_depth, bit_grid());
+    pyramid_cells.assign(header.likelihood ? pyramid_depth : 0, (const uint8_t*)0);
+    for (int level = 1; level <= pyramid_depth; level++)
+    {
+        const int margin = 1 << level;
+        const int width = width_max + margin + 1;
+        const int height = height_max + margin + 1;
+        pyramid_hits[level - 1].attach(width, height, tiled, (const uint32_t*)( base + header.offset[3 + level] ));
+        valid = valid && ( pyramid_hits[level - 1].size() == header.size[3 + level] );
+        if ( header.likelihood )
+        {
+            pyramid_cells[level - 1] = (const uint8_t*)( base + header.offset[3 + pyramid_depth + level] );
+            valid = valid && ( header.size[3 + pyramid_depth + level] == size_t(width) * height );
+        }
+    }
+
+    compute_likelihood_table();
+    if ( !valid )
+    {
+        release_package();
+        return (false);
+    }
+
+    return (true);
+
+}
+
+// skip the spaces and the comments of the header of a pgm image
+static void skip_pgm_comments(istream& in)
+{
+
+    while ( in >> ws && ( in.peek() == '#' ) )
+    {
+        string comment;
+        getline(in, comment);
+    }
+
+}
+
+bool read_map_file(const string& yaml_file, int& width, int& height, float& resolution, float& origin_x, float& origin_y, vector<int8_t>& occupancy)
+{
+
+    ifstream yaml(yaml_file.c_str());
+    if ( !yaml )
+        return (false);
+
+    string image;
+    int negate = 0;
+    float occupied_thresh = 0.65;
+    float free_thresh = 0.196;
+    origin_x = origin_y = 0;
+    resolution = 0;
+
+    string line;
+    while ( getline(yaml, line) )
+    {
+        size_t colon = line.find(':');
+        if ( colon == string::npos )
+            continue;
+        string key = line.substr(0, colon);
+        string value = line.substr(colon + 1);
+        key.erase(0, key.find_first_not_of(" \t"));
+        key.erase(key.find_last_not_of(" \t") + 1);
+
+        if ( key == "image" )
+            istringstream(value) >> image;
+        else if ( key == "resolution" )
+            istringstream(value) >> resolution;
+        else if ( key == "negate" )
+            istringstream(value) >> negate;
+        else if ( key == "occupied_thresh" )
+            istringstream(value) >> occupied_thresh;
+        else if ( key == "free_thresh" )
+            istringstream(value) >> free_thresh;
+        else if ( key == "origin" )
+            sscanf(value.c_str(), " [ %f , %f", &origin_x, &origin_y);
+    }
+    if ( image.empty() || ( resolution <= 0 ) )
+        return (false);
+
+    // the image is relative to the yaml file
+    if ( image[0] != '/' )
+    {
+        size_t slash = yaml_file.rfind('/');
+        if ( slash != string::npos )
+            image = yaml_file.substr(0, slash + 1) + image;
+    }
+
+    ifstream pgm(image.c_str(), ios::binary);
+    string magic;
+    int max_value;
+    pgm >> magic;
+    skip_pgm_comments(pgm);
+    pgm >> width;
+    skip_pgm_comments(pgm);
+    pgm >> height;
+    skip_pgm_comments(pgm);
+    pgm >> max_value;
+    if ( !pgm || ( ( magic != "P5" ) && ( magic != "P2" ) ) || ( max_value <= 0 ) || ( max_value > 255 ) )
+        return (false);
+    pgm.get();
+
+    occupancy.resize(size_t(width) * height);
+    for (int loop_row = 0; loop_row < height; loop_row++)
+        for (int loop_x = 0; loop_x < width; loop_x++)
+        {
+            int pixel;
+            if ( magic == "P5" )
+                pixel = (unsigned char)pgm.get();
+            else
+                pgm >> pixel;
+
+            // same conversion as the map_server in trinary mode, the first row of the image is the top of the map
+            float occupied = negate ? float(pixel) / max_value : float(max_value - pixel) / max_value;
+            int8_t value = -1;
+            if ( occupied > occupied_thresh )
+                value = 100;
+            else if ( occupied < free_thresh )
+                value = 0;
+            occupancy[size_t(width) * ( height - 1 - loop_row ) + loop_x] = value;
+        }
+
+    return (bool(pgm));
+}
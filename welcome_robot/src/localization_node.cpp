@@ -7,7 +7,8 @@ void localization::update()
 {
 
     //ROS_INFO("odom = %i, laser = %i, position = %i", init_odom, init_laser, init_position);
-    if ( init_odom && init_laser && init_position ) {
+    // without initial pose, the node starts from the position saved by its previous run
+    if ( init_odom && init_laser && ( init_position || warm_start ) ) {
         if ( !localization_initialized ) {
             initialize_localization();
             localization_initialized = true;
@@ -15,8 +16,8 @@ void localization::update()
         previous_distance_traveled = distance_traveled;
         previous_angle_traveled = angle_traveled;
 
-        distance_traveled = distancePoints(odom_current, odom_last);
-        angle_traveled = odom_current_orientation-odom_last_orientation;
+        distance_traveled = distancePoints(odom_scan, odom_last);
+        angle_traveled = odom_scan_orientation-odom_last_orientation;
         if ( angle_traveled < -M_PI )
             angle_traveled += 2*M_PI;
         if ( angle_traveled > M_PI )
@@ -25,16 +26,37 @@ void localization::update()
         if ( ( distance_traveled  != previous_distance_traveled ) || ( angle_traveled != previous_angle_traveled ) )
             ROS_INFO("distance_traveled = %f, angle_traveled = %f since last localization", distance_traveled, angle_traveled*180/M_PI);
 
-        if ( ( distance_traveled > distance_to_travel ) || ( fabs(angle_traveled*180/M_PI) > angle_to_travel ) )
-        {
+        bool triggered;
+        if ( particle_filter_mode )
+            // the particle filter is updated after each small motion, its cost depends on the number of particles
+            triggered = ( distance_traveled > particle_distance_to_travel ) || ( fabs(angle_traveled*180/M_PI) > particle_angle_to_travel );
+        else
+            triggered = ( distance_traveled > distance_to_travel ) || ( fabs(angle_traveled*180/M_PI) > angle_to_travel );
 
+        // the odometry drifts while the robot is parked: if the laser still sees the same scene, nothing is updated
+        if ( triggered && stationary() )
+        {
+            hold_position();
+            triggered = false;
+        }
 
+        if ( !triggered )
+            ;
+        else if ( particle_filter_mode )
+            track_position();
+        else if ( asynchronous_matching )
+            // the search runs in the worker, the position is published by odomCallback meanwhile
+            request_matching();
+        else
+        {
             // in order to be more precise, we can use odometry (i.e. predict_position) at each event in odometry
             // with this technic each iteration we can know +- exact position of robot and update it 
             // even more precesile with estimate_position every DISTANCE_TO_TRAVEL metres
             predict_position();
             estimate_position();
         }
+
+        save_checkpoint();
     }
 
 }// update
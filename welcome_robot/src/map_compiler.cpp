@@ -0,0 +1,76 @@
+// offline compilation of a map_server map into a binary map package for the localization
+// usage: map_compiler map.yaml map.package [uncertainty] [likelihood] [tiled] [ranges]
+// uncertainty (in meters) must be the hit_uncertainty of the localization node, 0.05 by default
+// likelihood adds the pyramid of distances needed by the likelihood mode
+// tiled stores the bit grids in tiles (see map_tiled)
+// ranges also writes the range table of the map to map.package.ranges, for the beam model and the free space score (see range_table_file)
+#include <localization_map.h>
+#include <range_table.h>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+int main(int argc, char **argv)
+{
+
+    if ( argc < 3 )
+    {
+        printf("usage: %s map.yaml map.package [uncertainty] [likelihood] [tiled] [ranges]\n", argv[0]);
+        return 1;
+    }
+
+    float uncertainty = 0.05;
+    bool likelihood = false;
+    bool tiled = map_tiled;
+    bool ranges = false;
+    for (int loop = 3; loop < argc; loop++)
+        if ( !strcmp(argv[loop], "likelihood") )
+            likelihood = true;
+        else if ( !strcmp(argv[loop], "tiled") )
+            tiled = true;
+        else if ( !strcmp(argv[loop], "ranges") )
+            ranges = true;
+        else
+            uncertainty = atof(argv[loop]);
+
+    int width, height;
+    float resolution, origin_x, origin_y;
+    vector<int8_t> occupancy;
+    if ( !read_map_file(argv[1], width, height, resolution, origin_x, origin_y, occupancy) )
+    {
+        printf("cannot read the map %s\n", argv[1]);
+        return 1;
+    }
+
+    localization_map map;
+    map.set_tiled(tiled);
+    map.load(width, height, resolution, origin_x, origin_y, &occupancy[0], uncertainty, likelihood);
+    if ( !map.save_package(argv[2]) )
+    {
+        printf("cannot write the package %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%s: %d x %d cells of %f m, %lu bytes, version %d\n", argv[2], width, height, resolution, map.memory_size(), map_package_version);
+
+    if ( ranges )
+    {
+        range_table table;
+        string file = string(argv[2]) + ".ranges";
+        if ( !table.build(map, thread::hardware_concurrency()) )
+        {
+            printf("the map is too large for the range table\n");
+            return 1;
+        }
+        if ( !table.save(file) )
+        {
+            printf("cannot write the range table %s\n", file.c_str());
+            return 1;
+        }
+        printf("%s: %lu bytes, version %d\n", file.c_str(), table.memory_size(), range_table_version);
+    }
+
+    return 0;
+
+}
@@ -0,0 +1,454 @@
+// changes of the map seen by the laser since the map was made
+#include <map_overlay.h>
+#include <algorithm>
+#include <cstring>
+
+void overlay_plane::resize(int origin, int width, int height)
+{
+
+    this->origin = origin;
+    this->width = width;
+    this->height = height;
+    nb_blocks_x = ( width + ( 1 << overlay_block_bits ) - 1 ) >> overlay_block_bits;
+    nb_blocks_y = ( height + ( 1 << overlay_block_bits ) - 1 ) >> overlay_block_bits;
+    present.assign(( size_t(nb_blocks_x) * nb_blocks_y + 63 ) / 64, 0);
+    blocks.clear();
+
+}
+
+uint32_t overlay_plane::row(int x_int, int y_int) const
+{
+
+    x_int -= origin;
+    y_int -= origin;
+    if ( blocks.empty() || ( unsigned(y_int) >= unsigned(height) ) )
+        return (0);
+
+    // the 32 cells are in 3 blocks at most
+    const int size = 1 << overlay_block_bits;
+    uint64_t bits = 0;
+    for (int loop = x_int >> overlay_block_bits; loop <= ( x_int + 31 ) >> overlay_block_bits; loop++)
+    {
+        int index = ( y_int >> overlay_block_bits ) * nb_blocks_x + loop;
+        if ( ( loop < 0 ) || ( loop >= nb_blocks_x ) || !( ( present[index >> 6] >> ( index & 63 ) ) & 1 ) )
+            continue;
+
+        // the first cell of the block is at shift in the row, between -15 and 31
+        uint64_t block_row = blocks.find(index)->second->rows[y_int & ( size - 1 )];
+        int shift = loop * size - x_int;
+        bits |= ( shift >= 0 ) ? ( block_row << shift ) : ( block_row >> -shift );
+    }
+
+    return (uint32_t(bits));
+
+}
+
+void overlay_plane::store(int index, const overlay_bits& bits)
+{
+
+    uint16_t any = 0;
+    for (int loop = 0; loop < ( 1 << overlay_block_bits ); loop++)
+        any |= bits.rows[loop];
+
+    if ( any )
+    {
+        blocks[index] = make_shared<overlay_bits>(bits);
+        present[index >> 6] |= uint64_t(1) << ( index & 63 );
+    }
+    else
+    {
+        blocks.erase(index);
+        present[index >> 6] &= ~( uint64_t(1) << ( index & 63 ) );
+    }
+
+}
+
+size_t overlay_plane::memory_size() const
+{
+
+    // each block is a node of the hash table, and a shared block with its counters
+    return (present.size() * sizeof(uint64_t) + blocks.size() * ( sizeof(overlay_bits) + sizeof(int) + 5 * sizeof(void*) ) + blocks.bucket_count() * sizeof(void*));
+
+}
+
+overlay_layer::overlay_layer(const localization_map& map)
+    : map(map)
+{
+
+    // the radius stays inside the neighbor blocks
+    radius = min(max(overlay_distance_radius, map.hit_distance()), ( 1 << overlay_block_bits ) - 1);
+    nb_blocks_x = ( map.width_max + ( 1 << overlay_block_bits ) - 1 ) >> overlay_block_bits;
+    nb_blocks_y = ( map.height_max + ( 1 << overlay_block_bits ) - 1 ) >> overlay_block_bits;
+    present.assign(( size_t(nb_blocks_x) * nb_blocks_y + 63 ) / 64, 0);
+    closer.resize(0, map.width_max, map.height_max);
+
+    // each level covers the cells of the same level of the map
+    levels.resize(map.nb_levels());
+    levels[0].resize(-1, map.width_max + 2, map.height_max + 2);
+    for (int loop = 1; loop < map.nb_levels(); loop++)
+        levels[loop].resize(-( 1 << loop ), map.width_max + ( 1 << loop ) + 1, map.height_max + ( 1 << loop ) + 1);
+    changes = 0;
+
+}
+
+int overlay_layer::cell_value(float x, float y) const
+{
+
+    int x_int, y_int;
+    if ( !map.cell_index(x, y, x_int, y_int) )
+        return (-1);
+
+    return (cell_state(x_int, y_int));
+
+}
+
+float overlay_layer::interpolated_likelihood(float x, float y, float& gradient_x, float& gradient_y) const
+{
+
+    if ( cells.empty() )
+        return (map.interpolated_likelihood(x, y, gradient_x, gradient_y));
+
+    // same interpolation as the map
+    float u = ( x - map.min_x ) / map.cell_size - 0.5;
+    float v = ( y - map.min_y ) / map.cell_size - 0.5;
+    int x_int = floor(u);
+    int y_int = floor(v);
+    float fx = u - x_int;
+    float fy = v - y_int;
+
+    float values[2][2];
+    for (int loop_y = 0; loop_y < 2; loop_y++)
+        for (int loop_x = 0; loop_x < 2; loop_x++)
+        {
+            int cell_x = x_int + loop_x, cell_y = y_int + loop_y;
+            if ( ( unsigned(cell_x) < unsigned(map.width_max) ) && ( unsigned(cell_y) < unsigned(map.height_max) ) )
+                values[loop_y][loop_x] = cell_likelihood(cell_x, cell_y);
+            else
+                values[loop_y][loop_x] = map.likelihood_values()[distance_saturation];
+        }
+
+    float bottom = ( 1 - fx ) * values[0][0] + fx * values[0][1];
+    float top = ( 1 - fx ) * values[1][0] + fx * values[1][1];
+    gradient_x = ( ( 1 - fy ) * ( values[0][1] - values[0][0] ) + fy * ( values[1][1] - values[1][0] ) ) / map.cell_size;
+    gradient_y = ( top - bottom ) / map.cell_size;
+    return ( 1 - fy ) * bottom + fy * top;
+
+}
+
+size_t overlay_layer::memory_size() const
+{
+
+    size_t size = present.size() * sizeof(uint64_t) + cells.size() * ( sizeof(cell_block) + sizeof(int) + 5 * sizeof(void*) ) + cells.bucket_count() * sizeof(void*) + closer.memory_size();
+    for (size_t loop = 0; loop < levels.size(); loop++)
+        size += levels[loop].memory_size();
+
+    return (size);
+
+}
+
+map_overlay::map_overlay(const localization_map& map)
+    : map(map)
+{
+
+    clear();
+
+}
+
+void map_overlay::clear()
+{
+
+    // the map may be loaded after the overlay is built
+    nb_blocks_x = ( map.width_max + ( 1 << overlay_block_bits ) - 1 ) >> overlay_block_bits;
+    nb_blocks_y = ( map.height_max + ( 1 << overlay_block_bits ) - 1 ) >> overlay_block_bits;
+    blocks.clear();
+    present.assign(( size_t(nb_blocks_x) * nb_blocks_y + 63 ) / 64, 0);
+    dirty.clear();
+    published.reset();
+
+}
+
+const int8_t* map_overlay::find_cell(int x_int, int y_int) const
+{
+
+    int index = block_index(x_int, y_int);
+    if ( !block_present(index) )
+        return (0);
+
+    const int mask = ( 1 << overlay_block_bits ) - 1;
+    return (&blocks.find(index)->second.log_odds[( ( y_int & mask ) << overlay_block_bits ) | ( x_int & mask )]);
+
+}
+
+int map_overlay::cell_value(float x, float y) const
+{
+
+    int x_int, y_int;
+    if ( !map.cell_index(x, y, x_int, y_int) )
+        return (-1);
+
+    return (cell_state(x_int, y_int));
+
+}
+
+int map_overlay::cell_state(int x_int, int y_int) const
+{
+
+    const int8_t* log_odds = blocks.empty() ? 0 : find_cell(x_int, y_int);
+    if ( log_odds && ( *log_odds >= overlay_occupied ) )
+        return (100);
+    else if ( log_odds && ( *log_odds <= -overlay_occupied ) )
+        return (0);
+    else
+        return (map.cell_state(x_int, y_int));
+
+}
+
+void map_overlay::update_cell(int x_int, int y_int, int change)
+{
+
+    int index = block_index(x_int, y_int);
+    const int mask = ( 1 << overlay_block_bits ) - 1;
+    if ( !block_present(index) )
+    {
+        // a hit where the map has no obstacle around, or a beam through an obstacle of the map, is a change of the map
+        // the other observations agree with the map, and there is nothing to store
+        bool added = ( change > 0 ) && !map.cell_hit(x_int, y_int);
+        bool removed = ( change < 0 ) && ( map.cell_state(x_int, y_int) == 100 );
+        if ( !added && !removed )
+            return;
+
+        // a new block starts from the map: its obstacles are sure, as its free cells
+        block& created = blocks[index];
+        const int first_x = ( x_int >> overlay_block_bits ) << overlay_block_bits, first_y = ( y_int >> overlay_block_bits ) << overlay_block_bits;
+        for (int loop_y = 0; loop_y <= mask; loop_y++)
+            for (int loop_x = 0; loop_x <= mask; loop_x++)
+            {
+                int value = ( ( first_x + loop_x < map.width_max ) && ( first_y + loop_y < map.height_max ) ) ? map.cell_state(first_x + loop_x, first_y + loop_y) : -1;
+                created.log_odds[( loop_y << overlay_block_bits ) | loop_x] = ( value == 100 ) ? overlay_occupied : ( value == 0 ) ? -overlay_occupied : 0;
+            }
+        present[index >> 6] |= uint64_t(1) << ( index & 63 );
+    }
+
+    int8_t& log_odds = blocks[index].log_odds[( ( y_int & mask ) << overlay_block_bits ) | ( x_int & mask )];
+    // state of the cell: occupied, free or not sure
+    auto state = [](int value) { return ( value >= overlay_occupied ) ? 1 : ( value <= -overlay_occupied ) ? -1 : 0; };
+    int previous = state(log_odds);
+    log_odds = max(min(log_odds + change, overlay_max), -overlay_max);
+    if ( state(log_odds) != previous )
+        dirty.push_back(index);
+
+}
+
+void map_overlay::integrate(float x, float y, float orientation, int nb_beams, const float* r, const float* theta, const bool* valid)
+{
+
+    int robot_x, robot_y;
+    if ( !map.cell_index(x, y, robot_x, robot_y) )
+        return;
+
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        if ( !valid[loop] )
+            continue;
+
+        // the cells crossed by the beam, from the robot to its hit (Bresenham)
+        int hit_x, hit_y;
+        if ( !map.cell_index(x + r[loop] * cos(orientation + theta[loop]), y + r[loop] * sin(orientation + theta[loop]), hit_x, hit_y) )
+            continue;
+
+        int dx = abs(hit_x - robot_x), dy = -abs(hit_y - robot_y);
+        int step_x = ( robot_x < hit_x ) ? 1 : -1, step_y = ( robot_y < hit_y ) ? 1 : -1;
+        int nb_free = max(dx, -dy) - overlay_hit_margin;
+        int error = dx + dy;
+        int cell_x = robot_x, cell_y = robot_y;
+        for (int loop_cell = 0; loop_cell < nb_free; loop_cell++)
+        {
+            update_cell(cell_x, cell_y, -overlay_miss);
+            int error2 = 2 * error;
+            if ( error2 >= dy )
+            {
+                error += dy;
+                cell_x += step_x;
+            }
+            if ( error2 <= dx )
+            {
+                error += dx;
+                cell_y += step_y;
+            }
+        }
+
+        update_cell(hit_x, hit_y, overlay_hit);
+    }
+
+}
+
+shared_ptr<const overlay_layer> map_overlay::publish()
+{
+
+    if ( published && dirty.empty() )
+        return (published);
+
+    // the new layer shares the blocks of the previous one
+    shared_ptr<overlay_layer> layer = published ? make_shared<overlay_layer>(*published) : make_shared<overlay_layer>(map);
+    if ( !dirty.empty() )
+    {
+        // a cell that changed moves the distances of the cells around it: the blocks around are computed again
+        vector<int> updated;
+        for (size_t loop = 0; loop < dirty.size(); loop++)
+        {
+            const int block_x = dirty[loop] % nb_blocks_x, block_y = dirty[loop] / nb_blocks_x;
+            for (int loop_y = max(block_y - 1, 0); loop_y <= min(block_y + 1, nb_blocks_y - 1); loop_y++)
+                for (int loop_x = max(block_x - 1, 0); loop_x <= min(block_x + 1, nb_blocks_x - 1); loop_x++)
+                    updated.push_back(loop_y * nb_blocks_x + loop_x);
+        }
+        sort(updated.begin(), updated.end());
+        updated.erase(unique(updated.begin(), updated.end()), updated.end());
+
+        for (size_t loop = 0; loop < updated.size(); loop++)
+            update_block(*layer, updated[loop]);
+        update_levels(*layer, updated);
+        layer->changes++;
+        dirty.clear();
+    }
+    published = layer;
+
+    return (published);
+
+}
+
+void map_overlay::update_block(overlay_layer& layer, int index) const
+{
+
+    const int size = 1 << overlay_block_bits;
+    const int radius = layer.radius;
+    const int first_x = ( index % nb_blocks_x ) << overlay_block_bits, first_y = ( index / nb_blocks_x ) << overlay_block_bits;
+
+    // obstacles of the block and around it, with the sure cells of the overlay
+    const int side = size + 2 * radius;
+    vector<uint8_t> obstacles(side * side, 0);
+    for (int loop_y = 0; loop_y < side; loop_y++)
+        for (int loop_x = 0; loop_x < side; loop_x++)
+        {
+            int x_int = first_x - radius + loop_x, y_int = first_y - radius + loop_y;
+            if ( ( unsigned(x_int) < unsigned(map.width_max) ) && ( unsigned(y_int) < unsigned(map.height_max) ) )
+                obstacles[side * loop_y + loop_x] = cell_state(x_int, y_int) == 100;
+        }
+
+    overlay_layer::cell_block block;
+    overlay_bits closer;
+    memset(&block, 0, sizeof(block));
+    memset(&closer, 0, sizeof(closer));
+    bool changed = false;
+    for (int loop_y = 0; loop_y < size; loop_y++)
+        for (int loop_x = 0; loop_x < size; loop_x++)
+        {
+            const int x_int = first_x + loop_x, y_int = first_y + loop_y;
+            uint8_t& distance = block.distance[( loop_y << overlay_block_bits ) | loop_x];
+            if ( ( x_int >= map.width_max ) || ( y_int >= map.height_max ) )
+            {
+                distance = distance_saturation;
+                continue;
+            }
+
+            // the nearest obstacle whose rounded distance is at most the radius, else the distance of the map,
+            // which is beyond the radius unless an obstacle of the map was removed
+            int nearest = radius * radius + radius + 1;
+            for (int loop_dy = -radius; loop_dy <= radius; loop_dy++)
+                for (int loop_dx = -radius; loop_dx <= radius; loop_dx++)
+                    if ( obstacles[side * ( loop_y + radius + loop_dy ) + loop_x + radius + loop_dx] )
+                        nearest = min(nearest, loop_dx * loop_dx + loop_dy * loop_dy);
+            const int map_distance = map.distance_field()[size_t(map.width_max) * y_int + x_int];
+            distance = ( nearest <= radius * radius + radius ) ? lround(sqrt(float(nearest))) : max(map_distance, radius + 1);
+
+            const uint16_t bit = 1 << loop_x;
+            const int state = cell_state(x_int, y_int);
+            if ( distance <= map.hit_distance() )
+                block.hits.rows[loop_y] |= bit;
+            if ( state == 100 )
+                block.occupied.rows[loop_y] |= bit;
+            else if ( state == -1 )
+                block.unknown.rows[loop_y] |= bit;
+            if ( distance < map_distance )
+                closer.rows[loop_y] |= bit;
+            changed = changed || ( distance != map_distance ) || ( state != map.cell_state(x_int, y_int) );
+        }
+
+    // a block equal to the map is not stored: its cells are read in the map
+    if ( changed )
+    {
+        layer.cells[index] = make_shared<overlay_layer::cell_block>(block);
+        layer.present[index >> 6] |= uint64_t(1) << ( index & 63 );
+    }
+    else
+    {
+        layer.cells.erase(index);
+        layer.present[index >> 6] &= ~( uint64_t(1) << ( index & 63 ) );
+    }
+    layer.closer.store(index, closer);
+
+}
+
+void map_overlay::update_levels(overlay_layer& layer, const vector<int>& updated) const
+{
+
+    const int size = 1 << overlay_block_bits;
+    vector<int> below = updated;
+    const overlay_plane* source = &layer.closer;
+    for (int loop_level = 0; loop_level < int(layer.levels.size()); loop_level++)
+    {
+        // the level 0 reads the cells [x - 1, x + 1] of closer, the level l the cells [x, x + 2^(l - 1)] of the level l - 1
+        overlay_plane& plane = layer.levels[loop_level];
+        const int step = ( loop_level == 0 ) ? 1 : 1 << ( loop_level - 1 );
+        const int after = ( loop_level == 0 ) ? 1 : 0;
+
+        // the blocks of the level that read a block updated in the level below
+        vector<int> blocks;
+        for (size_t loop = 0; loop < below.size(); loop++)
+        {
+            const int first_x = source->origin + ( below[loop] % source->nb_blocks_x ) * size - plane.origin;
+            const int first_y = source->origin + ( below[loop] / source->nb_blocks_x ) * size - plane.origin;
+            const int max_x = min(( first_x + size - 1 + after ) >> overlay_block_bits, plane.nb_blocks_x - 1);
+            const int max_y = min(( first_y + size - 1 + after ) >> overlay_block_bits, plane.nb_blocks_y - 1);
+            for (int loop_y = ( first_y - step ) >> overlay_block_bits; loop_y <= max_y; loop_y++)
+                for (int loop_x = ( first_x - step ) >> overlay_block_bits; loop_x <= max_x; loop_x++)
+                    blocks.push_back(loop_y * plane.nb_blocks_x + loop_x);
+        }
+        sort(blocks.begin(), blocks.end());
+        blocks.erase(unique(blocks.begin(), blocks.end()), blocks.end());
+
+        // 16 cells of a row at a time
+        for (size_t loop = 0; loop < blocks.size(); loop++)
+        {
+            const int first_x = plane.origin + ( blocks[loop] % plane.nb_blocks_x ) * size;
+            const int first_y = plane.origin + ( blocks[loop] / plane.nb_blocks_x ) * size;
+            overlay_bits bits;
+            for (int loop_row = 0; loop_row < size; loop_row++)
+            {
+                const int y_int = first_y + loop_row;
+                uint32_t row = 0;
+                if ( loop_level == 0 )
+                    for (int loop_dy = -1; loop_dy <= 1; loop_dy++)
+                    {
+                        uint32_t cells = source->row(first_x - 1, y_int + loop_dy);
+                        row |= cells | ( cells >> 1 ) | ( cells >> 2 );
+                    }
+                else
+                    row = source->row(first_x, y_int) | source->row(first_x + step, y_int) | source->row(first_x, y_int + step) | source->row(first_x + step, y_int + step);
+                bits.rows[loop_row] = uint16_t(row);
+            }
+            plane.store(blocks[loop], bits);
+        }
+
+        below.swap(blocks);
+        source = &plane;
+    }
+
+}
+
+size_t map_overlay::memory_size() const
+{
+
+    // each block is a node of the hash table
+    return (present.size() * sizeof(uint64_t) + blocks.size() * ( sizeof(block) + sizeof(int) + 2 * sizeof(void*) ) + blocks.bucket_count() * sizeof(void*));
+
+}
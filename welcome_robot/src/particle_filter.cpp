@@ -0,0 +1,203 @@
+// monte carlo localization with KLD sampling
+#include <particle_filter.h>
+#include <algorithm>
+#include <unordered_set>
+#include <limits>
+
+particle_filter::particle_filter(const localization_map& map)
+    : map(map)
+{
+
+    log_outside = 0;
+
+}
+
+void particle_filter::initialize(float x, float y, float o, float spread, float angle_spread)
+{
+
+    // the map is loaded at this point, the likelihood of a hit depends on the size of its cells
+    const float random_weight = ( 1 - particle_hit_weight ) * exp(-0.5);
+    for (int loop = 0; loop <= distance_saturation; loop++)
+    {
+        float d = loop * map.cell_size;
+        log_likelihood[loop] = log(particle_hit_weight * exp(-d * d / (2 * particle_sigma * particle_sigma)) + random_weight);
+    }
+    log_outside = log(random_weight);
+
+    normal_distribution<float> noise(0, 1);
+    particles.resize(particles_max);
+    for (int loop = 0; loop < particles_max; loop++)
+    {
+        particles[loop].x = x + spread * noise(generator);
+        particles[loop].y = y + spread * noise(generator);
+        particles[loop].orientation = o + angle_spread * noise(generator);
+        particles[loop].weight = 1.0 / particles_max;
+    }
+
+}
+
+void particle_filter::predict(float last_x, float last_y, float last_o, float x, float y, float o)
+{
+    // odometry motion model: a rotation, a translation and a second rotation, each with a noise
+    // proportional to the motion
+
+    float translation = hypot(x - last_x, y - last_y);
+    float rotation1 = 0;
+    if ( translation > 0.01 )
+        rotation1 = atan2(y - last_y, x - last_x) - last_o;
+    rotation1 = atan2(sin(rotation1), cos(rotation1));
+    float rotation2 = o - last_o - rotation1;
+    rotation2 = atan2(sin(rotation2), cos(rotation2));
+
+    normal_distribution<float> noise(0, 1);
+    float rotation1_deviation = odometry_rotation_noise * fabs(rotation1) + odometry_rotation_translation_noise * translation;
+    float translation_deviation = odometry_translation_noise * translation + odometry_translation_rotation_noise * ( fabs(rotation1) + fabs(rotation2) );
+    float rotation2_deviation = odometry_rotation_noise * fabs(rotation2) + odometry_rotation_translation_noise * translation;
+
+    for (size_t loop = 0; loop < particles.size(); loop++)
+    {
+        particle& p = particles[loop];
+        float r1 = rotation1 + rotation1_deviation * noise(generator);
+        float t = translation + translation_deviation * noise(generator);
+        float r2 = rotation2 + rotation2_deviation * noise(generator);
+
+        p.x += t * cos(p.orientation + r1);
+        p.y += t * sin(p.orientation + r1);
+        p.orientation += r1 + r2;
+        p.orientation = atan2(sin(p.orientation), cos(p.orientation));
+    }
+
+}
+
+double particle_filter::log_weight(const particle& p, const vector<float>& beam_r, const vector<float>& beam_cos, const vector<float>& beam_sin) const
+{
+
+    const float cos_o = cos(p.orientation);
+    const float sin_o = sin(p.orientation);
+    const uint8_t* distance = map.distance_field();
+
+    double log_weight = 0;
+    for (size_t loop = 0; loop < beam_r.size(); loop++)
+    {
+        float hit_x = p.x + beam_r[loop] * ( cos_o * beam_cos[loop] - sin_o * beam_sin[loop] );
+        float hit_y = p.y + beam_r[loop] * ( sin_o * beam_cos[loop] + cos_o * beam_sin[loop] );
+
+        int x_int, y_int;
+        if ( map.cell_index(hit_x, hit_y, x_int, y_int) )
+            log_weight += log_likelihood[distance[map.width_max * y_int + x_int]];
+        else
+            log_weight += log_outside;
+    }
+
+    return (log_weight);
+
+}
+
+void particle_filter::correct(int nb_beams, const float* r, const float* theta, const bool* valid)
+{
+
+    if ( particles.empty() )
+        return;
+
+    // a subset of the valid beams, spread over the whole scan
+    vector<float> beam_r, beam_cos, beam_sin;
+    int step = max(nb_beams / particle_beams, 1);
+    for (int loop = 0; loop < nb_beams; loop += step)
+        if ( valid[loop] )
+        {
+            beam_r.push_back(r[loop]);
+            beam_cos.push_back(cos(theta[loop]));
+            beam_sin.push_back(sin(theta[loop]));
+        }
+    if ( beam_r.empty() )
+        return;
+
+    // the weights are computed as logs: the product of the likelihoods of the beams underflows
+    vector<double> log_weights(particles.size());
+    double log_max = -numeric_limits<double>::infinity();
+    for (size_t loop = 0; loop < particles.size(); loop++)
+    {
+        log_weights[loop] = log_weight(particles[loop], beam_r, beam_cos, beam_sin);
+        log_max = max(log_max, log_weights[loop]);
+    }
+
+    double total = 0;
+    for (size_t loop = 0; loop < particles.size(); loop++)
+    {
+        particles[loop].weight *= exp(log_weights[loop] - log_max);
+        total += particles[loop].weight;
+    }
+    for (size_t loop = 0; loop < particles.size(); loop++)
+        particles[loop].weight /= total;
+
+    resample();
+
+}
+
+void particle_filter::resample()
+{
+    // KLD sampling: the particles are drawn one by one until their number is enough for the number of bins
+    // of the histogram they occupy, ie for the spread of the distribution
+
+    vector<double> cumulative(particles.size());
+    double total = 0;
+    for (size_t loop = 0; loop < particles.size(); loop++)
+    {
+        total += particles[loop].weight;
+        cumulative[loop] = total;
+    }
+
+    uniform_real_distribution<double> draw(0, total);
+    unordered_set<int64_t> bins;
+    vector<particle> samples;
+    samples.reserve(particles_max);
+    int nb_required = particles_min;
+    while ( ( int(samples.size()) < nb_required ) && ( int(samples.size()) < particles_max ) )
+    {
+        size_t index = upper_bound(cumulative.begin(), cumulative.end(), draw(generator)) - cumulative.begin();
+        particle p = particles[min(index, particles.size() - 1)];
+        samples.push_back(p);
+
+        int64_t bin_x = int64_t(floor(p.x / kld_bin_size)) & 0x1fffff;
+        int64_t bin_y = int64_t(floor(p.y / kld_bin_size)) & 0x1fffff;
+        int64_t bin_o = int64_t(floor(p.orientation * 180 / M_PI / kld_bin_angle)) & 0x1fffff;
+        if ( bins.insert(( bin_x << 42 ) | ( bin_y << 21 ) | bin_o).second && ( bins.size() > 1 ) )
+        {
+            // number of samples such that the KL divergence to the true distribution is below kld_error
+            // with a probability given by kld_quantile (Wilson-Hilferty approximation of the chi-square quantile)
+            double k = bins.size() - 1;
+            double a = 2 / ( 9 * k );
+            double b = 1 - a + sqrt(a) * kld_quantile;
+            nb_required = max<int>(particles_min, ceil(k / ( 2 * kld_error ) * b * b * b));
+        }
+    }
+
+    for (size_t loop = 0; loop < samples.size(); loop++)
+        samples[loop].weight = 1.0 / samples.size();
+    particles.swap(samples);
+
+}
+
+void particle_filter::estimate(float& x, float& y, float& o, float& deviation) const
+{
+
+    double sum_x = 0, sum_y = 0, sum_cos = 0, sum_sin = 0, total = 0;
+    for (size_t loop = 0; loop < particles.size(); loop++)
+    {
+        const particle& p = particles[loop];
+        sum_x += p.weight * p.x;
+        sum_y += p.weight * p.y;
+        sum_cos += p.weight * cos(p.orientation);
+        sum_sin += p.weight * sin(p.orientation);
+        total += p.weight;
+    }
+    x = sum_x / total;
+    y = sum_y / total;
+    o = atan2(sum_sin, sum_cos);
+
+    double variance = 0;
+    for (size_t loop = 0; loop < particles.size(); loop++)
+        variance += particles[loop].weight * ( pow(particles[loop].x - x, 2) + pow(particles[loop].y - y, 2) );
+    deviation = sqrt(variance / total);
+
+}
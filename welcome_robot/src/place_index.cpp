@@ -0,0 +1,303 @@
+// index of the places of a map for the global relocalization
+#include <place_index.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+static const char index_magic[8] = "LOCPLC";
+
+// header of an index file, followed by the places and their descriptors
+struct index_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_sectors;
+    uint32_t nb_places;
+    float place_step;
+    float range_max;
+};
+
+// range of the beam from (x, y) in the direction angle, range_max if it hits nothing
+// the distance field gives the length of the free path around each cell, so the ray jumps over the free space
+static float cast_ray(const localization_map& map, float x, float y, float angle, float range_max)
+{
+
+    const float c = cos(angle), s = sin(angle);
+    const uint8_t* distance = map.distance_field();
+    float range = 0;
+    while ( range < range_max )
+    {
+        int x_int, y_int;
+        if ( !map.cell_index(x + range * c, y + range * s, x_int, y_int) )
+            return (range_max);
+        if ( map.cell_value(x + range * c, y + range * s) == 100 )
+            return (range);
+
+        // the nearest occupied cell is at least 2 cells closer than the distance between the centers of the cells
+        int free_cells = distance[map.width_max * y_int + x_int] - 2;
+        range += max<float>(free_cells, 0.25) * map.cell_size;
+    }
+
+    return (range_max);
+
+}
+
+place_index::place_index()
+{
+
+    place_step = 1;
+    range_max = 1;
+
+}
+
+uint8_t place_index::quantize(float range) const
+{
+
+    return (lround(255 * sqrt(max(min(range, range_max), 0.0f) / range_max)));
+
+}
+
+void place_index::build(const localization_map& map, float place_step, float range_max)
+{
+
+    this->place_step = place_step;
+    this->range_max = range_max;
+    places.clear();
+    descriptors.clear();
+
+    const float ray_step = 2 * M_PI / ( place_sectors * place_rays_per_sector );
+    const int clearance = ceil(place_clearance / map.cell_size);
+    for (float y = map.min_y + place_step / 2; y < map.max_y; y += place_step)
+        for (float x = map.min_x + place_step / 2; x < map.max_x; x += place_step)
+        {
+            int x_int, y_int;
+            if ( !map.cell_index(x, y, x_int, y_int) || ( map.cell_value(x, y) != 0 ) || ( map.distance_field()[map.width_max * y_int + x_int] < clearance ) )
+                continue;
+
+            places.push_back(x);
+            places.push_back(y);
+            size_t first = descriptors.size();
+            descriptors.resize(first + 2 * place_sectors);
+            for (int loop = 0; loop < place_sectors; loop++)
+            {
+                float nearest = range_max;
+                for (int loop_ray = 0; loop_ray < place_rays_per_sector; loop_ray++)
+                    nearest = min(nearest, cast_ray(map, x, y, ( loop * place_rays_per_sector + loop_ray + 0.5 ) * ray_step, range_max));
+                descriptors[first + loop] = descriptors[first + place_sectors + loop] = quantize(nearest);
+            }
+        }
+    compute_keys();
+
+}
+
+void place_index::ring_key(const uint8_t* descriptor, int nb_sectors, uint8_t* key) const
+{
+
+    int counts[place_key_bins] = { 0 };
+    for (int loop = 0; loop < nb_sectors; loop++)
+        counts[descriptor[loop] * place_key_bins / 256]++;
+    for (int loop = 0; loop < place_key_bins; loop++)
+        key[loop] = nb_sectors ? ( counts[loop] * place_sectors + nb_sectors / 2 ) / nb_sectors : 0;
+
+}
+
+void place_index::compute_keys()
+{
+
+    const int nb_places = size();
+    keys.resize(size_t(nb_places) * place_key_bins);
+    for (int loop = 0; loop < nb_places; loop++)
+        ring_key(&descriptors[size_t(loop) * 2 * place_sectors], place_sectors, &keys[size_t(loop) * place_key_bins]);
+
+}
+
+int place_index::describe(int nb_beams, const float* r, const float* theta, const bool* valid, uint8_t* descriptor, int& nb_seen) const
+{
+
+    // the sectors entirely in the field of view of the laser, the beams without echo are at range_max
+    const float sector = angle_step();
+    int first = ceil(theta[0] / sector);
+    int last = floor(theta[nb_beams - 1] / sector);
+    nb_seen = min(last - first, place_sectors);
+    if ( nb_seen <= 0 )
+    {
+        nb_seen = 0;
+        return (0);
+    }
+
+    vector<float> nearest(nb_seen, range_max);
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        int current = floor(theta[loop] / sector) - first;
+        if ( ( current >= 0 ) && ( current < nb_seen ) && valid[loop] && ( r[loop] > 0 ) )
+            nearest[current] = min(nearest[current], r[loop]);
+    }
+    for (int loop = 0; loop < nb_seen; loop++)
+        descriptor[loop] = quantize(nearest[loop]);
+
+    return (( first % place_sectors + place_sectors ) % place_sectors);
+
+}
+
+void place_index::query(int nb_beams, const float* r, const float* theta, const bool* valid, int nb_candidates, vector<place_candidate>& candidates) const
+{
+
+    uint8_t descriptor[place_sectors];
+    int nb_seen;
+    int first = describe(nb_beams, r, theta, valid, descriptor, nb_seen);
+
+    // the places whose ring keys are the closest to the key of the scan, whatever the orientation of the robot
+    // the keys are small and contiguous: the sums of absolute differences are vectorized by the compiler
+    uint8_t key[place_key_bins];
+    ring_key(descriptor, nb_seen, key);
+    const int nb_places = size();
+    vector< pair<int, int> > key_distances(nb_places);
+    for (int loop = 0; loop < nb_places; loop++)
+    {
+        const uint8_t* place = &keys[size_t(loop) * place_key_bins];
+        int distance = 0;
+        for (int loop_bin = 0; loop_bin < place_key_bins; loop_bin++)
+            distance += abs(int(place[loop_bin]) - int(key[loop_bin]));
+        key_distances[loop] = make_pair(distance, loop);
+    }
+    const int nb_aligned = min(place_key_candidates, nb_places);
+    partial_sort(key_distances.begin(), key_distances.begin() + nb_aligned, key_distances.end());
+
+    // the robot at orientation sector * angle_step sees the sectors first + sector, first + sector + 1, ... of a place
+    vector< pair<int, int> > distances(nb_aligned);
+    for (int loop_aligned = 0; loop_aligned < nb_aligned; loop_aligned++)
+    {
+        const int loop = key_distances[loop_aligned].second;
+        const uint8_t* place = &descriptors[size_t(loop) * 2 * place_sectors];
+        int best = -1, best_sector = 0;
+        for (int loop_sector = 0; loop_sector < place_sectors; loop_sector++)
+        {
+            const uint8_t* current = place + ( first + loop_sector ) % place_sectors;
+            int distance = 0;
+            for (int loop_seen = 0; loop_seen < nb_seen; loop_seen++)
+                distance += abs(int(current[loop_seen]) - int(descriptor[loop_seen]));
+            if ( ( best < 0 ) || ( distance < best ) )
+            {
+                best = distance;
+                best_sector = loop_sector;
+            }
+        }
+        distances[loop_aligned] = make_pair(best, loop * place_sectors + best_sector);
+    }
+
+    nb_candidates = min(nb_candidates, nb_aligned);
+    partial_sort(distances.begin(), distances.begin() + nb_candidates, distances.end());
+
+    candidates.resize(nb_candidates);
+    for (int loop = 0; loop < nb_candidates; loop++)
+    {
+        const int place = distances[loop].second / place_sectors;
+        candidates[loop].x = places[2 * place];
+        candidates[loop].y = places[2 * place + 1];
+        candidates[loop].orientation = remainder(( distances[loop].second % place_sectors ) * angle_step(), 2 * M_PI);
+        candidates[loop].distance = distances[loop].first;
+    }
+
+}
+
+search_result place_index::verify(const scan_matcher& matcher, const vector<place_candidate>& candidates, float resolution, float angle_resolution, bool branch_and_bound) const
+{
+
+    search_result best = search_result();
+    int nb_scored = 0;
+    for (size_t loop = 0; loop < candidates.size(); loop++)
+    {
+        const place_candidate& candidate = candidates[loop];
+        search_window window = scan_matcher::make_window(candidate.x - place_step / 2, candidate.x + place_step / 2, candidate.y - place_step / 2, candidate.y + place_step / 2,
+                                                         candidate.orientation - angle_step(), candidate.orientation + angle_step(), resolution, angle_resolution);
+        search_result current = branch_and_bound ? matcher.branch_and_bound_search(window) : matcher.exhaustive_search(window);
+        nb_scored += current.nb_scored;
+        if ( current.found && ( !best.found || ( current.score > best.score ) ) )
+            best = current;
+    }
+    best.nb_scored = nb_scored;
+
+    return (best);
+
+}
+
+bool place_index::save(const string& file) const
+{
+
+    index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, index_magic, sizeof(header.magic));
+    header.version = place_index_version;
+    header.nb_sectors = place_sectors;
+    header.nb_places = size();
+    header.place_step = place_step;
+    header.range_max = range_max;
+
+    // written under a temporary name, so that a node never reads a partial index
+    string temporary = file + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if ( !out )
+        return (false);
+    bool written = ( fwrite(&header, sizeof(header), 1, out) == 1 )
+                && ( fwrite(places.data(), sizeof(float), places.size(), out) == places.size() );
+    // each descriptor is only written once
+    for (size_t loop = 0; written && ( loop < descriptors.size() ); loop += 2 * place_sectors)
+        written = fwrite(&descriptors[loop], 1, place_sectors, out) == place_sectors;
+    written = ( fclose(out) == 0 ) && written;
+    if ( !written || ( rename(temporary.c_str(), file.c_str()) != 0 ) )
+    {
+        remove(temporary.c_str());
+        return (false);
+    }
+
+    return (true);
+
+}
+
+bool place_index::load(const string& file)
+{
+
+    FILE* in = fopen(file.c_str(), "rb");
+    if ( !in )
+        return (false);
+
+    index_header header;
+    bool valid = ( fread(&header, sizeof(header), 1, in) == 1 ) && ( memcmp(header.magic, index_magic, sizeof(header.magic)) == 0 )
+              && ( header.version == place_index_version ) && ( header.nb_sectors == place_sectors ) && ( header.place_step > 0 ) && ( header.range_max > 0 );
+
+    // the places announced by the header must be in the file, before anything is allocated for them
+    if ( valid )
+    {
+        long start = ftell(in);
+        valid = ( start >= 0 ) && ( fseek(in, 0, SEEK_END) == 0 );
+        long end = valid ? ftell(in) : -1;
+        valid = valid && ( end >= start ) && ( fseek(in, start, SEEK_SET) == 0 )
+             && ( uint64_t(header.nb_places) * ( 2 * sizeof(float) + place_sectors ) == uint64_t(end - start) );
+    }
+
+    vector<float> read_places;
+    vector<uint8_t> read_descriptors;
+    if ( valid )
+    {
+        read_places.resize(size_t(header.nb_places) * 2);
+        read_descriptors.resize(size_t(header.nb_places) * 2 * place_sectors);
+        valid = fread(read_places.data(), sizeof(float), read_places.size(), in) == read_places.size();
+        for (size_t loop = 0; valid && ( loop < read_descriptors.size() ); loop += 2 * place_sectors)
+        {
+            valid = fread(&read_descriptors[loop], 1, place_sectors, in) == place_sectors;
+            copy(&read_descriptors[loop], &read_descriptors[loop] + place_sectors, &read_descriptors[loop] + place_sectors);
+        }
+    }
+    fclose(in);
+    if ( !valid )
+        return (false);
+
+    place_step = header.place_step;
+    range_max = header.range_max;
+    places.swap(read_places);
+    descriptors.swap(read_descriptors);
+    compute_keys();
+
+    return (true);
+
+}
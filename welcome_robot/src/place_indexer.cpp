@@ -0,0 +1,48 @@
+// offline indexing of the places of a map_server map for the global relocalization of the localization node
+// usage: place_indexer map.yaml map.places [place_step] [range_max]
+// place_step (in meters) is the distance between two places, 0.5 by default
+// range_max (in meters) must be the range of the laser, 12 by default
+#include <place_index.h>
+#include <cstdio>
+#include <cstdlib>
+
+int main(int argc, char **argv)
+{
+
+    if ( argc < 3 )
+    {
+        printf("usage: %s map.yaml map.places [place_step] [range_max]\n", argv[0]);
+        return 1;
+    }
+
+    float place_step = ( argc > 3 ) ? atof(argv[3]) : 0.5;
+    float range_max = ( argc > 4 ) ? atof(argv[4]) : 12;
+    if ( ( place_step <= 0 ) || ( range_max <= 0 ) )
+    {
+        printf("place_step and range_max must be positive\n");
+        return 1;
+    }
+
+    int width, height;
+    float resolution, origin_x, origin_y;
+    vector<int8_t> occupancy;
+    if ( !read_map_file(argv[1], width, height, resolution, origin_x, origin_y, occupancy) )
+    {
+        printf("cannot read the map %s\n", argv[1]);
+        return 1;
+    }
+
+    localization_map map;
+    map.load(width, height, resolution, origin_x, origin_y, &occupancy[0], resolution, false);
+    place_index places;
+    places.build(map, place_step, range_max);
+    if ( !places.save(argv[2]) )
+    {
+        printf("cannot write the index %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%s: %d places every %f m, version %d\n", argv[2], places.size(), place_step, place_index_version);
+    return 0;
+
+}
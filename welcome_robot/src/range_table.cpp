@@ -0,0 +1,428 @@
+// ranges expected from a position of the map, by direction and lane
+#include <range_table.h>
+#include <algorithm>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define range_file_alignment 64 // the sections of a range table file start on a cache line
+
+struct range_file_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_directions, lanes_per_cell, units_per_cell;
+    int32_t width, height;
+    float cell_size, min_x, min_y;
+    uint32_t padding;
+    uint64_t signature;
+    uint64_t nb_lanes, nb_runs;
+    uint64_t offset[4], size[4];
+};
+
+static const char range_file_magic[8] = { 'L', 'O', 'C', 'R', 'N', 'G', 0, 0 };
+
+// FNV-1a hash of the occupancy of the map: a file is only mapped for the map it was built from
+static uint64_t map_signature(const localization_map& map)
+{
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (int loop_y = 0; loop_y < map.height_max; loop_y++)
+        for (int loop_x = 0; loop_x < map.width_max; loop_x++)
+        {
+            hash ^= uint8_t(map.cell_state(loop_x, loop_y) + 1);
+            hash *= 1099511628211ULL;
+        }
+
+    return (hash);
+
+}
+
+range_table::range_table()
+{
+
+    cell_size = lane_width = 1;
+    min_x = min_y = 0;
+    nb_directions = 0;
+    width = height = 0;
+    signature = 0;
+    nb_lanes = nb_runs = 0;
+    file_data = 0;
+    file_size = 0;
+    attach_storage();
+
+}
+
+range_table::~range_table()
+{
+
+    release_file();
+
+}
+
+void range_table::release_file()
+{
+
+    if ( file_data )
+        munmap(file_data, file_size);
+    file_data = 0;
+    file_size = 0;
+
+}
+
+void range_table::attach_storage()
+{
+
+    directions = direction_storage.data();
+    first_run = first_run_storage.data();
+    run_start = start_storage.data();
+    run_length = length_storage.data();
+
+}
+
+bool range_table::build(const localization_map& map, int nb_threads)
+{
+
+    release_file();
+    nb_directions = 0;
+    cell_size = map.cell_size;
+    lane_width = cell_size / range_lanes_per_cell;
+    min_x = map.min_x;
+    min_y = map.min_y;
+    width = map.width_max;
+    height = map.height_max;
+    signature = map_signature(map);
+
+    // occupied cells with a neighbor that is not: the cells inside an obstacle are never the first one hit by a ray from a free cell
+    vector<int> border_x, border_y;
+    for (int loop_y = 0; loop_y < map.height_max; loop_y++)
+        for (int loop_x = 0; loop_x < map.width_max; loop_x++)
+            if ( ( map.cell_state(loop_x, loop_y) == 100 ) &&
+                 ( ( loop_x == 0 ) || ( loop_y == 0 ) || ( loop_x == map.width_max - 1 ) || ( loop_y == map.height_max - 1 ) ||
+                   ( map.cell_state(loop_x - 1, loop_y) != 100 ) || ( map.cell_state(loop_x + 1, loop_y) != 100 ) ||
+                   ( map.cell_state(loop_x, loop_y - 1) != 100 ) || ( map.cell_state(loop_x, loop_y + 1) != 100 ) ) )
+            {
+                border_x.push_back(loop_x);
+                border_y.push_back(loop_y);
+            }
+
+    const float size_x = map.width_max * cell_size, size_y = map.height_max * cell_size;
+    const float unit = cell_size / range_units_per_cell;
+    if ( ( ( size_x + size_y ) / unit + 2 * range_units_per_cell ) > 65535 - range_max_run )
+        return (false);
+
+    // the directions are independent: each thread builds every nb_threads-th direction in its own arrays
+    vector<lanes> built(range_directions);
+    vector< vector<uint32_t> > first(range_directions);
+    vector< vector<uint16_t> > starts(range_directions);
+    vector< vector<uint8_t> > lengths(range_directions);
+    const int nb_workers = max(1, min(nb_threads, range_directions));
+    vector<thread> workers;
+    for (int loop = 0; loop < nb_workers; loop++)
+    {
+        auto directions_of = [&, loop]()
+        {
+            for (int loop_direction = loop; loop_direction < range_directions; loop_direction += nb_workers)
+                build_direction(map, border_x, border_y, loop_direction, built[loop_direction], first[loop_direction], starts[loop_direction], lengths[loop_direction]);
+        };
+        if ( loop < nb_workers - 1 )
+            workers.push_back(thread(directions_of));
+        else
+            directions_of();
+    }
+    for (thread& worker : workers)
+        worker.join();
+
+    // the arrays of the directions are concatenated, the runs of the lanes are indexed from the first run of the table
+    size_t total_lanes = 0, total_runs = 0;
+    for (int loop = 0; loop < range_directions; loop++)
+    {
+        total_lanes += built[loop].nb_lanes;
+        total_runs += starts[loop].size();
+    }
+    if ( total_runs > 0xffffffffULL )
+        return (false);
+
+    direction_storage.swap(built);
+    first_run_storage.assign(1, 0);
+    first_run_storage.reserve(total_lanes + 1);
+    vector<uint16_t>().swap(start_storage);
+    vector<uint8_t>().swap(length_storage);
+    start_storage.reserve(total_runs);
+    length_storage.reserve(total_runs);
+    for (int loop = 0; loop < range_directions; loop++)
+    {
+        direction_storage[loop].first_lane = first_run_storage.size() - 1;
+        const uint32_t offset = start_storage.size();
+        for (int loop_lane = 1; loop_lane <= direction_storage[loop].nb_lanes; loop_lane++)
+            first_run_storage.push_back(offset + first[loop][loop_lane]);
+        start_storage.insert(start_storage.end(), starts[loop].begin(), starts[loop].end());
+        length_storage.insert(length_storage.end(), lengths[loop].begin(), lengths[loop].end());
+        vector<uint32_t>().swap(first[loop]);
+        vector<uint16_t>().swap(starts[loop]);
+        vector<uint8_t>().swap(lengths[loop]);
+    }
+
+    nb_lanes = total_lanes;
+    nb_runs = total_runs;
+    nb_directions = range_directions;
+    attach_storage();
+    return (true);
+
+}
+
+void range_table::build_direction(const localization_map& map, const vector<int>& border_x, const vector<int>& border_y, int direction, lanes& current,
+                                  vector<uint32_t>& first, vector<uint16_t>& starts, vector<uint8_t>& lengths) const
+{
+
+    const float size_x = map.width_max * cell_size, size_y = map.height_max * cell_size;
+    const float unit = cell_size / range_units_per_cell;
+    const float angle = direction * M_PI / range_directions;
+    current.cos_angle = cos(angle);
+    current.sin_angle = sin(angle);
+
+    // position across the direction: -x sin + y cos over the corners of the map
+    current.min_across = min(0.0f, -size_x * current.sin_angle) + min(0.0f, size_y * current.cos_angle);
+    float max_across = max(0.0f, -size_x * current.sin_angle) + max(0.0f, size_y * current.cos_angle);
+    current.nb_lanes = int(( max_across - current.min_across ) / lane_width) + 1;
+    current.min_along = min(0.0f, size_x * current.cos_angle) + min(0.0f, size_y * current.sin_angle);
+
+    // a cell is in all the lanes its extent across the direction, cell_size * ( |cos| + |sin| ), overlaps:
+    // a ray never misses an obstacle, it may only be stopped by an obstacle less than a lane beside it
+    const float half = 0.5 * cell_size * ( fabs(current.cos_angle) + fabs(current.sin_angle) );
+    vector<int> first_lane(border_x.size()), last_lane(border_x.size());
+    vector<float> along(border_x.size());
+    first.assign(current.nb_lanes + 1, 0);
+    for (size_t loop = 0; loop < border_x.size(); loop++)
+    {
+        float center_x = ( border_x[loop] + 0.5 ) * cell_size, center_y = ( border_y[loop] + 0.5 ) * cell_size;
+        float across = -center_x * current.sin_angle + center_y * current.cos_angle - current.min_across;
+        along[loop] = ( center_x * current.cos_angle + center_y * current.sin_angle - current.min_along ) / unit;
+        first_lane[loop] = max(int(floor(( across - half ) / lane_width)), 0);
+        last_lane[loop] = min(int(floor(( across + half ) / lane_width)), current.nb_lanes - 1);
+        for (int loop_lane = first_lane[loop]; loop_lane <= last_lane[loop]; loop_lane++)
+            first[loop_lane + 1]++;
+    }
+
+    // the cells of each lane, sorted along the direction (counting sort by lane)
+    for (int loop_lane = 0; loop_lane < current.nb_lanes; loop_lane++)
+        first[loop_lane + 1] += first[loop_lane];
+    vector<float> cells(first[current.nb_lanes]);
+    vector<uint32_t> next(first.begin(), first.end() - 1);
+    for (size_t loop = 0; loop < border_x.size(); loop++)
+        for (int loop_lane = first_lane[loop]; loop_lane <= last_lane[loop]; loop_lane++)
+            cells[next[loop_lane]++] = along[loop];
+
+    // the cells of a lane closer than a diagonal of cell make one run, which covers them by half a cell on both sides
+    // a run longer than range_max_run is stored as several runs that follow each other
+    const float half_cell = 0.5 * range_units_per_cell;
+    vector<int> run_begin, run_end;
+    starts.clear();
+    lengths.clear();
+    for (int loop_lane = 0; loop_lane < current.nb_lanes; loop_lane++)
+    {
+        const int begin = first[loop_lane], end = first[loop_lane + 1];
+        first[loop_lane] = starts.size();
+        sort(cells.begin() + begin, cells.begin() + end);
+        run_begin.clear();
+        run_end.clear();
+        for (int loop = begin; loop < end; loop++)
+            if ( ( loop > begin ) && ( cells[loop] - cells[loop - 1] <= 1.5 * range_units_per_cell ) )
+                run_end.back() = ceil(cells[loop] + half_cell);
+            else
+            {
+                run_begin.push_back(max(floor(cells[loop] - half_cell), 0.0f));
+                run_end.push_back(ceil(cells[loop] + half_cell));
+            }
+        for (size_t loop = 0; loop < run_begin.size(); loop++)
+            for (int position = run_begin[loop]; position < run_end[loop]; position += range_max_run)
+            {
+                starts.push_back(position);
+                lengths.push_back(min(run_end[loop] - position, range_max_run));
+            }
+    }
+    first[current.nb_lanes] = starts.size();
+
+}
+
+float range_table::range(float x, float y, float angle, float max_range) const
+{
+
+    if ( !nb_directions )
+        return (max_range);
+
+    // nearest direction of the table, the lanes of the opposite directions are read backwards
+    long direction = lround(angle * range_directions / M_PI) % ( 2 * range_directions );
+    if ( direction < 0 )
+        direction += 2 * range_directions;
+    bool backwards = direction >= range_directions;
+    const lanes& current = directions[backwards ? direction - range_directions : direction];
+
+    float position_x = x - min_x, position_y = y - min_y;
+    int lane = floor(( -position_x * current.sin_angle + position_y * current.cos_angle - current.min_across ) / lane_width);
+    if ( ( lane < 0 ) || ( lane >= current.nb_lanes ) )
+        return (max_range);
+    const float unit = cell_size / range_units_per_cell;
+    float along = ( position_x * current.cos_angle + position_y * current.sin_angle - current.min_along ) / unit;
+
+    const uint32_t first = first_run[current.first_lane + lane];
+    const int nb_runs = first_run[current.first_lane + lane + 1] - first;
+    const uint16_t* starts = run_start + first;
+    const uint8_t* lengths = run_length + first;
+    float distance;
+    if ( !backwards )
+    {
+        // first run that starts after the position, unless the position is inside the run before it
+        int run = upper_bound(starts, starts + nb_runs, along) - starts;
+        if ( ( run > 0 ) && ( starts[run - 1] + lengths[run - 1] > along ) )
+            return (0);
+        if ( run == nb_runs )
+            return (max_range);
+        distance = ( starts[run] - along ) * unit;
+    }
+    else
+    {
+        // last run that starts before the position
+        int run = lower_bound(starts, starts + nb_runs, along) - starts;
+        if ( run == 0 )
+            return (max_range);
+        distance = max(along - ( starts[run - 1] + lengths[run - 1] ), 0.0f) * unit;
+    }
+
+    return (min(distance, max_range));
+
+}
+
+size_t range_table::memory_size() const
+{
+
+    return (nb_directions * sizeof(lanes) + ( nb_lanes + 1 ) * sizeof(uint32_t) + nb_runs * ( sizeof(uint16_t) + sizeof(uint8_t) ));
+
+}
+
+bool range_table::save(const string& file) const
+{
+
+    if ( !nb_directions )
+        return (false);
+
+    range_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, range_file_magic, sizeof(header.magic));
+    header.version = range_table_version;
+    header.nb_directions = nb_directions;
+    header.lanes_per_cell = range_lanes_per_cell;
+    header.units_per_cell = range_units_per_cell;
+    header.cell_size = cell_size;
+    header.min_x = min_x;
+    header.min_y = min_y;
+    header.nb_lanes = nb_lanes;
+    header.nb_runs = nb_runs;
+
+    const void* sections[4] = { directions, first_run, run_start, run_length };
+    const uint64_t sizes[4] = { nb_directions * sizeof(lanes), ( nb_lanes + 1 ) * sizeof(uint32_t), nb_runs * sizeof(uint16_t), nb_runs * sizeof(uint8_t) };
+    uint64_t offset = ( sizeof(header) + range_file_alignment - 1 ) / range_file_alignment * range_file_alignment;
+    for (int loop = 0; loop < 4; loop++)
+    {
+        header.offset[loop] = offset;
+        header.size[loop] = sizes[loop];
+        offset += ( sizes[loop] + range_file_alignment - 1 ) / range_file_alignment * range_file_alignment;
+    }
+
+    header.width = width;
+    header.height = height;
+    header.signature = signature;
+
+    // written under a temporary name, so that a node never maps a partial file
+    string temporary = file + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if ( !out )
+        return (false);
+    bool written = fwrite(&header, sizeof(header), 1, out) == 1;
+    static const char padding[range_file_alignment] = { 0 };
+    uint64_t position = sizeof(header);
+    for (int loop = 0; written && ( loop < 4 ); loop++)
+    {
+        written = fwrite(padding, 1, header.offset[loop] - position, out) == header.offset[loop] - position;
+        if ( written && sizes[loop] )
+            written = fwrite(sections[loop], 1, sizes[loop], out) == sizes[loop];
+        position = header.offset[loop] + sizes[loop];
+    }
+    written = ( fclose(out) == 0 ) && written;
+    if ( !written || ( rename(temporary.c_str(), file.c_str()) != 0 ) )
+    {
+        remove(temporary.c_str());
+        return (false);
+    }
+
+    return (true);
+
+}
+
+bool range_table::open(const string& file, const localization_map& map)
+{
+
+    int fd = ::open(file.c_str(), O_RDONLY);
+    if ( fd < 0 )
+        return (false);
+    struct stat status;
+    void* data = MAP_FAILED;
+    if ( ( fstat(fd, &status) == 0 ) && ( size_t(status.st_size) >= sizeof(range_file_header) ) )
+        data = mmap(0, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if ( data == MAP_FAILED )
+        return (false);
+    const size_t size = status.st_size;
+
+    const range_file_header& header = *(const range_file_header*)data;
+    bool valid = ( memcmp(header.magic, range_file_magic, sizeof(header.magic)) == 0 ) && ( header.version == range_table_version )
+              && ( header.nb_directions == range_directions ) && ( header.lanes_per_cell == range_lanes_per_cell ) && ( header.units_per_cell == range_units_per_cell )
+              && ( header.width == map.width_max ) && ( header.height == map.height_max ) && ( header.cell_size == map.cell_size )
+              && ( header.min_x == map.min_x ) && ( header.min_y == map.min_y )
+              && ( header.size[0] == header.nb_directions * sizeof(lanes) ) && ( header.size[1] == ( header.nb_lanes + 1 ) * sizeof(uint32_t) )
+              && ( header.size[2] == header.nb_runs * sizeof(uint16_t) ) && ( header.size[3] == header.nb_runs * sizeof(uint8_t) );
+    for (int loop = 0; valid && ( loop < 4 ); loop++)
+        valid = ( header.offset[loop] % range_file_alignment == 0 ) && ( header.offset[loop] <= size ) && ( header.size[loop] <= size - header.offset[loop] );
+    // the lanes of the directions must be in the file
+    const char* base = (const char*)data;
+    const lanes* mapped = (const lanes*)( base + header.offset[0] );
+    for (uint32_t loop = 0; valid && ( loop < header.nb_directions ); loop++)
+        valid = ( mapped[loop].nb_lanes > 0 ) && ( uint64_t(mapped[loop].first_lane) + mapped[loop].nb_lanes <= header.nb_lanes );
+    // last, the occupancy of the map, which costs a pass over its cells
+    valid = valid && ( header.signature == map_signature(map) );
+    if ( !valid )
+    {
+        munmap(data, size);
+        return (false);
+    }
+
+    release_file();
+    file_data = data;
+    file_size = size;
+    vector<lanes>().swap(direction_storage);
+    vector<uint32_t>().swap(first_run_storage);
+    vector<uint16_t>().swap(start_storage);
+    vector<uint8_t>().swap(length_storage);
+
+    cell_size = header.cell_size;
+    lane_width = cell_size / range_lanes_per_cell;
+    min_x = header.min_x;
+    min_y = header.min_y;
+    width = header.width;
+    height = header.height;
+    signature = header.signature;
+    nb_lanes = header.nb_lanes;
+    nb_runs = header.nb_runs;
+    nb_directions = header.nb_directions;
+    directions = mapped;
+    first_run = (const uint32_t*)( base + header.offset[1] );
+    run_start = (const uint16_t*)( base + header.offset[2] );
+    run_length = (const uint8_t*)( base + header.offset[3] );
+
+    return (true);
+
+}
@@ -0,0 +1,1071 @@
+// search of the position of the robot for which the laser data best match the map
+#include <scan_matcher.h>
+#include <work_stealing_pool.h>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <queue>
+
+scan_matcher::scan_matcher(const localization_map& map, bool likelihood, bool correlative)
+    : map(map), likelihood(likelihood), correlative(correlative)
+{
+
+    nb_beams = 0;
+    nb_threads = 1;
+    pool = 0;
+    layer = 0;
+    vectorized = simd_supported();
+    bounded = true;
+    deadline = 0;
+    nb_echoes = 0;
+    ranges = 0;
+    beam_model = false;
+    mixture = beam_mixture();
+
+}
+
+void scan_matcher::set_vectorized(bool vectorized)
+{
+
+    this->vectorized = vectorized && simd_supported();
+
+}
+
+void scan_matcher::set_deadline(double deadline)
+{
+
+    this->deadline = deadline;
+
+}
+
+void scan_matcher::set_bounded(bool bounded)
+{
+
+    this->bounded = bounded;
+
+}
+
+void scan_matcher::set_nb_threads(int nb_threads)
+{
+
+    this->nb_threads = max(nb_threads, 1);
+
+}
+
+void scan_matcher::set_pool(work_stealing_pool* pool)
+{
+
+    this->pool = pool;
+
+}
+
+void scan_matcher::set_overlay(const overlay_layer* layer)
+{
+
+    // a layer without changes is the map: the kernels read the map directly
+    this->layer = ( layer && !layer->empty() ) ? layer : 0;
+
+}
+
+void scan_matcher::set_scan(int nb_beams, const float* r, const float* theta, const bool* echo)
+{
+
+    // the beams with an echo first, in their order: with the ranges, the hits are scored over the first nb_echoes beams
+    this->r.clear();
+    this->theta.clear();
+    this->echo.clear();
+    for (int loop_pass = 1; loop_pass >= 0; loop_pass--)
+        for (int loop = 0; loop < nb_beams; loop++)
+            if ( ( !echo || echo[loop] ) == bool(loop_pass) )
+            {
+                this->r.push_back(r[loop]);
+                this->theta.push_back(theta[loop]);
+                this->echo.push_back(loop_pass);
+            }
+    nb_echoes = count(this->echo.begin(), this->echo.end(), 1);
+    this->nb_beams = ranges ? nb_echoes : nb_beams;
+
+    beam_cos.resize(nb_beams);
+    beam_sin.resize(nb_beams);
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        beam_cos[loop] = cos(this->theta[loop]);
+        beam_sin[loop] = sin(this->theta[loop]);
+    }
+
+}
+
+void scan_matcher::set_ranges(const range_table* ranges, const beam_mixture& mixture, bool beam_model)
+{
+
+    this->ranges = ( ranges && ranges->built() ) ? ranges : 0;
+    this->mixture = mixture;
+    this->beam_model = beam_model;
+    nb_beams = this->ranges ? nb_echoes : int(r.size());
+
+}
+
+float scan_matcher::range_score(float x, float y, float o, float threshold, int& nb_evaluated) const
+{
+    // the beams scored with their expected range: all of them with the beam model, the beams without echo otherwise;
+    // the other beams score their hits as scalar_score
+
+    const float cos_o = cos(o), sin_o = sin(o);
+    const int nb_ranged = r.size();
+    float score_current = 0;
+    for (int loop = 0; loop < nb_ranged; loop++)
+    {
+        // each beam left scores at most 1
+        if ( ( loop % bound_check_beams == 0 ) && ( score_current + ( nb_ranged - loop ) + bound_margin < threshold ) )
+        {
+            nb_evaluated = loop;
+            return (score_current);
+        }
+
+        if ( !echo[loop] && !mixture.free_space )
+            continue;
+        if ( beam_model || !echo[loop] )
+        {
+            float expected = ranges->range(x, y, o + theta[loop], mixture.max_range);
+            score_current += mixture.score(r[loop], expected, echo[loop]);
+            continue;
+        }
+
+        float cos_beam = cos_o * beam_cos[loop] - sin_o * beam_sin[loop];
+        float sin_beam = sin_o * beam_cos[loop] + cos_o * beam_sin[loop];
+        float hit_x = x + r[loop] * cos_beam;
+        float hit_y = y + r[loop] * sin_beam;
+        int x_int, y_int;
+        if ( map.cell_index(hit_x, hit_y, x_int, y_int) )
+        {
+            if ( likelihood )
+                score_current += cell_likelihood(x_int, y_int);
+            else if ( cell_hit(x_int, y_int) )
+                score_current++;
+        }
+    }
+
+    nb_evaluated = nb_ranged;
+    return (score_current);
+}
+
+float scan_matcher::scalar_score(float x, float y, float o, float threshold, int& nb_evaluated) const
+{
+    // for each hit of the laser, we compute its position in the map and check if it is close to an occupied cell
+
+    // the beams are rotated as by the vectorized kernel, with the same operations: both find the same cells
+    const float cos_o = cos(o), sin_o = sin(o);
+    float score_current = 0;
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        // each beam left scores at most 1
+        if ( ( loop % bound_check_beams == 0 ) && ( score_current + ( nb_beams - loop ) + bound_margin < threshold ) )
+        {
+            nb_evaluated = loop;
+            return (score_current);
+        }
+
+        float cos_beam = cos_o * beam_cos[loop] - sin_o * beam_sin[loop];
+        float sin_beam = sin_o * beam_cos[loop] + cos_o * beam_sin[loop];
+        float hit_x = x + r[loop] * cos_beam;
+        float hit_y = y + r[loop] * sin_beam;
+
+        int x_int, y_int;
+        if ( map.cell_index(hit_x, hit_y, x_int, y_int) )
+        {
+            if ( likelihood )
+                score_current += cell_likelihood(x_int, y_int);
+            else if ( cell_hit(x_int, y_int) )
+                score_current++;
+        }
+    }
+
+    nb_evaluated = nb_beams;
+    return (score_current);
+}
+
+void scan_matcher::scalar_score_batch(int nb_positions, const float* x, const float* y, const float* o, float threshold, float* scores, int* nb_evaluated) const
+{
+
+    // positions still able to reach threshold
+    int active[score_batch_size];
+    int nb_active = 0;
+    for (int loop = 0; loop < nb_positions; loop++)
+    {
+        scores[loop] = 0;
+        nb_evaluated[loop] = nb_beams;
+        active[nb_active++] = loop;
+    }
+
+    for (int first = 0; ( first < nb_beams ) && nb_active; first += bound_check_beams)
+    {
+        // each beam left scores at most 1
+        int nb_kept = 0;
+        for (int loop = 0; loop < nb_active; loop++)
+            if ( scores[active[loop]] + ( nb_beams - first ) + bound_margin < threshold )
+                nb_evaluated[active[loop]] = first;
+            else
+                active[nb_kept++] = active[loop];
+        nb_active = nb_kept;
+
+        const int last = min(first + bound_check_beams, nb_beams);
+        for (int loop = first; loop < last; loop++)
+        {
+            // the positions of a batch mostly share their orientation: the direction of the beam is only computed when it changes
+            // (rotated as by scalar_score)
+            float beam_o = 0, beam_c = 0, beam_s = 0;
+            bool computed = false;
+            for (int loop_position = 0; loop_position < nb_active; loop_position++)
+            {
+                const int position = active[loop_position];
+                if ( !computed || ( o[position] != beam_o ) )
+                {
+                    beam_o = o[position];
+                    const float cos_o = cos(beam_o), sin_o = sin(beam_o);
+                    beam_c = r[loop] * ( cos_o * beam_cos[loop] - sin_o * beam_sin[loop] );
+                    beam_s = r[loop] * ( sin_o * beam_cos[loop] + cos_o * beam_sin[loop] );
+                    computed = true;
+                }
+                float hit_x = x[position] + beam_c;
+                float hit_y = y[position] + beam_s;
+
+                int x_int, y_int;
+                if ( map.cell_index(hit_x, hit_y, x_int, y_int) )
+                {
+                    if ( likelihood )
+                        scores[position] += cell_likelihood(x_int, y_int);
+                    else if ( cell_hit(x_int, y_int) )
+                        scores[position]++;
+                }
+            }
+        }
+    }
+
+}
+
+void scan_matcher::rotate_scan(const search_window& window, vector<int>& cells_x, vector<int>& cells_y) const
+{
+
+    cells_x.resize(window.nb_orientations * nb_beams);
+    cells_y.resize(window.nb_orientations * nb_beams);
+    for (int loop_orientation = 0; loop_orientation < window.nb_orientations; loop_orientation++)
+    {
+        float o = window.min_orientation + loop_orientation * window.angle_step;
+        for (int loop = 0; loop < nb_beams; loop++)
+        {
+            float hit_x = window.min_x + r[loop] * cos(o + theta[loop]);
+            float hit_y = window.min_y + r[loop] * sin(o + theta[loop]);
+            cells_x[loop_orientation * nb_beams + loop] = floor((hit_x - map.min_x) / map.cell_size);
+            cells_y[loop_orientation * nb_beams + loop] = floor((hit_y - map.min_y) / map.cell_size);
+        }
+    }
+
+}
+
+float scan_matcher::scalar_correlative_score(const int* cells_x, const int* cells_y, int x, int y, float threshold, int& nb_evaluated) const
+{
+
+    float score_current = 0;
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        if ( ( loop % bound_check_beams == 0 ) && ( score_current + ( nb_beams - loop ) + bound_margin < threshold ) )
+        {
+            nb_evaluated = loop;
+            return (score_current);
+        }
+
+        int x_int = cells_x[loop] + x;
+        int y_int = cells_y[loop] + y;
+
+        // outside of the map when x_int < 0 or x_int >= width_max
+        if ( ( unsigned(x_int) < unsigned(map.width_max) ) && ( unsigned(y_int) < unsigned(map.height_max) ) )
+        {
+            if ( likelihood )
+                score_current += cell_likelihood(x_int, y_int);
+            else if ( cell_hit(x_int, y_int) )
+                score_current++;
+        }
+    }
+
+    nb_evaluated = nb_beams;
+    return (score_current);
+}
+
+void scan_matcher::scalar_correlative_score_batch(const int* cells_x, const int* cells_y, int nb_positions, const int* x, const int* y, float threshold,
+                                                  float* scores, int* nb_evaluated) const
+{
+
+    int active[score_batch_size];
+    int nb_active = 0;
+    for (int loop = 0; loop < nb_positions; loop++)
+    {
+        scores[loop] = 0;
+        nb_evaluated[loop] = nb_beams;
+        active[nb_active++] = loop;
+    }
+
+    for (int first = 0; ( first < nb_beams ) && nb_active; first += bound_check_beams)
+    {
+        int nb_kept = 0;
+        for (int loop = 0; loop < nb_active; loop++)
+            if ( scores[active[loop]] + ( nb_beams - first ) + bound_margin < threshold )
+                nb_evaluated[active[loop]] = first;
+            else
+                active[nb_kept++] = active[loop];
+        nb_active = nb_kept;
+
+        const int last = min(first + bound_check_beams, nb_beams);
+        for (int loop = first; loop < last; loop++)
+            for (int loop_position = 0; loop_position < nb_active; loop_position++)
+            {
+                const int position = active[loop_position];
+                int x_int = cells_x[loop] + x[position];
+                int y_int = cells_y[loop] + y[position];
+                if ( ( unsigned(x_int) < unsigned(map.width_max) ) && ( unsigned(y_int) < unsigned(map.height_max) ) )
+                {
+                    if ( likelihood )
+                        scores[position] += cell_likelihood(x_int, y_int);
+                    else if ( cell_hit(x_int, y_int) )
+                        scores[position]++;
+                }
+            }
+    }
+
+}
+
+double scan_matcher::alignment_cost(float x, float y, float o, double hessian[3][3], double gradient[3]) const
+{
+
+    double cost = 0;
+    for (int loop = 0; loop < 3; loop++)
+    {
+        gradient[loop] = 0;
+        for (int loop_column = 0; loop_column < 3; loop_column++)
+            hessian[loop][loop_column] = 0;
+    }
+
+    // the beams without echo hit nothing
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        if ( !echo[loop] )
+            continue;
+        float c = r[loop] * cos(o + theta[loop]);
+        float s = r[loop] * sin(o + theta[loop]);
+
+        float gradient_x, gradient_y;
+        float residual = 1 - interpolated_likelihood(x + c, y + s, gradient_x, gradient_y);
+        cost += residual * residual;
+
+        // derivatives of the residual with respect to x, y and o
+        double jacobian[3] = { -gradient_x, -gradient_y, gradient_x * s - gradient_y * c };
+        for (int loop_row = 0; loop_row < 3; loop_row++)
+        {
+            gradient[loop_row] += jacobian[loop_row] * residual;
+            for (int loop_column = 0; loop_column < 3; loop_column++)
+                hessian[loop_row][loop_column] += jacobian[loop_row] * jacobian[loop_column];
+        }
+    }
+
+    return (cost);
+}
+
+bool solve_3x3(const double a[3][3], const double b[3], double x[3])
+{
+
+    double determinant = a[0][0] * ( a[1][1] * a[2][2] - a[1][2] * a[2][1] )
+                       - a[0][1] * ( a[1][0] * a[2][2] - a[1][2] * a[2][0] )
+                       + a[0][2] * ( a[1][0] * a[2][1] - a[1][1] * a[2][0] );
+    if ( fabs(determinant) < 1e-12 )
+        return (false);
+
+    for (int loop = 0; loop < 3; loop++)
+    {
+        double m[3][3];
+        for (int loop_row = 0; loop_row < 3; loop_row++)
+            for (int loop_column = 0; loop_column < 3; loop_column++)
+                m[loop_row][loop_column] = ( loop_column == loop ) ? b[loop_row] : a[loop_row][loop_column];
+        x[loop] = ( m[0][0] * ( m[1][1] * m[2][2] - m[1][2] * m[2][1] )
+                  - m[0][1] * ( m[1][0] * m[2][2] - m[1][2] * m[2][0] )
+                  + m[0][2] * ( m[1][0] * m[2][1] - m[1][1] * m[2][0] ) ) / determinant;
+    }
+
+    return (true);
+}
+
+search_result scan_matcher::refine(const search_window& window, const search_result& found) const
+{
+
+    if ( !found.found )
+        return (found);
+
+    float x = found.x, y = found.y, o = found.orientation;
+    double hessian[3][3], gradient[3];
+    double cost = alignment_cost(x, y, o, hessian, gradient);
+    double damping = 1e-3;
+
+    for (int loop = 0; loop < refine_iterations; loop++)
+    {
+        // Levenberg-Marquardt step: the diagonal is damped until the step decreases the cost
+        double damped[3][3], step[3], minus_gradient[3];
+        for (int loop_row = 0; loop_row < 3; loop_row++)
+        {
+            minus_gradient[loop_row] = -gradient[loop_row];
+            for (int loop_column = 0; loop_column < 3; loop_column++)
+                damped[loop_row][loop_column] = hessian[loop_row][loop_column] * ( ( loop_row == loop_column ) ? 1 + damping : 1 );
+        }
+        if ( !solve_3x3(damped, minus_gradient, step) )
+            break;
+
+        double next_hessian[3][3], next_gradient[3];
+        double next_cost = alignment_cost(x + step[0], y + step[1], o + step[2], next_hessian, next_gradient);
+        if ( next_cost < cost )
+        {
+            x += step[0];
+            y += step[1];
+            o += step[2];
+            cost = next_cost;
+            memcpy(hessian, next_hessian, sizeof(hessian));
+            memcpy(gradient, next_gradient, sizeof(gradient));
+            damping /= 10;
+
+            // converged below a tenth of millimeter and of a thousandth of degree
+            if ( ( fabs(step[0]) < 1e-4 ) && ( fabs(step[1]) < 1e-4 ) && ( fabs(step[2]) < 2e-5 ) )
+                break;
+        }
+        else
+            damping *= 10;
+    }
+
+    // the discrete search has found the right basin, the refinement must not leave it
+    search_result refined = found;
+    if ( ( fabs(x - found.x) <= window.step ) && ( fabs(y - found.y) <= window.step ) && ( fabs(o - found.orientation) <= window.angle_step ) )
+    {
+        refined.x = x;
+        refined.y = y;
+        refined.orientation = o;
+    }
+
+    return (refined);
+}
+
+bool scan_matcher::covariance(float x, float y, float o, double covariance[3][3]) const
+{
+
+    if ( nb_echoes <= 3 )
+        return (false);
+
+    double hessian[3][3], gradient[3];
+    double variance = alignment_cost(x, y, o, hessian, gradient) / ( nb_echoes - 3 );
+
+    // columns of the inverse of the hessian
+    for (int loop = 0; loop < 3; loop++)
+    {
+        double unit[3] = { 0, 0, 0 }, column[3];
+        unit[loop] = 1;
+        if ( !solve_3x3(hessian, unit, column) )
+            return (false);
+        for (int loop_row = 0; loop_row < 3; loop_row++)
+            covariance[loop_row][loop] = variance * column[loop_row];
+    }
+
+    return (true);
+
+}
+
+search_window scan_matcher::make_window(float min_x, float max_x, float min_y, float max_y, float min_orientation, float max_orientation, float step, float angle_step)
+{
+
+    search_window window;
+    window.min_x = min_x;
+    window.min_y = min_y;
+    window.min_orientation = min_orientation;
+    window.step = step;
+    window.angle_step = angle_step;
+
+    for (window.nb_x = 0; min_x + window.nb_x * step < max_x; window.nb_x++);
+    for (window.nb_y = 0; min_y + window.nb_y * step < max_y; window.nb_y++);
+    for (window.nb_orientations = 0; min_orientation + window.nb_orientations * angle_step < max_orientation; window.nb_orientations++);
+
+    return (window);
+}
+
+search_result scan_matcher::exhaustive_search(const search_window& window) const
+{
+
+    const chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+    // in correlative mode, the scan is rotated once for each orientation instead of once for each position
+    // the positions must then be aligned with the cells of the map
+    bool translate = correlative && ( fabs(window.step - map.cell_size) <= 1e-4 * map.cell_size );
+    vector<int> cells_x, cells_y;
+    if ( translate )
+        rotate_scan(window, cells_x, cells_y);
+
+    // the positions are scored best first, from the center of the window, ie the predicted position, outwards:
+    // the best score rises quickly, and the bounded scores abandon the other positions after a few beams
+    // they are scored by tiles of neighboring positions, whose hits fall in the same cells of the map
+    const int tile_size = 1 << score_tile_bits;
+    vector<search_position> tiles;
+    for (int loop_x = 0; loop_x < window.nb_x; loop_x += tile_size)
+        for (int loop_y = 0; loop_y < window.nb_y; loop_y += tile_size)
+        {
+            search_position tile = { loop_x, loop_y };
+            tiles.push_back(tile);
+        }
+    // distances of the centers of the tiles, in half positions
+    const int center_x = window.nb_x - 1, center_y = window.nb_y - 1;
+    stable_sort(tiles.begin(), tiles.end(), [center_x, center_y, tile_size](const search_position& a, const search_position& b)
+    {
+        const int a_x = 2 * a.x + tile_size - 1 - center_x, a_y = 2 * a.y + tile_size - 1 - center_y;
+        const int b_x = 2 * b.x + tile_size - 1 - center_x, b_y = 2 * b.y + tile_size - 1 - center_y;
+        return a_x * a_x + a_y * a_y < b_x * b_x + b_y * b_y;
+    });
+
+    // the tiles are dealt to the threads in turn, so that each thread starts close to the center
+    int nb_workers = max(1, min(nb_threads, int(tiles.size())));
+    vector<search_state> states(nb_workers);
+    atomic<float> shared_score(-1);
+    for (int loop = 0; loop < nb_workers; loop++)
+        start(states[loop], window, cells_x, cells_y, &shared_score, begin);
+    run_workers(nb_workers, [this, &states, translate, &tiles, nb_workers](int worker)
+    {
+        exhaustive_positions(states[worker], translate, tiles, worker, nb_workers);
+    });
+
+    return ( ranges ? rerank(states) : merge(states) );
+}
+
+void scan_matcher::run_workers(int nb_workers, const function<void(int)>& work) const
+{
+
+    if ( pool )
+    {
+        // the jobs submitted by a job go to the queue of its thread: the idle threads steal them, the others are run by this thread while it waits
+        atomic<int> nb_running(nb_workers - 1);
+        for (int loop = 0; loop < nb_workers - 1; loop++)
+            pool->submit([&work, &nb_running, loop]
+            {
+                work(loop);
+                nb_running--;
+            });
+        work(nb_workers - 1);
+        pool->wait_until([&nb_running] { return nb_running == 0; });
+        return;
+    }
+
+    vector<thread> workers;
+    for (int loop = 0; loop < nb_workers - 1; loop++)
+        workers.push_back(thread(work, loop));
+    work(nb_workers - 1);
+    for (thread& worker : workers)
+        worker.join();
+
+}
+
+void scan_matcher::start(search_state& state, const search_window& window, const vector<int>& cells_x, const vector<int>& cells_y, atomic<float>* shared_score,
+                         chrono::steady_clock::time_point begin) const
+{
+
+    state.shared_score = shared_score;
+    state.window = &window;
+    state.cells_x = &cells_x;
+    state.cells_y = &cells_y;
+    state.best.found = false;
+    state.best.score = -1;
+    state.best.nb_scored = 0;
+    state.best.nb_beams_scored = 0;
+    state.timed = deadline > 0;
+    state.expired = false;
+    state.end = begin + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(deadline));
+    state.nb_covered = 0;
+    state.candidates.clear();
+
+}
+
+bool scan_matcher::out_of_time(search_state& state) const
+{
+
+    if ( state.timed && !state.expired && ( chrono::steady_clock::now() >= state.end ) )
+        state.expired = true;
+    return (state.expired);
+
+}
+
+float scan_matcher::threshold(const search_state& state) const
+{
+    // a position that scores strictly less than the best score of this thread or of the others cannot win
+    // with the ranges, it cannot enter the candidates
+
+    if ( !bounded )
+        return (no_threshold);
+    float best = ranges ? candidate_threshold(state) : state.best.found ? state.best.score : no_threshold;
+    return ( max(best, state.shared_score->load(memory_order_relaxed)) );
+}
+
+void scan_matcher::exhaustive_positions(search_state& state, bool translate, const vector<search_position>& tiles, int first, int step) const
+{
+
+    const search_window& window = *state.window;
+
+    // orientations from the center of the window outwards
+    vector<int> orientations;
+    const int center = window.nb_orientations / 2;
+    for (int loop = 0; loop <= center; loop++)
+    {
+        if ( center - loop >= 0 )
+            orientations.push_back(center - loop);
+        if ( ( loop > 0 ) && ( center + loop < window.nb_orientations ) )
+            orientations.push_back(center + loop);
+    }
+
+    const int tile_size = 1 << score_tile_bits;
+    for (size_t loop = first; ( loop < tiles.size() ) && !( state.best.found && out_of_time(state) ); loop += step)
+    {
+        // the free positions of the tile: the robot can only be in a free cell
+        int positions_x[score_batch_size], positions_y[score_batch_size];
+        float x[score_batch_size], y[score_batch_size], o[score_batch_size];
+        int nb_positions = 0;
+        for (int loop_x = tiles[loop].x; loop_x < min(tiles[loop].x + tile_size, window.nb_x); loop_x++)
+            for (int loop_y = tiles[loop].y; loop_y < min(tiles[loop].y + tile_size, window.nb_y); loop_y++)
+            {
+                state.nb_covered += window.nb_orientations;
+                x[nb_positions] = window.min_x + loop_x * window.step;
+                y[nb_positions] = window.min_y + loop_y * window.step;
+                if ( cell_value(x[nb_positions], y[nb_positions]) )
+                    continue;
+                positions_x[nb_positions] = loop_x;
+                positions_y[nb_positions] = loop_y;
+                nb_positions++;
+            }
+        if ( !nb_positions )
+            continue;
+
+        for (size_t loop_orientation = 0; loop_orientation < orientations.size(); loop_orientation++)
+        {
+            const int orientation = orientations[loop_orientation];
+            float scores[score_batch_size];
+            int nb_evaluated[score_batch_size];
+            if ( translate )
+                correlative_score_batch(&(*state.cells_x)[orientation * nb_beams], &(*state.cells_y)[orientation * nb_beams], nb_positions, positions_x, positions_y,
+                                        threshold(state), scores, nb_evaluated);
+            else
+            {
+                fill(o, o + nb_positions, window.min_orientation + orientation * window.angle_step);
+                hit_score_batch(nb_positions, x, y, o, threshold(state), scores, nb_evaluated);
+            }
+
+            // the order of the positions does not change the result: ties are broken as in the order of the window
+            for (int loop_position = 0; loop_position < nb_positions; loop_position++)
+            {
+                state.best.nb_scored++;
+                state.best.nb_beams_scored += nb_evaluated[loop_position];
+                consider(state, scores[loop_position], positions_x[loop_position], positions_y[loop_position], orientation);
+            }
+        }
+    }
+
+}
+
+search_result scan_matcher::branch_and_bound_search(const search_window& window) const
+{
+
+    const chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+
+    // the positions of the window must be aligned with the cells of the map
+    if ( ( map.nb_levels() < 2 ) || ( fabs(window.step - map.cell_size) > 1e-4 * map.cell_size ) )
+        return (exhaustive_search(window));
+
+    vector<int> cells_x, cells_y;
+    rotate_scan(window, cells_x, cells_y);
+
+    int nb_workers = max(1, nb_threads);
+    vector<search_state> states(nb_workers);
+    atomic<float> shared_score(-1);
+    for (int loop = 0; loop < nb_workers; loop++)
+        start(states[loop], window, cells_x, cells_y, &shared_score, begin);
+
+    // the coarsest level is the first one whose blocks cover the window, or the last level of the pyramid
+    int depth = 1;
+    while ( ( depth < map.nb_levels() - 1 ) && ( ( ( 1 << depth ) < window.nb_x ) || ( ( 1 << depth ) < window.nb_y ) ) )
+        depth++;
+
+    vector<search_node> roots;
+    for (int loop_orientation = 0; loop_orientation < window.nb_orientations; loop_orientation++)
+        for (int loop_x = 0; loop_x < window.nb_x; loop_x += 1 << depth)
+            for (int loop_y = 0; loop_y < window.nb_y; loop_y += 1 << depth)
+            {
+                search_node root;
+                root.x = loop_x;
+                root.y = loop_y;
+                root.orientation = loop_orientation;
+                root.level = depth;
+                root.bound = upper_bound(states[0], depth, loop_x, loop_y, loop_orientation);
+                root.distance = center_distance(window, depth, loop_x, loop_y, loop_orientation);
+                roots.push_back(root);
+            }
+
+    // the most promising blocks are explored first, so that the best score increases quickly
+    // and more blocks are pruned; among equal bounds, the blocks around the predicted position come first
+    stable_sort(roots.begin(), roots.end(), more_promising);
+
+    // the roots are dealt to the threads in turn, so that each thread starts with a promising block
+    // each thread keeps its own best position, and a block is only pruned by another thread
+    // if its bound is strictly lower than the best score of that thread: the merged result is the same as with a single thread
+    run_workers(nb_workers, [this, &roots, &states, nb_workers](int worker)
+    {
+        if ( states[worker].timed )
+            explore_best_first(states[worker], roots, worker, nb_workers);
+        else
+            for (size_t loop_root = worker; loop_root < roots.size(); loop_root += nb_workers)
+                explore(states[worker], roots[loop_root]);
+    });
+
+    return ( ranges ? rerank(states) : merge(states) );
+}
+
+float scan_matcher::upper_bound(const search_state& state, int level, int x, int y, int orientation) const
+{
+    // the score of a position is the sum of the scores of its hits
+    // the score of each hit is bounded by the best cell of the block it can reach
+
+    const int* cells_x = &(*state.cells_x)[orientation * nb_beams];
+    const int* cells_y = &(*state.cells_y)[orientation * nb_beams];
+
+    float bound = 0;
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        if ( likelihood )
+            bound += level_likelihood(level, cells_x[loop] + x, cells_y[loop] + y);
+        else if ( level_hit(level, cells_x[loop] + x, cells_y[loop] + y) )
+            bound++;
+    }
+
+    return (bound);
+}
+
+float scan_matcher::center_distance(const search_window& window, int level, int x, int y, int orientation) const
+{
+    // the window is centered on the predicted position
+
+    const int size = 1 << level;
+    float dx = x + 0.5 * ( min(size, window.nb_x - x) - 1 ) - 0.5 * ( window.nb_x - 1 );
+    float dy = y + 0.5 * ( min(size, window.nb_y - y) - 1 ) - 0.5 * ( window.nb_y - 1 );
+    float dorientation = orientation - 0.5 * ( window.nb_orientations - 1 );
+    return (dx * dx + dy * dy + dorientation * dorientation);
+}
+
+bool scan_matcher::more_promising(const search_node& a, const search_node& b)
+{
+
+    if ( a.bound != b.bound )
+        return (a.bound > b.bound);
+    return (a.distance < b.distance);
+}
+
+bool scan_matcher::better(const search_state& state, float score, int x, int y, int orientation) const
+{
+    // exhaustive_search returns the first best position in the order (x, y, orientation)
+    // so for the same score, the position that comes first wins
+
+    if ( score != state.best.score )
+        return (score > state.best.score);
+    if ( x != state.best_x )
+        return (x < state.best_x);
+    if ( y != state.best_y )
+        return (y < state.best_y);
+    return (orientation < state.best_orientation);
+}
+
+void scan_matcher::keep_best(search_state& state, float score, int x, int y, int orientation) const
+{
+
+    const search_window& window = *state.window;
+
+    state.best.found = true;
+    state.best.score = score;
+    state.best.x = window.min_x + x * window.step;
+    state.best.y = window.min_y + y * window.step;
+    state.best.orientation = window.min_orientation + orientation * window.angle_step;
+    state.best_x = x;
+    state.best_y = y;
+    state.best_orientation = orientation;
+
+    // with the ranges, the threads share the threshold of their candidates instead
+    if ( state.shared_score && !ranges )
+    {
+        float shared = state.shared_score->load();
+        while ( ( shared < score ) && !state.shared_score->compare_exchange_weak(shared, score) );
+    }
+
+}
+
+void scan_matcher::consider(search_state& state, float score, int x, int y, int orientation) const
+{
+
+    if ( !state.best.found || better(state, score, x, y, orientation) )
+        keep_best(state, score, x, y, orientation);
+    if ( !ranges )
+        return;
+
+    // the worst candidate is replaced by a position ranked before it
+    vector<search_candidate>& candidates = state.candidates;
+    search_candidate candidate = { score, x, y, orientation };
+    if ( candidates.size() == rerank_candidates )
+    {
+        if ( !ranked_before(candidate, candidates.front()) )
+            return;
+        pop_heap(candidates.begin(), candidates.end(), ranked_before);
+        candidates.pop_back();
+    }
+    candidates.push_back(candidate);
+    push_heap(candidates.begin(), candidates.end(), ranked_before);
+
+    // a position below the worst candidate of a thread cannot be among the candidates of all the threads
+    float worst = candidate_threshold(state);
+    if ( state.shared_score && ( worst != no_threshold ) )
+    {
+        float shared = state.shared_score->load();
+        while ( ( shared < worst ) && !state.shared_score->compare_exchange_weak(shared, worst) );
+    }
+
+}
+
+bool scan_matcher::ranked_before(const search_candidate& a, const search_candidate& b)
+{
+
+    if ( a.score != b.score )
+        return (a.score > b.score);
+    if ( a.x != b.x )
+        return (a.x < b.x);
+    if ( a.y != b.y )
+        return (a.y < b.y);
+    return (a.orientation < b.orientation);
+}
+
+float scan_matcher::candidate_threshold(const search_state& state) const
+{
+
+    if ( state.candidates.size() < rerank_candidates )
+        return (no_threshold);
+    return (state.candidates.front().score);
+}
+
+search_result scan_matcher::merge(const vector<search_state>& states) const
+{
+    // best position over all the threads, with the same order as a single thread
+
+    const search_state* best = &states[0];
+    int nb_scored = states[0].best.nb_scored;
+    long nb_beams_scored = states[0].best.nb_beams_scored;
+    long nb_covered = states[0].nb_covered;
+    bool complete = !states[0].expired;
+    for (size_t loop = 1; loop < states.size(); loop++)
+    {
+        const search_state& state = states[loop];
+        if ( state.best.found && ( !best->best.found || better(*best, state.best.score, state.best_x, state.best_y, state.best_orientation) ) )
+            best = &state;
+        nb_scored += state.best.nb_scored;
+        nb_beams_scored += state.best.nb_beams_scored;
+        nb_covered += state.nb_covered;
+        complete = complete && !state.expired;
+    }
+
+    const search_window& window = *states[0].window;
+    long nb_positions = long(window.nb_x) * window.nb_y * window.nb_orientations;
+    search_result result = best->best;
+    result.nb_scored = nb_scored;
+    result.nb_beams_scored = nb_beams_scored;
+    result.complete = complete;
+    result.coverage = nb_positions ? float(nb_covered) / nb_positions : 1;
+    return (result);
+}
+
+search_result scan_matcher::rerank(const vector<search_state>& states) const
+{
+    // the best candidates of the hits over all the threads, in the order of a single thread, scored with the ranges:
+    // the first one with the highest score wins
+
+    vector<search_candidate> candidates;
+    for (const search_state& state : states)
+        candidates.insert(candidates.end(), state.candidates.begin(), state.candidates.end());
+    sort(candidates.begin(), candidates.end(), ranked_before);
+    if ( candidates.size() > rerank_candidates )
+        candidates.resize(rerank_candidates);
+
+    const search_window& window = *states[0].window;
+    search_result result = merge(states);
+    result.found = false;
+    for (const search_candidate& candidate : candidates)
+    {
+        float x = window.min_x + candidate.x * window.step;
+        float y = window.min_y + candidate.y * window.step;
+        float orientation = window.min_orientation + candidate.orientation * window.angle_step;
+        int nb_evaluated;
+        float score = range_score(x, y, orientation, no_threshold, nb_evaluated);
+        result.nb_scored++;
+        result.nb_beams_scored += nb_evaluated;
+        if ( !result.found || ( score > result.score ) )
+        {
+            result.found = true;
+            result.score = score;
+            result.x = x;
+            result.y = y;
+            result.orientation = orientation;
+        }
+    }
+
+    return (result);
+}
+
+void scan_matcher::score_leaves(search_state& state, const search_node* leaves, int nb_leaves) const
+{
+
+    const search_window& window = *state.window;
+    const int orientation = leaves[0].orientation;
+    state.nb_covered += nb_leaves;
+
+    // the robot can only be in a free cell
+    int positions_x[4], positions_y[4];
+    float x[4], y[4], o[4];
+    int nb_positions = 0;
+    for (int loop = 0; loop < nb_leaves; loop++)
+    {
+        x[nb_positions] = window.min_x + leaves[loop].x * window.step;
+        y[nb_positions] = window.min_y + leaves[loop].y * window.step;
+        o[nb_positions] = window.min_orientation + orientation * window.angle_step;
+        if ( cell_value(x[nb_positions], y[nb_positions]) )
+            continue;
+        positions_x[nb_positions] = leaves[loop].x;
+        positions_y[nb_positions] = leaves[loop].y;
+        nb_positions++;
+    }
+    if ( !nb_positions )
+        return;
+
+    float scores[4];
+    int nb_evaluated[4];
+    if ( correlative )
+        correlative_score_batch(&(*state.cells_x)[orientation * nb_beams], &(*state.cells_y)[orientation * nb_beams], nb_positions, positions_x, positions_y,
+                                threshold(state), scores, nb_evaluated);
+    else
+        hit_score_batch(nb_positions, x, y, o, threshold(state), scores, nb_evaluated);
+
+    for (int loop = 0; loop < nb_positions; loop++)
+    {
+        state.best.nb_scored++;
+        state.best.nb_beams_scored += nb_evaluated[loop];
+        consider(state, scores[loop], positions_x[loop], positions_y[loop], orientation);
+    }
+
+}
+
+bool scan_matcher::pruned(search_state& state, const search_node& node) const
+{
+    // the first position of the block comes before all the others, so if it cannot win, none of them can
+    // with the ranges, a block is pruned if its bound cannot enter the candidates
+
+    bool beaten = ranges ? ( node.bound < candidate_threshold(state) ) : ( state.best.found && !better(state, node.bound, node.x, node.y, node.orientation) );
+    if ( beaten || ( node.bound < state.shared_score->load(memory_order_relaxed) ) )
+    {
+        const int size = 1 << node.level;
+        state.nb_covered += long(min(size, state.window->nb_x - node.x)) * min(size, state.window->nb_y - node.y);
+        return (true);
+    }
+    return (false);
+
+}
+
+int scan_matcher::split(const search_state& state, const search_node& node, search_node children[4]) const
+{
+
+    const search_window& window = *state.window;
+    const int half = 1 << ( node.level - 1 );
+    int nb_children = 0;
+    for (int loop_x = node.x; ( loop_x < node.x + 2 * half ) && ( loop_x < window.nb_x ); loop_x += half)
+        for (int loop_y = node.y; ( loop_y < node.y + 2 * half ) && ( loop_y < window.nb_y ); loop_y += half)
+        {
+            search_node& child = children[nb_children++];
+            child.x = loop_x;
+            child.y = loop_y;
+            child.orientation = node.orientation;
+            child.level = node.level - 1;
+            child.bound = ( child.level > 0 ) ? upper_bound(state, child.level, loop_x, loop_y, node.orientation) : 0;
+            child.distance = center_distance(window, child.level, loop_x, loop_y, node.orientation);
+        }
+
+    // the positions are scored in the order of the window, the blocks are explored from the most promising one
+    if ( node.level > 1 )
+        stable_sort(children, children + nb_children, more_promising);
+
+    return (nb_children);
+
+}
+
+void scan_matcher::explore(search_state& state, const search_node& node) const
+{
+
+    // anytime search: the blocks left when the deadline expires are neither scored nor covered
+    if ( state.best.found && out_of_time(state) )
+        return;
+
+    if ( pruned(state, node) )
+        return;
+
+    // the positions of a block of level 1 are scored together
+    search_node children[4];
+    int nb_children = split(state, node, children);
+    if ( node.level == 1 )
+        score_leaves(state, children, nb_children);
+    else
+        for (int loop = 0; loop < nb_children; loop++)
+            explore(state, children[loop]);
+
+}
+
+void scan_matcher::explore_best_first(search_state& state, const vector<search_node>& roots, int first, int step) const
+{
+    // anytime search: a greedy dive into the most promising root gives a position at once,
+    // then the blocks of all the roots are refined in the order of their bounds, coarse to fine,
+    // so that the position found when the time is over comes from the most promising blocks of the whole window
+    // among equal bounds, the blocks closest to the predicted position are refined first
+    // without deadline, the result is the same as explore
+
+    auto lower = [](const search_node& a, const search_node& b) { return more_promising(b, a); };
+    priority_queue<search_node, vector<search_node>, decltype(lower)> queue(lower);
+    for (size_t loop = first; loop < roots.size(); loop += step)
+        queue.push(roots[loop]);
+    if ( queue.empty() )
+        return;
+
+    // the blocks beside the path of the dive are left to the queue: each position is scored or pruned once
+    search_node children[4];
+    search_node node = queue.top();
+    queue.pop();
+    int nb_children = split(state, node, children);
+    while ( node.level > 1 )
+    {
+        for (int loop = 1; loop < nb_children; loop++)
+            queue.push(children[loop]);
+        node = children[0];
+        nb_children = split(state, node, children);
+    }
+    score_leaves(state, children, nb_children);
+
+    while ( !queue.empty() )
+    {
+        node = queue.top();
+        queue.pop();
+        if ( pruned(state, node) )
+            continue;
+        if ( state.best.found && out_of_time(state) )
+            break;
+
+        nb_children = split(state, node, children);
+        if ( node.level == 1 )
+            score_leaves(state, children, nb_children);
+        else
+            for (int loop = 0; loop < nb_children; loop++)
+                queue.push(children[loop]);
+    }
+
+}
@@ -0,0 +1,417 @@
+// vectorized kernels of the scan matcher, 8 beams at a time with AVX2
+// the functions are compiled for AVX2 with a target attribute and only called when the processor supports it
+#include <scan_matcher.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_AVX2 __attribute__((target("avx2")))
+#endif
+
+bool scan_matcher::simd_supported()
+{
+
+#ifdef SIMD_AVX2
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return (supported);
+#else
+    return (false);
+#endif
+
+}
+
+#ifdef SIMD_AVX2
+
+// score of 8 hits whose cells are (x_int, y_int), for the lanes of valid
+// the cells in a block changed by the layer (if any) are scored by the layer, one bit per block tells which
+SIMD_AVX2 static inline void score_cells(const localization_map& map, const overlay_layer* layer, bool likelihood, __m256i x_int, __m256i y_int, __m256i valid, __m256& sum, int& count)
+{
+
+    valid = _mm256_and_si256(valid, _mm256_cmpgt_epi32(_mm256_set1_epi32(map.width_max), x_int));
+    valid = _mm256_and_si256(valid, _mm256_cmpgt_epi32(_mm256_set1_epi32(map.height_max), y_int));
+    valid = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), x_int), valid);
+    valid = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), y_int), valid);
+
+    if ( layer )
+    {
+        __m256i block = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y_int, overlay_block_bits), _mm256_set1_epi32(layer->blocks_per_row())), _mm256_srli_epi32(x_int, overlay_block_bits));
+        __m256i words = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)layer->changed_blocks(), _mm256_srli_epi32(block, 5), valid, 4);
+        __m256i changed = _mm256_and_si256(_mm256_slli_epi32(_mm256_srlv_epi32(words, _mm256_and_si256(block, _mm256_set1_epi32(31))), 31), valid);
+        int lanes = _mm256_movemask_ps(_mm256_castsi256_ps(changed));
+        if ( lanes )
+        {
+            valid = _mm256_andnot_si256(_mm256_srai_epi32(changed, 31), valid);
+            int cells_x[8], cells_y[8];
+            _mm256_storeu_si256((__m256i*)cells_x, x_int);
+            _mm256_storeu_si256((__m256i*)cells_y, y_int);
+            float changed_sum = 0;
+            for (int loop = 0; loop < 8; loop++)
+                if ( ( lanes >> loop ) & 1 )
+                {
+                    if ( likelihood )
+                        changed_sum += layer->cell_likelihood(cells_x[loop], cells_y[loop]);
+                    else
+                        count += layer->cell_hit(cells_x[loop], cells_y[loop]);
+                }
+            if ( likelihood )
+                sum = _mm256_add_ps(sum, _mm256_setr_ps(changed_sum, 0, 0, 0, 0, 0, 0, 0));
+        }
+    }
+
+    if ( likelihood )
+    {
+        // the distance of each cell is the low byte of a 32 bit gather
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y_int, _mm256_set1_epi32(map.width_max)), x_int);
+        __m256i distance = _mm256_mask_i32gather_epi32(_mm256_set1_epi32(distance_saturation), (const int*)map.distance_field(), index, valid, 1);
+        distance = _mm256_and_si256(distance, _mm256_set1_epi32(0xff));
+        __m256 values = _mm256_mask_i32gather_ps(_mm256_setzero_ps(), map.likelihood_values(), distance, _mm256_castsi256_ps(valid), 4);
+        sum = _mm256_add_ps(sum, values);
+    }
+    else
+    {
+        // the bit of each cell is gathered with the 32 bit word that contains it
+        const bit_grid& hits = map.hit_grid();
+        __m256i index;
+        if ( hits.tiled )
+        {
+            const __m256i mask = _mm256_set1_epi32(( 1 << tile_bits ) - 1);
+            __m256i tile = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srli_epi32(y_int, tile_bits), _mm256_set1_epi32(hits.nb_tiles_x)), _mm256_srli_epi32(x_int, tile_bits));
+            index = _mm256_or_si256(_mm256_slli_epi32(tile, 2 * tile_bits), _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(y_int, mask), tile_bits), _mm256_and_si256(x_int, mask)));
+        }
+        else
+            index = _mm256_add_epi32(_mm256_mullo_epi32(y_int, _mm256_set1_epi32(hits.width)), x_int);
+        __m256i words = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(), (const int*)hits.bits, _mm256_srli_epi32(index, 5), valid, 4);
+        __m256i bits = _mm256_srlv_epi32(words, _mm256_and_si256(index, _mm256_set1_epi32(31)));
+        bits = _mm256_slli_epi32(bits, 31);
+        count += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(bits, valid))));
+    }
+
+}
+
+SIMD_AVX2 static inline float horizontal_sum(__m256 sum)
+{
+
+    __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1));
+    half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+    half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+    return (_mm_cvtss_f32(half));
+
+}
+
+SIMD_AVX2 float scan_matcher::vectorized_score(float x, float y, float o, float threshold, int& nb_evaluated) const
+{
+
+    const __m256 cos_o = _mm256_set1_ps(cos(o));
+    const __m256 sin_o = _mm256_set1_ps(sin(o));
+    const __m256 position_x = _mm256_set1_ps(x);
+    const __m256 position_y = _mm256_set1_ps(y);
+    const __m256 min_x = _mm256_set1_ps(map.min_x);
+    const __m256 min_y = _mm256_set1_ps(map.min_y);
+    const __m256 cell_size = _mm256_set1_ps(map.cell_size);
+
+    __m256 sum = _mm256_setzero_ps();
+    int count = 0;
+    int loop = 0;
+    for (; loop + 8 <= nb_beams; loop += 8)
+    {
+        // each beam left scores at most 1
+        if ( ( loop % bound_check_beams == 0 ) && ( threshold > nb_beams - loop ) )
+        {
+            float score_current = likelihood ? horizontal_sum(sum) : count;
+            if ( score_current + ( nb_beams - loop ) + bound_margin < threshold )
+            {
+                nb_evaluated = loop;
+                return (score_current);
+            }
+        }
+
+        __m256 range = _mm256_loadu_ps(&r[loop]);
+        __m256 c = _mm256_loadu_ps(&beam_cos[loop]);
+        __m256 s = _mm256_loadu_ps(&beam_sin[loop]);
+
+        // cos(o + theta) and sin(o + theta)
+        __m256 cos_beam = _mm256_sub_ps(_mm256_mul_ps(cos_o, c), _mm256_mul_ps(sin_o, s));
+        __m256 sin_beam = _mm256_add_ps(_mm256_mul_ps(sin_o, c), _mm256_mul_ps(cos_o, s));
+
+        __m256 hit_x = _mm256_add_ps(position_x, _mm256_mul_ps(range, cos_beam));
+        __m256 hit_y = _mm256_add_ps(position_y, _mm256_mul_ps(range, sin_beam));
+
+        __m256 cell_x = _mm256_div_ps(_mm256_sub_ps(hit_x, min_x), cell_size);
+        __m256 cell_y = _mm256_div_ps(_mm256_sub_ps(hit_y, min_y), cell_size);
+
+        // the hits before the origin of the map are outside, even if they truncate to cell 0
+        __m256 valid = _mm256_and_ps(_mm256_cmp_ps(cell_x, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(cell_y, _mm256_setzero_ps(), _CMP_GE_OQ));
+
+        score_cells(map, layer, likelihood, _mm256_cvttps_epi32(cell_x), _mm256_cvttps_epi32(cell_y), _mm256_castps_si256(valid), sum, count);
+    }
+
+    float score_current = likelihood ? horizontal_sum(sum) : count;
+
+    // last beams
+    for (; loop < nb_beams; loop++)
+    {
+        float cos_beam = cos(o) * beam_cos[loop] - sin(o) * beam_sin[loop];
+        float sin_beam = sin(o) * beam_cos[loop] + cos(o) * beam_sin[loop];
+
+        int x_int, y_int;
+        if ( map.cell_index(x + r[loop] * cos_beam, y + r[loop] * sin_beam, x_int, y_int) )
+        {
+            if ( likelihood )
+                score_current += cell_likelihood(x_int, y_int);
+            else if ( cell_hit(x_int, y_int) )
+                score_current++;
+        }
+    }
+
+    nb_evaluated = nb_beams;
+    return (score_current);
+
+}
+
+SIMD_AVX2 float scan_matcher::vectorized_correlative_score(const int* cells_x, const int* cells_y, int x, int y, float threshold, int& nb_evaluated) const
+{
+
+    const __m256i offset_x = _mm256_set1_epi32(x);
+    const __m256i offset_y = _mm256_set1_epi32(y);
+    const __m256i all = _mm256_set1_epi32(-1);
+
+    __m256 sum = _mm256_setzero_ps();
+    int count = 0;
+    int loop = 0;
+    for (; loop + 8 <= nb_beams; loop += 8)
+    {
+        if ( ( loop % bound_check_beams == 0 ) && ( threshold > nb_beams - loop ) )
+        {
+            float score_current = likelihood ? horizontal_sum(sum) : count;
+            if ( score_current + ( nb_beams - loop ) + bound_margin < threshold )
+            {
+                nb_evaluated = loop;
+                return (score_current);
+            }
+        }
+
+        __m256i x_int = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&cells_x[loop]), offset_x);
+        __m256i y_int = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)&cells_y[loop]), offset_y);
+        score_cells(map, layer, likelihood, x_int, y_int, all, sum, count);
+    }
+
+    float score_current = likelihood ? horizontal_sum(sum) : count;
+
+    // last beams
+    for (; loop < nb_beams; loop++)
+    {
+        int x_int = cells_x[loop] + x;
+        int y_int = cells_y[loop] + y;
+        if ( ( unsigned(x_int) < unsigned(map.width_max) ) && ( unsigned(y_int) < unsigned(map.height_max) ) )
+        {
+            if ( likelihood )
+                score_current += cell_likelihood(x_int, y_int);
+            else if ( cell_hit(x_int, y_int) )
+                score_current++;
+        }
+    }
+
+    nb_evaluated = nb_beams;
+    return (score_current);
+
+}
+
+SIMD_AVX2 void scan_matcher::vectorized_score_batch(int nb_positions, const float* x, const float* y, const float* o, float threshold, float* scores, int* nb_evaluated) const
+{
+
+    const __m256 min_x = _mm256_set1_ps(map.min_x);
+    const __m256 min_y = _mm256_set1_ps(map.min_y);
+    const __m256 cell_size = _mm256_set1_ps(map.cell_size);
+
+    __m256 sums[score_batch_size];
+    int counts[score_batch_size];
+    float cos_o[score_batch_size], sin_o[score_batch_size];
+    int active[score_batch_size];
+    int nb_active = 0;
+    for (int loop = 0; loop < nb_positions; loop++)
+    {
+        sums[loop] = _mm256_setzero_ps();
+        counts[loop] = 0;
+        cos_o[loop] = cos(o[loop]);
+        sin_o[loop] = sin(o[loop]);
+        nb_evaluated[loop] = nb_beams;
+        active[nb_active++] = loop;
+    }
+
+    // 8 beams for all the positions, then the next 8 beams
+    const int nb_vectorized = nb_beams & ~7;
+    int loop = 0;
+    for (; ( loop < nb_vectorized ) && nb_active; loop += 8)
+    {
+        // each beam left scores at most 1
+        if ( ( loop % bound_check_beams == 0 ) && ( threshold > nb_beams - loop ) )
+        {
+            int nb_kept = 0;
+            for (int loop_position = 0; loop_position < nb_active; loop_position++)
+            {
+                const int position = active[loop_position];
+                float score_current = likelihood ? horizontal_sum(sums[position]) : counts[position];
+                if ( score_current + ( nb_beams - loop ) + bound_margin < threshold )
+                {
+                    nb_evaluated[position] = loop;
+                    scores[position] = score_current;
+                }
+                else
+                    active[nb_kept++] = position;
+            }
+            nb_active = nb_kept;
+        }
+
+        __m256 range = _mm256_loadu_ps(&r[loop]);
+        __m256 c = _mm256_loadu_ps(&beam_cos[loop]);
+        __m256 s = _mm256_loadu_ps(&beam_sin[loop]);
+
+        for (int loop_position = 0; loop_position < nb_active; loop_position++)
+        {
+            const int position = active[loop_position];
+            const __m256 cos_position = _mm256_set1_ps(cos_o[position]);
+            const __m256 sin_position = _mm256_set1_ps(sin_o[position]);
+
+            __m256 cos_beam = _mm256_sub_ps(_mm256_mul_ps(cos_position, c), _mm256_mul_ps(sin_position, s));
+            __m256 sin_beam = _mm256_add_ps(_mm256_mul_ps(sin_position, c), _mm256_mul_ps(cos_position, s));
+
+            __m256 hit_x = _mm256_add_ps(_mm256_set1_ps(x[position]), _mm256_mul_ps(range, cos_beam));
+            __m256 hit_y = _mm256_add_ps(_mm256_set1_ps(y[position]), _mm256_mul_ps(range, sin_beam));
+
+            __m256 cell_x = _mm256_div_ps(_mm256_sub_ps(hit_x, min_x), cell_size);
+            __m256 cell_y = _mm256_div_ps(_mm256_sub_ps(hit_y, min_y), cell_size);
+
+            __m256 valid = _mm256_and_ps(_mm256_cmp_ps(cell_x, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(cell_y, _mm256_setzero_ps(), _CMP_GE_OQ));
+
+            score_cells(map, layer, likelihood, _mm256_cvttps_epi32(cell_x), _mm256_cvttps_epi32(cell_y), _mm256_castps_si256(valid), sums[position], counts[position]);
+        }
+    }
+
+    // last beams
+    for (int loop_position = 0; loop_position < nb_active; loop_position++)
+    {
+        const int position = active[loop_position];
+        float score_current = likelihood ? horizontal_sum(sums[position]) : counts[position];
+        for (int loop_beam = loop; loop_beam < nb_beams; loop_beam++)
+        {
+            float cos_beam = cos_o[position] * beam_cos[loop_beam] - sin_o[position] * beam_sin[loop_beam];
+            float sin_beam = sin_o[position] * beam_cos[loop_beam] + cos_o[position] * beam_sin[loop_beam];
+
+            int x_int, y_int;
+            if ( map.cell_index(x[position] + r[loop_beam] * cos_beam, y[position] + r[loop_beam] * sin_beam, x_int, y_int) )
+            {
+                if ( likelihood )
+                    score_current += cell_likelihood(x_int, y_int);
+                else if ( cell_hit(x_int, y_int) )
+                    score_current++;
+            }
+        }
+        scores[position] = score_current;
+    }
+
+}
+
+SIMD_AVX2 void scan_matcher::vectorized_correlative_score_batch(const int* cells_x, const int* cells_y, int nb_positions, const int* x, const int* y, float threshold,
+                                                                float* scores, int* nb_evaluated) const
+{
+
+    const __m256i all = _mm256_set1_epi32(-1);
+
+    __m256 sums[score_batch_size];
+    int counts[score_batch_size];
+    int active[score_batch_size];
+    int nb_active = 0;
+    for (int loop = 0; loop < nb_positions; loop++)
+    {
+        sums[loop] = _mm256_setzero_ps();
+        counts[loop] = 0;
+        nb_evaluated[loop] = nb_beams;
+        active[nb_active++] = loop;
+    }
+
+    const int nb_vectorized = nb_beams & ~7;
+    int loop = 0;
+    for (; ( loop < nb_vectorized ) && nb_active; loop += 8)
+    {
+        if ( ( loop % bound_check_beams == 0 ) && ( threshold > nb_beams - loop ) )
+        {
+            int nb_kept = 0;
+            for (int loop_position = 0; loop_position < nb_active; loop_position++)
+            {
+                const int position = active[loop_position];
+                float score_current = likelihood ? horizontal_sum(sums[position]) : counts[position];
+                if ( score_current + ( nb_beams - loop ) + bound_margin < threshold )
+                {
+                    nb_evaluated[position] = loop;
+                    scores[position] = score_current;
+                }
+                else
+                    active[nb_kept++] = position;
+            }
+            nb_active = nb_kept;
+        }
+
+        const __m256i beam_x = _mm256_loadu_si256((const __m256i*)&cells_x[loop]);
+        const __m256i beam_y = _mm256_loadu_si256((const __m256i*)&cells_y[loop]);
+        for (int loop_position = 0; loop_position < nb_active; loop_position++)
+        {
+            const int position = active[loop_position];
+            __m256i x_int = _mm256_add_epi32(beam_x, _mm256_set1_epi32(x[position]));
+            __m256i y_int = _mm256_add_epi32(beam_y, _mm256_set1_epi32(y[position]));
+            score_cells(map, layer, likelihood, x_int, y_int, all, sums[position], counts[position]);
+        }
+    }
+
+    // last beams
+    for (int loop_position = 0; loop_position < nb_active; loop_position++)
+    {
+        const int position = active[loop_position];
+        float score_current = likelihood ? horizontal_sum(sums[position]) : counts[position];
+        for (int loop_beam = loop; loop_beam < nb_beams; loop_beam++)
+        {
+            int x_int = cells_x[loop_beam] + x[position];
+            int y_int = cells_y[loop_beam] + y[position];
+            if ( ( unsigned(x_int) < unsigned(map.width_max) ) && ( unsigned(y_int) < unsigned(map.height_max) ) )
+            {
+                if ( likelihood )
+                    score_current += cell_likelihood(x_int, y_int);
+                else if ( cell_hit(x_int, y_int) )
+                    score_current++;
+            }
+        }
+        scores[position] = score_current;
+    }
+
+}
+
+#else
+
+float scan_matcher::vectorized_score(float x, float y, float o, float threshold, int& nb_evaluated) const
+{
+
+    return (scalar_score(x, y, o, threshold, nb_evaluated));
+
+}
+
+float scan_matcher::vectorized_correlative_score(const int* cells_x, const int* cells_y, int x, int y, float threshold, int& nb_evaluated) const
+{
+
+    return (scalar_correlative_score(cells_x, cells_y, x, y, threshold, nb_evaluated));
+
+}
+
+void scan_matcher::vectorized_score_batch(int nb_positions, const float* x, const float* y, const float* o, float threshold, float* scores, int* nb_evaluated) const
+{
+
+    scalar_score_batch(nb_positions, x, y, o, threshold, scores, nb_evaluated);
+
+}
+
+void scan_matcher::vectorized_correlative_score_batch(const int* cells_x, const int* cells_y, int nb_positions, const int* x, const int* y, float threshold,
+                                                      float* scores, int* nb_evaluated) const
+{
+
+    scalar_correlative_score_batch(cells_x, cells_y, nb_positions, x, y, threshold, scores, nb_evaluated);
+
+}
+
+#endif
@@ -0,0 +1,327 @@
+// test of the vectorized kernels of the scan matcher against the scalar ones, without ROS
+// usage: scan_matcher_test
+// the numbers of hits must be the same, the sums of likelihoods the same up to the order of their additions
+// the scores with the ranges of the free space term must also score the beams with an echo as the scalar kernel,
+// and the searches with the ranges must rerank the same candidates with the branch and bound as with the exhaustive search
+// the scores with the changes of an overlay must be the same with the layer of the overlay as with a map rebuilt with the changes,
+// and the bounds of the pyramid must stay above them
+// returns 0 if all the scores agree (the vectorized kernels are only tested if the processor supports them)
+#include <scan_matcher.h>
+#include <cstdio>
+#include <cstdlib>
+
+#define test_poses 2000 // positions scored by each kernel
+#define test_beams 723 // beams of the scans: not a multiple of 8, so that the last beams of the vectorized kernels are tested too
+#define likelihood_tolerance 1e-3 // relative difference allowed between two sums of likelihoods
+#define test_scans 100 // scans of the map with furniture moved integrated by the overlay
+#define test_searches 20 // searches with the ranges, exhaustive and by branch and bound
+
+static float random_float(float min, float max)
+{
+
+    return (min + ( max - min ) * ( rand() / float(RAND_MAX) ));
+
+}
+
+// rooms of 4 x 4 meters with furniture, and unknown cells around them
+static void test_map(localization_map& map, bool likelihood, vector<int8_t>& occupancy)
+{
+
+    const int width = 400, height = 300;
+    occupancy.assign(width * height, -1);
+    srand(1);
+    for (int loop_y = 20; loop_y < height - 20; loop_y++)
+        for (int loop_x = 20; loop_x < width - 20; loop_x++)
+        {
+            int x = loop_x - 20, y = loop_y - 20;
+            bool wall = ( x % 80 == 0 ) || ( y % 80 == 0 ) || ( loop_x == width - 21 ) || ( loop_y == height - 21 );
+            bool door = ( abs(x % 80 - 40) < 8 ) || ( abs(y % 80 - 40) < 8 );
+            occupancy[width * loop_y + loop_x] = ( wall && !door ) ? 100 : 0;
+        }
+    for (int loop = 0; loop < 300; loop++)
+    {
+        int x = 20 + rand() % ( width - 60 ), y = 20 + rand() % ( height - 60 );
+        int size_x = 2 + rand() % 8, size_y = 2 + rand() % 8;
+        for (int loop_y = y; loop_y < y + size_y; loop_y++)
+            for (int loop_x = x; loop_x < x + size_x; loop_x++)
+                occupancy[width * loop_y + loop_x] = 100;
+    }
+
+    map.load(width, height, 0.05, -10, -7.5, &occupancy[0], 0.05, likelihood);
+
+}
+
+// both scores must be equal, or nearly equal for sums of likelihoods
+static bool same_score(bool likelihood, float scalar, float vectorized)
+{
+
+    if ( !likelihood )
+        return (scalar == vectorized);
+    return (fabs(scalar - vectorized) <= likelihood_tolerance * max(1.0f, fabs(scalar)));
+
+}
+
+// with the changes of layer if it is not 0
+static bool test_kernels(const localization_map& map, bool likelihood, const overlay_layer* layer)
+{
+
+    scan_matcher scalar(map, likelihood, false), vectorized(map, likelihood, false);
+    scalar.set_vectorized(false);
+    vectorized.set_vectorized(true);
+    scalar.set_overlay(layer);
+    vectorized.set_overlay(layer);
+
+    // beams over 270 degrees, some of them outside the map
+    vector<float> r(test_beams), theta(test_beams);
+    for (int loop = 0; loop < test_beams; loop++)
+    {
+        theta[loop] = -3 * M_PI / 4 + loop * ( 3 * M_PI / 2 ) / test_beams;
+        r[loop] = random_float(0.1, 12);
+    }
+    scalar.set_scan(test_beams, &r[0], &theta[0]);
+    vectorized.set_scan(test_beams, &r[0], &theta[0]);
+
+    int nb_failed = 0;
+    long nb_hits = 0;
+    for (int loop = 0; loop < test_poses; loop++)
+    {
+        float x = random_float(map.min_x, map.max_x), y = random_float(map.min_y, map.max_y), o = random_float(-M_PI, M_PI);
+        int scalar_evaluated, vectorized_evaluated;
+        float scalar_score = scalar.scalar_score(x, y, o, no_threshold, scalar_evaluated);
+        float vectorized_score = vectorized.vectorized_score(x, y, o, no_threshold, vectorized_evaluated);
+        nb_hits += scalar_score;
+        if ( !same_score(likelihood, scalar_score, vectorized_score) || ( scalar_evaluated != vectorized_evaluated ) )
+        {
+            if ( nb_failed++ < 10 )
+                printf("score (%f, %f, %f): scalar %f, vectorized %f\n", x, y, o, scalar_score, vectorized_score);
+        }
+    }
+
+    // the correlative scores of the cells of a window, translated by random offsets
+    search_window window = scan_matcher::make_window(-1, 1, -1, 1, -M_PI, M_PI, map.cell_size, M_PI / 18);
+    vector<int> cells_x, cells_y;
+    scalar.rotate_scan(window, cells_x, cells_y);
+    for (int loop = 0; loop < test_poses; loop++)
+    {
+        int orientation = rand() % window.nb_orientations;
+        int x = rand() % 200 - 100, y = rand() % 200 - 100;
+        const int* rotated_x = &cells_x[orientation * test_beams];
+        const int* rotated_y = &cells_y[orientation * test_beams];
+        int scalar_evaluated, vectorized_evaluated;
+        float scalar_score = scalar.scalar_correlative_score(rotated_x, rotated_y, x, y, no_threshold, scalar_evaluated);
+        float vectorized_score = vectorized.vectorized_correlative_score(rotated_x, rotated_y, x, y, no_threshold, vectorized_evaluated);
+        if ( !same_score(likelihood, scalar_score, vectorized_score) || ( scalar_evaluated != vectorized_evaluated ) )
+        {
+            if ( nb_failed++ < 10 )
+                printf("correlative score (%i, %i, %i): scalar %f, vectorized %f\n", x, y, orientation, scalar_score, vectorized_score);
+        }
+    }
+
+    printf("%s%s: %i scores out of %i differ (%.1f hits per position)\n", likelihood ? "likelihood" : "hits", layer ? " with the overlay" : "", nb_failed, 2 * test_poses,
+           likelihood ? 0.0 : double(nb_hits) / test_poses);
+    return (nb_failed == 0);
+
+}
+
+// with the free space term, the beams with an echo score their hits as scalar_score, the beams without echo at most 1
+static bool test_range_score(const localization_map& map, bool likelihood)
+{
+
+    range_table ranges;
+    ranges.build(map, 1);
+    scan_matcher scalar(map, likelihood, false), free_space(map, likelihood, false);
+    scalar.set_vectorized(false);
+    beam_mixture mixture = { 0.1, 0.7, 0.2, 0.1, 0.5, 12, true };
+    free_space.set_ranges(&ranges, mixture, false);
+
+    // the beams with an echo first, as the free space term adds the others after them
+    vector<float> r(test_beams), theta(test_beams);
+    bool echo[test_beams];
+    const int nb_echoes = 2 * test_beams / 3;
+    for (int loop = 0; loop < test_beams; loop++)
+    {
+        theta[loop] = -3 * M_PI / 4 + loop * ( 3 * M_PI / 2 ) / test_beams;
+        echo[loop] = loop < nb_echoes;
+        r[loop] = echo[loop] ? random_float(0.1, 12) : 12;
+    }
+    scalar.set_scan(nb_echoes, &r[0], &theta[0]);
+    free_space.set_scan(test_beams, &r[0], &theta[0], echo);
+
+    int nb_failed = 0;
+    for (int loop = 0; loop < test_poses; loop++)
+    {
+        float x = random_float(map.min_x, map.max_x), y = random_float(map.min_y, map.max_y), o = random_float(-M_PI, M_PI);
+        int scalar_evaluated, free_space_evaluated;
+        float hits = scalar.scalar_score(x, y, o, no_threshold, scalar_evaluated);
+        float score = free_space.range_score(x, y, o, no_threshold, free_space_evaluated);
+        const float tolerance = likelihood ? likelihood_tolerance * max(1.0f, score) : 0;
+        if ( ( score < hits - tolerance ) || ( score > hits + ( test_beams - nb_echoes ) + tolerance ) || ( free_space_evaluated != test_beams ) )
+        {
+            if ( nb_failed++ < 10 )
+                printf("free space score (%f, %f, %f): hits %f, with the free space %f\n", x, y, o, hits, score);
+        }
+    }
+
+    printf("%s with the free space: %i scores out of %i differ\n", likelihood ? "likelihood" : "hits", nb_failed, test_poses);
+    return (nb_failed == 0);
+
+}
+
+// with the ranges, the branch and bound search must find the same candidates of the hits as the exhaustive search, with any number of threads,
+// and return the one with the best score of the ranges
+static bool test_reranked_search(const localization_map& map, bool likelihood)
+{
+
+    range_table ranges;
+    ranges.build(map, 1);
+    beam_mixture mixture = { 0.1, 0.7, 0.2, 0.1, 0.5, 12, true };
+    vector<float> r(test_beams), theta(test_beams);
+    bool echo[test_beams];
+    for (int loop = 0; loop < test_beams; loop++)
+    {
+        theta[loop] = -3 * M_PI / 4 + loop * ( 3 * M_PI / 2 ) / test_beams;
+        echo[loop] = loop % 3 != 0;
+        r[loop] = echo[loop] ? random_float(0.1, 12) : 12;
+    }
+
+    int nb_failed = 0;
+    for (int loop = 0; loop < test_searches; loop++)
+    {
+        float x = random_float(map.min_x + 1, map.max_x - 1), y = random_float(map.min_y + 1, map.max_y - 1), o = random_float(-M_PI, M_PI);
+        search_window window = scan_matcher::make_window(x - 0.5, x + 0.5, y - 0.5, y + 0.5, o - M_PI / 18, o + M_PI / 18, map.cell_size, M_PI / 90);
+        search_result results[3];
+        for (int loop_search = 0; loop_search < 3; loop_search++)
+        {
+            scan_matcher matcher(map, likelihood, true);
+            matcher.set_nb_threads(( loop_search == 2 ) ? 3 : 1);
+            matcher.set_ranges(&ranges, mixture, loop % 2 == 0);
+            matcher.set_scan(test_beams, &r[0], &theta[0], echo);
+            results[loop_search] = ( loop_search == 0 ) ? matcher.exhaustive_search(window) : matcher.branch_and_bound_search(window);
+            int nb_evaluated;
+            float score = matcher.range_score(results[loop_search].x, results[loop_search].y, results[loop_search].orientation, no_threshold, nb_evaluated);
+            if ( !results[loop_search].found || ( score != results[loop_search].score ) )
+                nb_failed++;
+        }
+        for (int loop_search = 1; loop_search < 3; loop_search++)
+            if ( ( results[loop_search].x != results[0].x ) || ( results[loop_search].y != results[0].y ) ||
+                 ( results[loop_search].orientation != results[0].orientation ) || ( results[loop_search].score != results[0].score ) )
+            {
+                if ( nb_failed++ < 10 )
+                    printf("reranked search (%f, %f, %f): exhaustive (%f, %f, %f) %f, branch and bound (%f, %f, %f) %f\n", x, y, o, results[0].x, results[0].y,
+                           results[0].orientation, results[0].score, results[loop_search].x, results[loop_search].y, results[loop_search].orientation,
+                           results[loop_search].score);
+            }
+    }
+
+    printf("%s reranked with the ranges: %i searches out of %i differ\n", likelihood ? "likelihood" : "hits", nb_failed, test_searches);
+    return (nb_failed == 0);
+
+}
+
+// the overlay learns furniture moved from the scans of a changed map, its layer is compared with the map rebuilt from the cells of the overlay
+static bool test_overlay(const localization_map& map, bool likelihood, const vector<int8_t>& occupancy)
+{
+
+    // furniture removed and added
+    vector<int8_t> changed_occupancy = occupancy;
+    const int width = map.width_max, height = map.height_max;
+    for (int loop = 0; loop < 100; loop++)
+    {
+        int x = 20 + rand() % ( width - 60 ), y = 20 + rand() % ( height - 60 );
+        int8_t value = ( loop % 2 ) ? 100 : 0;
+        for (int loop_y = y; loop_y < y + 6; loop_y++)
+            for (int loop_x = x; loop_x < x + 6; loop_x++)
+                changed_occupancy[width * loop_y + loop_x] = value;
+    }
+    localization_map changed;
+    changed.load(width, height, map.cell_size, map.min_x, map.min_y, &changed_occupancy[0], 0.05, false);
+
+    // each scan 3 times, so that its hits are sure
+    map_overlay overlay(map);
+    vector<float> r(360), theta(360);
+    bool valid[360];
+    for (int loop = 0; loop < test_scans; loop++)
+    {
+        float x, y;
+        do
+        {
+            x = random_float(map.min_x, map.max_x);
+            y = random_float(map.min_y, map.max_y);
+        }
+        while ( changed.cell_value(x, y) != 0 );
+        for (int loop_beam = 0; loop_beam < 360; loop_beam++)
+        {
+            theta[loop_beam] = loop_beam * M_PI / 180;
+            for (r[loop_beam] = 0; r[loop_beam] < 12; r[loop_beam] += map.cell_size / 2)
+                if ( changed.cell_value(x + r[loop_beam] * cos(theta[loop_beam]), y + r[loop_beam] * sin(theta[loop_beam])) == 100 )
+                    break;
+            valid[loop_beam] = r[loop_beam] < 12;
+        }
+        for (int loop_time = 0; loop_time < 3; loop_time++)
+            overlay.integrate(x, y, 0, 360, &r[0], &theta[0], valid);
+        // a layer published in the middle of the scans, so that the next ones update it
+        if ( loop == test_scans / 2 )
+            overlay.publish();
+    }
+    shared_ptr<const overlay_layer> layer = overlay.publish();
+
+    vector<int8_t> merged_occupancy(width * height);
+    for (int loop_y = 0; loop_y < height; loop_y++)
+        for (int loop_x = 0; loop_x < width; loop_x++)
+            merged_occupancy[width * loop_y + loop_x] = overlay.cell_value(map.min_x + ( loop_x + 0.5 ) * map.cell_size, map.min_y + ( loop_y + 0.5 ) * map.cell_size);
+    localization_map merged;
+    merged.load(width, height, map.cell_size, map.min_x, map.min_y, &merged_occupancy[0], 0.05, likelihood);
+
+    // the distances beyond overlay_distance_radius are not computed again: their likelihood is negligible
+    int nb_failed = 0;
+    const float tolerance = map.likelihood_values()[overlay_distance_radius];
+    for (int loop_y = 0; loop_y < height; loop_y++)
+        for (int loop_x = 0; loop_x < width; loop_x++)
+            if ( ( layer->cell_hit(loop_x, loop_y) != merged.cell_hit(loop_x, loop_y) ) || ( layer->cell_state(loop_x, loop_y) != merged.cell_state(loop_x, loop_y) )
+              || ( fabs(layer->cell_likelihood(loop_x, loop_y) - merged.cell_likelihood(loop_x, loop_y)) > tolerance ) )
+            {
+                if ( nb_failed++ < 10 )
+                    printf("cell (%i, %i): hit %i, merged %i\n", loop_x, loop_y, layer->cell_hit(loop_x, loop_y), merged.cell_hit(loop_x, loop_y));
+            }
+
+    for (int loop_level = 1; loop_level < map.nb_levels(); loop_level++)
+        for (int loop = 0; loop < test_poses; loop++)
+        {
+            int x = rand() % ( width + 200 ) - 150, y = rand() % ( height + 200 ) - 150;
+            bool below = likelihood ? ( layer->level_likelihood(loop_level, x, y) >= merged.level_likelihood(loop_level, x, y) )
+                                    : ( layer->level_hit(loop_level, x, y) || !merged.level_hit(loop_level, x, y) );
+            if ( !below && ( nb_failed++ < 10 ) )
+                printf("bound of level %i at (%i, %i) below the map with the changes\n", loop_level, x, y);
+        }
+
+    printf("%s overlay: %i blocks changed, %i cells or bounds differ\n", likelihood ? "likelihood" : "hits", layer->nb_blocks(), nb_failed);
+    bool passed = ( nb_failed == 0 ) && !layer->empty();
+    if ( scan_matcher::simd_supported() )
+        passed = test_kernels(map, likelihood, layer.get()) && passed;
+
+    return (passed);
+
+}
+
+int main()
+{
+
+    bool passed = true;
+    if ( !scan_matcher::simd_supported() )
+        printf("the processor does not support the vectorized kernels, they are not tested\n");
+    for (int loop = 0; loop < 2; loop++)
+    {
+        localization_map map;
+        vector<int8_t> occupancy;
+        test_map(map, loop == 1, occupancy);
+        if ( scan_matcher::simd_supported() )
+            passed = test_kernels(map, loop == 1, 0) && passed;
+        passed = test_range_score(map, loop == 1) && passed;
+        passed = test_reranked_search(map, loop == 1) && passed;
+        passed = test_overlay(map, loop == 1, occupancy) && passed;
+    }
+
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return ( passed ? 0 : 1 );
+
+}
@@ -0,0 +1,230 @@
+// motion of the robot measured by matching consecutive scans
+#include <scan_odometry.h>
+#include <scan_matcher.h>
+#include <algorithm>
+#include <cmath>
+
+// motion (dx, dy, do) in the frame of the pose (x0, y0, o0) to the pose (x1, y1, o1)
+static void relative_motion(float x0, float y0, float o0, float x1, float y1, float o1, float& dx, float& dy, float& dorientation)
+{
+
+    dx = cos(o0) * ( x1 - x0 ) + sin(o0) * ( y1 - y0 );
+    dy = -sin(o0) * ( x1 - x0 ) + cos(o0) * ( y1 - y0 );
+    dorientation = remainder(o1 - o0, 2 * M_PI);
+
+}
+
+scan_odometry::scan_odometry()
+{
+
+    x = y = orientation = 0;
+    failures = 0;
+    has_previous = false;
+    previous_odom_x = previous_odom_y = previous_odom_orientation = 0;
+
+}
+
+void scan_odometry::scan_points(int nb_beams, const float* r, const float* theta, const bool* valid,
+                                vector<float>& points_x, vector<float>& points_y, vector<float>& normals_x, vector<float>& normals_y)
+{
+
+    vector<float> hit_x, hit_y;
+    for (int loop = 0; loop < nb_beams; loop++)
+        if ( valid[loop] && ( r[loop] > 0 ) )
+        {
+            hit_x.push_back(r[loop] * cos(theta[loop]));
+            hit_y.push_back(r[loop] * sin(theta[loop]));
+        }
+
+    points_x.clear();
+    points_y.clear();
+    normals_x.clear();
+    normals_y.clear();
+    const int nb_hits = hit_x.size();
+    for (int loop = 0; loop < nb_hits; loop++)
+    {
+        // line through the neighbors of the hit in the scan, on the same wall
+        int previous = max(loop - 1, 0), next = min(loop + 1, nb_hits - 1);
+        if ( hypot(hit_x[previous] - hit_x[loop], hit_y[previous] - hit_y[loop]) > icp_neighbor_distance )
+            previous = loop;
+        if ( hypot(hit_x[next] - hit_x[loop], hit_y[next] - hit_y[loop]) > icp_neighbor_distance )
+            next = loop;
+        if ( previous == next )
+            continue;
+
+        float tangent_x = hit_x[next] - hit_x[previous], tangent_y = hit_y[next] - hit_y[previous];
+        float length = hypot(tangent_x, tangent_y);
+        points_x.push_back(hit_x[loop]);
+        points_y.push_back(hit_y[loop]);
+        normals_x.push_back(-tangent_y / length);
+        normals_y.push_back(tangent_x / length);
+    }
+
+}
+
+void scan_odometry::build_tree(vector<int>& order, int begin, int end, int depth) const
+{
+
+    if ( end - begin <= 1 )
+        return;
+
+    const vector<float>& coordinate = ( depth % 2 == 0 ) ? points_x : points_y;
+    int middle = ( begin + end ) / 2;
+    nth_element(order.begin() + begin, order.begin() + middle, order.begin() + end, [&coordinate](int a, int b) { return coordinate[a] < coordinate[b]; });
+    build_tree(order, begin, middle, depth + 1);
+    build_tree(order, middle + 1, end, depth + 1);
+
+}
+
+void scan_odometry::nearest(float x, float y, int begin, int end, int depth, int& best, float& best_distance) const
+{
+
+    if ( begin >= end )
+        return;
+
+    int middle = ( begin + end ) / 2;
+    float distance = ( points_x[middle] - x ) * ( points_x[middle] - x ) + ( points_y[middle] - y ) * ( points_y[middle] - y );
+    if ( distance < best_distance )
+    {
+        best_distance = distance;
+        best = middle;
+    }
+
+    // the side of the query first, the other side only if the splitting line is closer than the best point
+    float split = ( depth % 2 == 0 ) ? x - points_x[middle] : y - points_y[middle];
+    if ( split < 0 )
+    {
+        nearest(x, y, begin, middle, depth + 1, best, best_distance);
+        if ( split * split < best_distance )
+            nearest(x, y, middle + 1, end, depth + 1, best, best_distance);
+    }
+    else
+    {
+        nearest(x, y, middle + 1, end, depth + 1, best, best_distance);
+        if ( split * split < best_distance )
+            nearest(x, y, begin, middle, depth + 1, best, best_distance);
+    }
+
+}
+
+bool scan_odometry::match(const vector<float>& current_x, const vector<float>& current_y, float& dx, float& dy, float& dorientation) const
+{
+
+    const int nb_points = current_x.size();
+    const int nb_previous = points_x.size();
+    if ( ( nb_points < icp_min_pairs ) || ( nb_previous < icp_min_pairs ) )
+        return (false);
+
+    float max_distance = icp_max_distance;
+    int nb_pairs = 0;
+    double error = 0, constraint[2][2];
+    for (int loop_iteration = 0; loop_iteration < icp_iterations; loop_iteration++)
+    {
+        // gauss-newton step on the distances of the points to the lines of their nearest points
+        const float c = cos(dorientation), s = sin(dorientation);
+        double hessian[3][3] = { { 0 } }, minus_gradient[3] = { 0 };
+        constraint[0][0] = constraint[0][1] = constraint[1][1] = 0;
+        nb_pairs = 0;
+        error = 0;
+        for (int loop = 0; loop < nb_points; loop++)
+        {
+            float px = c * current_x[loop] - s * current_y[loop] + dx;
+            float py = s * current_x[loop] + c * current_y[loop] + dy;
+            int paired = -1;
+            float distance = max_distance * max_distance;
+            nearest(px, py, 0, nb_previous, 0, paired, distance);
+            if ( paired < 0 )
+                continue;
+
+            const float nx = normals_x[paired], ny = normals_y[paired];
+            double residual = nx * ( px - points_x[paired] ) + ny * ( py - points_y[paired] );
+            double jacobian[3] = { nx, ny, nx * ( -s * current_x[loop] - c * current_y[loop] ) + ny * ( c * current_x[loop] - s * current_y[loop] ) };
+            for (int loop_row = 0; loop_row < 3; loop_row++)
+            {
+                minus_gradient[loop_row] -= jacobian[loop_row] * residual;
+                for (int loop_column = 0; loop_column < 3; loop_column++)
+                    hessian[loop_row][loop_column] += jacobian[loop_row] * jacobian[loop_column];
+            }
+            constraint[0][0] += nx * nx;
+            constraint[0][1] += nx * ny;
+            constraint[1][1] += ny * ny;
+            error += residual * residual;
+            nb_pairs++;
+        }
+
+        double step[3];
+        if ( ( nb_pairs < icp_min_pairs ) || !solve_3x3(hessian, minus_gradient, step) )
+            return (false);
+        dx += step[0];
+        dy += step[1];
+        dorientation += step[2];
+
+        max_distance = max<float>(max_distance * 0.7, icp_min_distance);
+        if ( ( max_distance == icp_min_distance ) && ( hypot(step[0], step[1]) < 1e-4 ) && ( fabs(step[2]) < 1e-4 ) )
+            break;
+    }
+
+    // smallest eigenvalue of the mean of n n^T: the direction of translation the least constrained by the lines
+    double a = constraint[0][0] / nb_pairs, b = constraint[0][1] / nb_pairs, d = constraint[1][1] / nb_pairs;
+    double smallest = ( a + d ) / 2 - sqrt(( a - d ) * ( a - d ) / 4 + b * b);
+
+    return (( sqrt(error / nb_pairs) < icp_max_error ) && ( smallest > icp_min_constraint ));
+
+}
+
+bool scan_odometry::add_scan(int nb_beams, const float* r, const float* theta, const bool* valid, float odom_x, float odom_y, float odom_orientation)
+{
+
+    vector<float> current_x, current_y, current_normals_x, current_normals_y;
+    scan_points(nb_beams, r, theta, valid, current_x, current_y, current_normals_x, current_normals_y);
+
+    float odom_dx = 0, odom_dy = 0, odom_dorientation = 0;
+    if ( has_previous )
+        relative_motion(previous_odom_x, previous_odom_y, previous_odom_orientation, odom_x, odom_y, odom_orientation, odom_dx, odom_dy, odom_dorientation);
+
+    float dx = odom_dx, dy = odom_dy, dorientation = odom_dorientation;
+    bool matched = has_previous && match(current_x, current_y, dx, dy, dorientation);
+    if ( !matched )
+    {
+        dx = odom_dx;
+        dy = odom_dy;
+        dorientation = odom_dorientation;
+        if ( has_previous )
+            failures++;
+    }
+
+    // the pose integrates the motion, expressed in the frame of the previous pose
+    x += cos(orientation) * dx - sin(orientation) * dy;
+    y += sin(orientation) * dx + cos(orientation) * dy;
+    orientation = remainder(orientation + dorientation, 2 * M_PI);
+
+    // the scan becomes the reference of the next one
+    points_x.swap(current_x);
+    points_y.swap(current_y);
+    normals_x.swap(current_normals_x);
+    normals_y.swap(current_normals_y);
+    vector<int> order(points_x.size());
+    for (size_t loop = 0; loop < order.size(); loop++)
+        order[loop] = loop;
+    build_tree(order, 0, order.size(), 0);
+    vector<float> sorted_x(order.size()), sorted_y(order.size()), sorted_normals_x(order.size()), sorted_normals_y(order.size());
+    for (size_t loop = 0; loop < order.size(); loop++)
+    {
+        sorted_x[loop] = points_x[order[loop]];
+        sorted_y[loop] = points_y[order[loop]];
+        sorted_normals_x[loop] = normals_x[order[loop]];
+        sorted_normals_y[loop] = normals_y[order[loop]];
+    }
+    points_x.swap(sorted_x);
+    points_y.swap(sorted_y);
+    normals_x.swap(sorted_normals_x);
+    normals_y.swap(sorted_normals_y);
+
+    has_previous = true;
+    previous_odom_x = odom_x;
+    previous_odom_y = odom_y;
+    previous_odom_orientation = odom_orientation;
+
+    return (matched);
+
+}
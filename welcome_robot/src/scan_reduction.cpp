@@ -0,0 +1,115 @@
+// reduction of the laser data before the scan matching
+#include <scan_reduction.h>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <stdint.h>
+
+#define nb_normal_buckets 16 // directions of the normals used by the informative selection
+#define neighbor_distance 0.5 // in meters, the normal of a hit is estimated with its neighbors closer than this distance
+
+// beams whose normals are spread over all the directions: the walls of each direction constrain the position
+// along their normal, so the beams are taken evenly from each direction of normal rather than from the longest walls
+static void select_informative(int nb_informative, const vector<float>& x, const vector<float>& y, vector<int>& kept)
+{
+
+    const int nb_kept = kept.size();
+    vector< vector<int> > buckets(nb_normal_buckets);
+    for (int loop = 0; loop < nb_kept; loop++)
+    {
+        // tangent of the wall from the neighbors of the hit in the scan
+        int current = kept[loop];
+        int previous = kept[max(loop - 1, 0)];
+        int next = kept[min(loop + 1, nb_kept - 1)];
+        if ( hypot(x[previous] - x[current], y[previous] - y[current]) > neighbor_distance )
+            previous = current;
+        if ( hypot(x[next] - x[current], y[next] - y[current]) > neighbor_distance )
+            next = current;
+
+        float tangent;
+        if ( previous == next )
+            tangent = atan2(y[current], x[current]) + M_PI / 2; // isolated hit: the beam itself is its normal
+        else
+            tangent = atan2(y[next] - y[previous], x[next] - x[previous]);
+
+        // the normals are undirected
+        float normal = fmod(tangent + M_PI / 2 + 2 * M_PI, M_PI);
+        buckets[min<int>(normal / M_PI * nb_normal_buckets, nb_normal_buckets - 1)].push_back(current);
+    }
+
+    // the beams are shared evenly between the directions, the directions with few beams give their share to the others
+    vector<int> quota(nb_normal_buckets, 0);
+    int nb_selected = 0;
+    while ( nb_selected < min(nb_informative, nb_kept) )
+        for (int loop = 0; ( loop < nb_normal_buckets ) && ( nb_selected < nb_informative ); loop++)
+            if ( quota[loop] < int(buckets[loop].size()) )
+            {
+                quota[loop]++;
+                nb_selected++;
+            }
+
+    // and spread along the walls of each direction
+    kept.clear();
+    for (int loop = 0; loop < nb_normal_buckets; loop++)
+        for (int loop_beam = 0; loop_beam < quota[loop]; loop_beam++)
+            kept.push_back(buckets[loop][size_t(loop_beam) * buckets[loop].size() / quota[loop]]);
+    sort(kept.begin(), kept.end());
+
+}
+
+int reduce_scan(const scan_reduction& reduction, int nb_beams, const float* r, const float* theta, const bool* valid, vector<float>& r_out, vector<float>& theta_out)
+{
+
+    // hits in the frame of the robot
+    vector<float> x(nb_beams), y(nb_beams);
+    for (int loop = 0; loop < nb_beams; loop++)
+    {
+        x[loop] = r[loop] * cos(theta[loop]);
+        y[loop] = r[loop] * sin(theta[loop]);
+    }
+
+    vector<int> kept;
+    kept.reserve(nb_beams);
+    if ( reduction.voxel_size > 0 )
+    {
+        // for each voxel, the beam whose hit is the closest to its center
+        unordered_map<int64_t, int> voxels;
+        for (int loop = 0; loop < nb_beams; loop++)
+        {
+            if ( reduction.drop_invalid && !valid[loop] )
+                continue;
+            float voxel_x = floor(x[loop] / reduction.voxel_size);
+            float voxel_y = floor(y[loop] / reduction.voxel_size);
+            int64_t key = ( int64_t(voxel_x) << 32 ) ^ ( int64_t(voxel_y) & 0xffffffff );
+            float center_x = ( voxel_x + 0.5 ) * reduction.voxel_size;
+            float center_y = ( voxel_y + 0.5 ) * reduction.voxel_size;
+
+            unordered_map<int64_t, int>::iterator voxel = voxels.find(key);
+            if ( voxel == voxels.end() )
+                voxels[key] = loop;
+            else if ( hypot(x[loop] - center_x, y[loop] - center_y) < hypot(x[voxel->second] - center_x, y[voxel->second] - center_y) )
+                voxel->second = loop;
+        }
+        for (unordered_map<int64_t, int>::iterator voxel = voxels.begin(); voxel != voxels.end(); voxel++)
+            kept.push_back(voxel->second);
+        sort(kept.begin(), kept.end());
+    }
+    else
+        for (int loop = 0; loop < nb_beams; loop++)
+            if ( !reduction.drop_invalid || valid[loop] )
+                kept.push_back(loop);
+
+    if ( ( reduction.nb_informative > 0 ) && ( int(kept.size()) > reduction.nb_informative ) )
+        select_informative(reduction.nb_informative, x, y, kept);
+
+    r_out.resize(kept.size());
+    theta_out.resize(kept.size());
+    for (size_t loop = 0; loop < kept.size(); loop++)
+    {
+        r_out[loop] = r[kept[loop]];
+        theta_out[loop] = theta[kept[loop]];
+    }
+
+    return (kept.size());
+
+}
@@ -0,0 +1,142 @@
+// pool of threads with one queue of jobs per thread, the idle threads steal the jobs of the others
+#include <work_stealing_pool.h>
+
+// pool and index of the thread running the current job, so that a job submitted by a job stays on its thread
+static thread_local const work_stealing_pool* current_pool = nullptr;
+static thread_local int current_index = -1;
+
+work_stealing_pool::work_stealing_pool(int nb_threads)
+    : stop(false), nb_queued(0), nb_pending(0), next_queue(0), stolen(0)
+{
+
+    if ( nb_threads <= 0 )
+        nb_threads = max(1u, thread::hardware_concurrency());
+
+    for (int loop = 0; loop < nb_threads; loop++)
+        queues.push_back(unique_ptr<job_queue>(new job_queue()));
+    for (int loop = 0; loop < nb_threads; loop++)
+        threads.push_back(thread(&work_stealing_pool::run, this, loop));
+
+}
+
+work_stealing_pool::~work_stealing_pool()
+{
+
+    wait_idle();
+    {
+        lock_guard<mutex> lock(sleep_lock);
+        stop = true;
+    }
+    wake.notify_all();
+    for (thread& current : threads)
+        current.join();
+
+}
+
+void work_stealing_pool::submit(function<void()> job)
+{
+
+    int index = ( current_pool == this ) ? current_index : next_queue++ % queues.size();
+    nb_pending++;
+    {
+        lock_guard<mutex> lock(queues[index]->lock);
+        queues[index]->jobs.push_back(move(job));
+    }
+
+    // the lock makes sure that a thread going to sleep sees the job or is woken up
+    {
+        lock_guard<mutex> lock(sleep_lock);
+        nb_queued++;
+    }
+    wake.notify_one();
+
+}
+
+void work_stealing_pool::wait_idle()
+{
+
+    unique_lock<mutex> lock(sleep_lock);
+    idle.wait(lock, [this] { return nb_pending == 0; });
+
+}
+
+void work_stealing_pool::wait_until(const function<bool()>& done)
+{
+    // a thread out of the pool has no queue: it only waits
+
+    const bool in_pool = current_pool == this;
+    function<void()> job;
+    while ( !done() )
+        if ( in_pool && take(current_index, false, job) )
+            run_job(job);
+        else
+            this_thread::yield();
+
+}
+
+bool work_stealing_pool::take(int index, bool steal, function<void()>& job)
+{
+    // the newest job of the thread, or else the oldest job of the next threads
+
+    const int nb_queues = steal ? queues.size() : 1;
+    for (int loop = 0; loop < nb_queues; loop++)
+    {
+        job_queue& queue = *queues[( index + loop ) % nb_queues];
+        lock_guard<mutex> lock(queue.lock);
+        if ( queue.jobs.empty() )
+            continue;
+
+        if ( loop == 0 )
+        {
+            job = move(queue.jobs.back());
+            queue.jobs.pop_back();
+        }
+        else
+        {
+            job = move(queue.jobs.front());
+            queue.jobs.pop_front();
+            stolen++;
+        }
+        nb_queued--;
+        return (true);
+    }
+
+    return (false);
+
+}
+
+void work_stealing_pool::run_job(function<void()>& job)
+{
+
+    job();
+    job = nullptr;
+    if ( --nb_pending == 0 )
+    {
+        lock_guard<mutex> lock(sleep_lock);
+        idle.notify_all();
+    }
+
+}
+
+void work_stealing_pool::run(int index)
+{
+
+    current_pool = this;
+    current_index = index;
+
+    function<void()> job;
+    while ( true )
+    {
+        if ( take(index, true, job) )
+        {
+            run_job(job);
+            continue;
+        }
+
+        unique_lock<mutex> lock(sleep_lock);
+        wake.wait(lock, [this] { return stop || ( nb_queued > 0 ); });
+        if ( stop && ( nb_queued == 0 ) )
+            return;
+    }
+
+}